@@ -8,12 +8,25 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <stdio.h>
+#include <errno.h>
 #endif
 #include <string>
 
 using namespace PaintsNow;
 
+// fseek takes a long offset, which is 32 bit on Windows and 32-bit Linux.
+static bool SeekFile(FILE* fp, int64_t offset, int origin) {
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+	return fseek(fp, safe_cast<long>(offset), origin) == 0;
+#elif defined(_WIN32) || defined(WIN32)
+	return _fseeki64(fp, offset, origin) == 0;
+#else
+	return fseeko(fp, (off_t)offset, origin) == 0;
+#endif
+}
+
 class FileStream : public IStreamBase {
 public:
 	FileStream(FILE* p, rvalue<String> path) : fp(p), filePath(std::move(path)) {
@@ -38,6 +51,61 @@ public:
 		return (len = fwrite(p, 1, len, fp)) != 0;
 	}
 
+	bool WriteV(const IoVec* vectors, size_t count, size_t& len) override {
+#if defined(_WIN32) || defined(WIN32)
+		return IStreamBase::WriteV(vectors, count, len);
+#else
+		// bypass stdio buffer, so flush it first and resync its position after writing.
+		len = 0;
+		if (fflush(fp) != 0) {
+			return false;
+		}
+
+		const size_t BATCH = 64;
+		struct iovec iov[BATCH];
+		int fd = fileno(fp);
+		size_t i = 0, skip = 0;
+		while (i < count) {
+			// empty vectors are left out, writev() would return 0 for them as if nothing could be written
+			size_t n = 0;
+			for (size_t k = i; k < count && n < BATCH; k++) {
+				size_t s = k == i ? skip : 0;
+				if (vectors[k].length != s) {
+					iov[n].iov_base = reinterpret_cast<uint8_t*>(vectors[k].base) + s;
+					iov[n].iov_len = vectors[k].length - s;
+					n++;
+				}
+			}
+
+			if (n == 0) {
+				i = count;
+				break;
+			}
+
+			ssize_t r = ::writev(fd, iov, (int)n);
+			if (r < 0 && errno == EINTR) {
+				continue;
+			} else if (r <= 0) {
+				break;
+			}
+
+			// advance over completed vectors, partial writes are possible
+			size_t w = (size_t)r;
+			len += w;
+			while (i < count && w >= vectors[i].length - skip) {
+				w -= vectors[i].length - skip;
+				skip = 0;
+				i++;
+			}
+
+			skip += w;
+		}
+
+		SeekFile(fp, (int64_t)lseek(fd, 0, SEEK_CUR), SEEK_SET);
+		return i == count;
+#endif
+	}
+
 	bool Seek(SEEK_OPTION option, int64_t offset) override {
 		int s = SEEK_CUR;
 		switch (option) {
@@ -52,7 +120,7 @@ public:
 			break;
 		}
 
-		return fseek(fp, (long)offset, s) == 0;
+		return SeekFile(fp, offset, s);
 	}
 
 	bool Truncate(uint64_t length) override {
@@ -79,7 +147,7 @@ public:
 	}
 
 	bool WriteDummy(size_t& len) override {
-		return fseek(fp, (long)len, SEEK_CUR) == 0;
+		return SeekFile(fp, (int64_t)len, SEEK_CUR);
 	}
 
 	long GetOffset() const {
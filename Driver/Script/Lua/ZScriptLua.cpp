@@ -754,7 +754,10 @@ inline void byteswrite(lua_State* L, const Bytes& v) {
 inline Bytes bytesget(lua_State* L, int index) {
 	size_t length;
 	const char* ptr = lua_tolstring(L, index, &length);
-	return Bytes((const uint8_t*)ptr, length);
+	// payloads of requests are usually passed on to other warps by copy
+	Bytes bytes((const uint8_t*)ptr, length);
+	bytes.Share();
+	return bytes;
 }
 
 IScript::Request& ZScriptLua::Request::operator << (const Bytes& v) {
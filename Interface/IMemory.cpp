@@ -1,11 +1,98 @@
 #include "IMemory.h"
+#include "../Template/TAllocator.h"
 #ifdef _WIN32
 #include <windows.h>
 #include <tlhelp32.h>
+#else
+#include <sys/mman.h>
 #endif
 
 using namespace PaintsNow;
 
+#ifdef _WIN32
+void* IMemory::MapVirtual(size_t size, size_t alignment, PAGE_TYPE type) {
+	// Large pages on windows require SeLockMemoryPrivilege, just use default pages.
+	while (true) {
+		// reserve a larger range to find an aligned address, then release and map it again.
+		uint8_t* address = reinterpret_cast<uint8_t*>(::VirtualAlloc(nullptr, size + alignment, MEM_RESERVE, PAGE_NOACCESS));
+		if (address == nullptr) return nullptr;
+
+		::VirtualFree(address, 0, MEM_RELEASE);
+		uint8_t* aligned = reinterpret_cast<uint8_t*>(((size_t)address + alignment - 1) & ~(alignment - 1));
+		void* result = ::VirtualAlloc(aligned, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (result != nullptr) {
+			return result;
+		}
+
+		// someone else takes the range, retry
+	}
+}
+
+void IMemory::UnmapVirtual(void* address, size_t size) {
+	::VirtualFree(address, 0, MEM_RELEASE);
+}
+
+bool IMemory::CommitVirtual(void* address, size_t size) {
+	return ::VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+}
+
+void IMemory::DecommitVirtual(void* address, size_t size) {
+	::VirtualFree(address, size, MEM_DECOMMIT);
+}
+#else
+static uint8_t* MapAligned(size_t size, size_t alignment, int flags) {
+	uint8_t* address = reinterpret_cast<uint8_t*>(::mmap(nullptr, size + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0));
+	if (address == reinterpret_cast<uint8_t*>(MAP_FAILED)) return nullptr;
+
+	// trim unaligned head and tail
+	uint8_t* aligned = reinterpret_cast<uint8_t*>(((size_t)address + alignment - 1) & ~(alignment - 1));
+	if (aligned != address) {
+		::munmap(address, aligned - address);
+	}
+
+	if (aligned + size != address + size + alignment) {
+		::munmap(aligned + size, address + alignment - aligned);
+	}
+
+	return aligned;
+}
+
+void* IMemory::MapVirtual(size_t size, size_t alignment, PAGE_TYPE type) {
+	uint8_t* address = nullptr;
+#ifdef MAP_HUGETLB
+	// explicit huge pages are taken from a preallocated pool, fallback to transparent huge pages if it is exhausted.
+	if (type == PAGE_HUGE && size % HUGE_PAGE_SIZE == 0 && alignment % HUGE_PAGE_SIZE == 0) {
+		address = MapAligned(size, alignment, MAP_HUGETLB);
+	}
+#endif
+
+	if (address == nullptr) {
+		address = MapAligned(size, alignment, 0);
+#ifdef MADV_HUGEPAGE
+		if (address != nullptr && type != PAGE_DEFAULT) {
+			::madvise(address, size, MADV_HUGEPAGE);
+		}
+#endif
+	}
+
+	return address;
+}
+
+void IMemory::UnmapVirtual(void* address, size_t size) {
+	::munmap(address, size);
+}
+
+bool IMemory::CommitVirtual(void*, size_t) {
+	// anonymous pages are committed on demand
+	return true;
+}
+
+void IMemory::DecommitVirtual(void* address, size_t size) {
+	// pages are zero-filled on next access. may fail on hugetlb ranges that are not huge page aligned, then they just stay resident.
+	::madvise(address, size, MADV_DONTNEED);
+}
+#endif
+
 void IMemory::SetHardwareBreakpoint(void* address, size_t length, BREAK_TYPE type, size_t slot) {
 #ifdef _WIN32
 	assert(slot < 4);
@@ -54,3 +141,227 @@ void IMemory::SetHardwareBreakpoint(void* address, size_t length, BREAK_TYPE typ
 	}
 #endif
 }
+
+// General purpose allocator.
+// All states are constructed in static storages and never destructed, since blocks may be freed during static destruction.
+template <size_t N, size_t K>
+class TImmortalRootAllocator : public TRootAllocator<N, K> {
+public:
+	static TImmortalRootAllocator& Get() {
+		alignas(CPU_CACHELINE_SIZE) static uint8_t storage[sizeof(TImmortalRootAllocator)];
+		static TImmortalRootAllocator* allocator = new (storage) TImmortalRootAllocator();
+		return *allocator;
+	}
+};
+
+class pure_interface SizeClass {
+public:
+	virtual ~SizeClass() {}
+	virtual void* Allocate() = 0;
+	virtual void Deallocate(void* p) = 0;
+};
+
+// Blocks contain at least 16 elements and root spans are about 4 MB.
+template <size_t K>
+class TSizeClass : public SizeClass {
+public:
+	enum {
+		M = K * 16 > 65536 ? Math::TRoundUpPowerOfTwo<K * 16>::value : 65536,
+		S = 4 * 1024 * 1024 / M - 1
+	};
+
+	typedef TAllocator<K, M, 8, S, TImmortalRootAllocator<M, S> > Allocator;
+
+	void* Allocate() override {
+		return allocator.Allocate();
+	}
+
+	void Deallocate(void* p) override {
+		Allocator::Deallocate(p);
+	}
+
+protected:
+	Allocator allocator;
+};
+
+// 16 bytes step up to 128 bytes, then 4 classes for each power of two.
+enum { SIZE_CLASS_COUNT = 40, SIZE_CLASS_ALIGNMENT = 16 };
+
+template <size_t I, bool Small = (I < 8)>
+struct TSizeClassSize {
+	enum { value = SIZE_CLASS_ALIGNMENT * (I + 1) };
+};
+
+template <size_t I>
+struct TSizeClassSize<I, false> {
+	enum { value = ((size_t)1 << (7 + (I - 8) / 4)) + (((I - 8) % 4 + 1) << (5 + (I - 8) / 4)) };
+};
+
+template <size_t I>
+struct TSizeClassCreator {
+	static void Create(SizeClass** sizeClasses, size_t* sizes) {
+		typedef TSizeClass<TSizeClassSize<I>::value> Class;
+		alignas(CPU_CACHELINE_SIZE) static uint8_t storage[sizeof(Class)];
+		sizeClasses[I] = new (storage) Class();
+		sizes[I] = TSizeClassSize<I>::value;
+
+		TSizeClassCreator<I + 1>::Create(sizeClasses, sizes);
+	}
+};
+
+template <>
+struct TSizeClassCreator<SIZE_CLASS_COUNT> {
+	static void Create(SizeClass**, size_t*) {}
+};
+
+// Set while constructing the allocator on this thread. Allocations from global operator new are redirected to system heap then.
+static thread_local bool genericInitializing = false;
+
+class GenericAllocator {
+public:
+	GenericAllocator() {
+		static_assert((size_t)TSizeClassSize<SIZE_CLASS_COUNT - 1>::value == (size_t)IMemory::MAX_CACHED_SIZE, "Size classes mismatch.");
+		genericInitializing = true;
+		TSizeClassCreator<0>::Create(sizeClasses, sizes);
+		genericInitializing = false;
+
+		size_t k = 0;
+		for (size_t i = 0; i <= IMemory::MAX_CACHED_SIZE / SIZE_CLASS_ALIGNMENT; i++) {
+			while (sizes[k] < i * SIZE_CLASS_ALIGNMENT) {
+				k++;
+			}
+
+			indices[i] = (uint8_t)k;
+		}
+	}
+
+	static GenericAllocator& Get() {
+		alignas(CPU_CACHELINE_SIZE) static uint8_t storage[sizeof(GenericAllocator)];
+		static GenericAllocator* allocator = new (storage) GenericAllocator();
+		return *allocator;
+	}
+
+	inline SizeClass* operator [] (size_t size) {
+		assert(size <= IMemory::MAX_CACHED_SIZE);
+		return sizeClasses[indices[(size + SIZE_CLASS_ALIGNMENT - 1) / SIZE_CLASS_ALIGNMENT]];
+	}
+
+	SizeClass* sizeClasses[SIZE_CLASS_COUNT];
+	size_t sizes[SIZE_CLASS_COUNT];
+	uint8_t indices[IMemory::MAX_CACHED_SIZE / SIZE_CLASS_ALIGNMENT + 1];
+};
+
+class GenericThreadCache {
+public:
+	GenericThreadCache(bool cached) {
+		GenericAllocator& allocator = GenericAllocator::Get();
+		indices = allocator.indices;
+
+		for (size_t i = 0; i < SIZE_CLASS_COUNT; i++) {
+			// about 64 KB at most for each size class
+			magazines[i].Attach(allocator.sizeClasses[i], cached ? Math::Clamp(65536 / allocator.sizes[i], (size_t)2, (size_t)64) : 0);
+		}
+	}
+
+	inline TMagazine<SizeClass, 64>& operator [] (size_t size) {
+		assert(size <= IMemory::MAX_CACHED_SIZE);
+		return magazines[indices[(size + SIZE_CLASS_ALIGNMENT - 1) / SIZE_CLASS_ALIGNMENT]];
+	}
+
+protected:
+	const uint8_t* indices;
+	TMagazine<SizeClass, 64> magazines[SIZE_CLASS_COUNT];
+};
+
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+// VC6 does not support thread_local objects, use pass-through magazines (no caching) instead.
+static GenericThreadCache& GetGenericThreadCache() {
+	static GenericThreadCache threadCache(false);
+	return threadCache;
+}
+
+static inline bool IsGenericThreadCacheDestroyed() {
+	return false;
+}
+#else
+// Trivially destructible, so it is still valid when blocks are allocated or freed after the cache is destroyed in thread or static teardown.
+static thread_local bool genericThreadCacheDestroyed = false;
+
+class ThreadGenericThreadCache : public GenericThreadCache {
+public:
+	ThreadGenericThreadCache() : GenericThreadCache(true) {}
+	~ThreadGenericThreadCache() {
+		// magazines are drained after this, which never reenters the cache
+		genericThreadCacheDestroyed = true;
+	}
+};
+
+static thread_local ThreadGenericThreadCache genericThreadCache;
+static inline GenericThreadCache& GetGenericThreadCache() {
+	return genericThreadCache;
+}
+
+static inline bool IsGenericThreadCacheDestroyed() {
+	return genericThreadCacheDestroyed;
+}
+#endif
+
+static inline size_t GetMappedSize(size_t size) {
+	return (size + IMemory::DEFAULT_PAGE_SIZE - 1) & ~(size_t)(IMemory::DEFAULT_PAGE_SIZE - 1);
+}
+
+void* IMemory::Alloc(size_t size) {
+	if (size <= MAX_CACHED_SIZE) {
+		// go to shared size classes directly once the thread cache is gone
+		return IsGenericThreadCacheDestroyed() ? GenericAllocator::Get()[size]->Allocate() : GetGenericThreadCache()[size].Allocate();
+	} else {
+		return MapVirtual(GetMappedSize(size), DEFAULT_PAGE_SIZE);
+	}
+}
+
+void IMemory::Free(void* address, size_t size) {
+	if (size <= MAX_CACHED_SIZE) {
+		if (IsGenericThreadCacheDestroyed()) {
+			GenericAllocator::Get()[size]->Deallocate(address);
+		} else {
+			GetGenericThreadCache()[size].Deallocate(address);
+		}
+	} else {
+		UnmapVirtual(address, GetMappedSize(size));
+	}
+}
+
+struct UnsizedHeader {
+	size_t size;
+	size_t system;
+};
+
+void* IMemory::AllocUnsized(size_t size) {
+	static_assert(sizeof(UnsizedHeader) == SIZE_CLASS_ALIGNMENT || sizeof(UnsizedHeader) * 2 == SIZE_CLASS_ALIGNMENT, "Invalid header size.");
+	UnsizedHeader* header = genericInitializing ? nullptr : reinterpret_cast<UnsizedHeader*>(Alloc(size + SIZE_CLASS_ALIGNMENT));
+	if (header != nullptr) {
+		header->system = 0;
+	} else {
+		// redirected to system heap while initializing, or fall back to it if our arenas can not be mapped
+		header = reinterpret_cast<UnsizedHeader*>(AllocAligned(size + SIZE_CLASS_ALIGNMENT, SIZE_CLASS_ALIGNMENT));
+		if (header == nullptr) {
+			return nullptr;
+		}
+
+		header->system = 1;
+	}
+
+	header->size = size;
+	return reinterpret_cast<uint8_t*>(header) + SIZE_CLASS_ALIGNMENT;
+}
+
+void IMemory::FreeUnsized(void* address) {
+	if (address == nullptr) return;
+
+	UnsizedHeader* header = reinterpret_cast<UnsizedHeader*>(reinterpret_cast<uint8_t*>(address) - SIZE_CLASS_ALIGNMENT);
+	if (header->system) {
+		FreeAligned(header);
+	} else {
+		Free(header, header->size + SIZE_CLASS_ALIGNMENT);
+	}
+}
@@ -98,8 +98,97 @@ namespace PaintsNow {
 #endif
 		}
 
+		// Virtual memory arenas. MapVirtual reserves and commits an aligned region, DecommitVirtual releases
+		// physical pages of a sub range but keeps the address reservation, CommitVirtual makes it usable again.
+		enum PAGE_TYPE { PAGE_DEFAULT, PAGE_TRANSPARENT_HUGE, PAGE_HUGE };
+		enum { DEFAULT_PAGE_SIZE = 4096, HUGE_PAGE_SIZE = 2 * 1024 * 1024 };
+		void* MapVirtual(size_t size, size_t alignment, PAGE_TYPE type = PAGE_DEFAULT);
+		void UnmapVirtual(void* address, size_t size);
+		bool CommitVirtual(void* address, size_t size);
+		void DecommitVirtual(void* address, size_t size);
+
+		// General purpose allocator with thread-local caches, 16 bytes aligned.
+		// Sizes up to MAX_CACHED_SIZE are served by TAllocator size classes, larger ones are mapped directly. Returns nullptr if out of memory.
+		enum { MAX_CACHED_SIZE = 32768 };
+		void* Alloc(size_t size);
+		void Free(void* address, size_t size);
+
+		// Same as above but keeps size in a header, so they can replace global operator new/delete. Falls back to system heap if out of memory.
+		void* AllocUnsized(size_t size);
+		void FreeUnsized(void* address);
+
 		enum BREAK_TYPE { EXECUTE, READWRITE, WRITE };
 		void SetHardwareBreakpoint(void* address, size_t length, BREAK_TYPE type, size_t slot);
 	};
+
+	// STL allocator for IMemory::Alloc
+	template <class T>
+	struct TMemoryAllocator {
+		typedef T value_type;
+		typedef T* pointer;
+		typedef const T* const_pointer;
+		typedef T& reference;
+		typedef const T& const_reference;
+		typedef size_t size_type;
+		typedef ptrdiff_t difference_type;
+		template <class M>
+		struct rebind { typedef TMemoryAllocator<M> other; };
+		typedef std::true_type is_always_equal;
+
+		TMemoryAllocator() {}
+		TMemoryAllocator(const TMemoryAllocator& al) {}
+		template <class M>
+		TMemoryAllocator(const TMemoryAllocator<M>& rhs) {}
+
+		template <class M>
+		bool operator == (const TMemoryAllocator<M>& rhs) const {
+			return true;
+		}
+
+		template <class M>
+		bool operator != (const TMemoryAllocator<M>& rhs) const {
+			return false;
+		}
+
+		pointer address(reference x) const {
+			return &x;
+		};
+
+		const_pointer address(const_reference x) const {
+			return &x;
+		}
+
+		size_type max_size() const {
+			return ~(size_type)0 / sizeof(T);
+		}
+
+		void construct(pointer p) {
+			new ((void*)p) T();
+		}
+
+		void construct(pointer p, const_reference val) {
+			new ((void*)p) T(val);
+		}
+
+#if !defined(_MSC_VER) || _MSC_VER > 1200
+		template <class M, class... Args>
+		void construct(M* p, Args&&... args) {
+			new ((void*)p) M(std::forward<Args>(args)...);
+		}
+#endif
+		template <class M>
+		void destroy(M* p) {
+			((M*)p)->~M();
+		}
+
+		forceinline pointer allocate(size_type n, const void* hint = nullptr) {
+			static_assert(alignof(T) <= 16, "IMemory::Alloc only guarantees 16 bytes alignment.");
+			return reinterpret_cast<pointer>(IMemory::Alloc(n * sizeof(T)));
+		}
+
+		forceinline void deallocate(T* p, size_t n) {
+			IMemory::Free(p, n * sizeof(T));
+		}
+	};
 }
 
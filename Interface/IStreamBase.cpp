@@ -31,11 +31,25 @@ inline bool WriteBaseObject(IStreamBase& stream, Unique typeID, Unique refTypeID
 		}
 	} else if (typeID == byteBufferType) {
 		Bytes* buffer = reinterpret_cast<Bytes*>(ptr);
-		size_t size = buffer->GetSize();
+		size_t size = buffer->GetViewSize();
 		if (stream << size) {
 			if (size != 0) {
-				if (!stream.WriteBlock(buffer->GetData(), size)) {
-					result = false;
+				if (!buffer->IsViewStorage()) {
+					if (!stream.WriteBlock(buffer->GetData(), size)) {
+						result = false;
+					}
+				} else {
+					// write view chains in place
+					Bytes::Segments segments(*buffer);
+					IoVec vectors[16];
+					size_t count;
+					while ((count = segments.Export(vectors, sizeof(vectors) / sizeof(vectors[0]))) != 0) {
+						size_t len;
+						if (!stream.WriteV(vectors, count, len)) {
+							result = false;
+							break;
+						}
+					}
 				}
 			}
 		} else {
@@ -101,6 +115,9 @@ inline bool ReadBaseObject(IStreamBase& stream, Unique typeID, Unique refTypeID,
 					if (!stream.ReadBlock(buffer->GetData(), s)) {
 						result = false;
 					}
+
+					// loaded payloads are copied around far more often than written
+					buffer->Share();
 				}
 			} else {
 				result = false;
@@ -270,6 +287,22 @@ bool IStreamBase::Truncate(uint64_t length) {
 	return false; // not supported
 }
 
+bool IStreamBase::WriteV(const IoVec* vectors, size_t count, size_t& len) {
+	// fallback to segment by segment writes
+	len = 0;
+	for (size_t i = 0; i < count; i++) {
+		size_t n = vectors[i].length;
+		bool success = n == 0 || Write(vectors[i].base, n);
+		len += n;
+
+		if (!success || n != vectors[i].length) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 IStreamBase& IStreamBase::GetBaseStream() {
 	return *this;
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include "IReflect.h"
 #include "../PaintsNow.h"
+#include "../Template/TBuffer.h"
 #include <map>
 #include <list>
 #include <stack>
@@ -15,6 +16,8 @@ namespace PaintsNow {
 		virtual void Flush() = 0;
 		virtual bool Read(void* p, size_t& len) = 0;
 		virtual bool Write(const void* p, size_t& len) = 0;
+		// Vectored write, len receives total bytes written. Returns true if all vectors are written.
+		virtual bool WriteV(const IoVec* vectors, size_t count, size_t& len);
 		virtual bool Transfer(IStreamBase& stream, size_t& len) = 0;
 		virtual bool WriteDummy(size_t& len) = 0;
 		enum SEEK_OPTION { BEGIN, CUR, END };
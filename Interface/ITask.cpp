@@ -2,29 +2,102 @@
 #include "../Template/TAllocator.h"
 using namespace PaintsNow;
 
-static TAllocator<64>* globalTaskAllocator64;
-static TAllocator<128>* globalTaskAllocator128;
-static TAllocator<256>* globalTaskAllocator256;
-static TAllocator<512>* globalTaskAllocator512;
+typedef TAllocator<64> TaskAllocator64;
+typedef TAllocator<128> TaskAllocator128;
+typedef TAllocator<256> TaskAllocator256;
+typedef TAllocator<512> TaskAllocator512;
+typedef TAllocator<1024, 32768> TaskAllocator1024;
+typedef TAllocator<2048, 32768> TaskAllocator2048;
+typedef TAllocator<4096, 32768> TaskAllocator4096;
+
+static TaskAllocator64* globalTaskAllocator64;
+static TaskAllocator128* globalTaskAllocator128;
+static TaskAllocator256* globalTaskAllocator256;
+static TaskAllocator512* globalTaskAllocator512;
+static TaskAllocator1024* globalTaskAllocator1024;
+static TaskAllocator2048* globalTaskAllocator2048;
+static TaskAllocator4096* globalTaskAllocator4096;
+
+template <class T>
+static inline void CreateTaskAllocator(T*& allocator) {
+	allocator = new T();
+	allocator->GetRootAllocator().Pin(allocator);
+	allocator->ReleaseObject();
+}
 
 class TaskInitializer {
 public:
 	TaskInitializer() {
-		globalTaskAllocator64 = new TAllocator<64>();
-		globalTaskAllocator64->GetRootAllocator().Pin(globalTaskAllocator64);
-		globalTaskAllocator64->ReleaseObject();
-		globalTaskAllocator128 = new TAllocator<128>();
-		globalTaskAllocator128->GetRootAllocator().Pin(globalTaskAllocator128);
-		globalTaskAllocator128->ReleaseObject();
-		globalTaskAllocator256 = new TAllocator<256>();
-		globalTaskAllocator256->GetRootAllocator().Pin(globalTaskAllocator256);
-		globalTaskAllocator256->ReleaseObject();
-		globalTaskAllocator512 = new TAllocator<512>();
-		globalTaskAllocator512->GetRootAllocator().Pin(globalTaskAllocator512);
-		globalTaskAllocator512->ReleaseObject();
+		CreateTaskAllocator(globalTaskAllocator64);
+		CreateTaskAllocator(globalTaskAllocator128);
+		CreateTaskAllocator(globalTaskAllocator256);
+		CreateTaskAllocator(globalTaskAllocator512);
+		CreateTaskAllocator(globalTaskAllocator1024);
+		CreateTaskAllocator(globalTaskAllocator2048);
+		CreateTaskAllocator(globalTaskAllocator4096);
 	}
 };
 
+// Per-thread magazines in front of global task allocators.
+// Most tasks are allocated and freed on worker threads, so the common path is free of atomics.
+class TaskMagazines {
+public:
+	TaskMagazines(size_t cached) :
+		// make sure that global allocators are created before magazines
+		magazine64((TSingleton<TaskInitializer>::Get(), globalTaskAllocator64), cached),
+		magazine128(globalTaskAllocator128, cached),
+		magazine256(globalTaskAllocator256, cached / 2),
+		magazine512(globalTaskAllocator512, cached / 2),
+		magazine1024(globalTaskAllocator1024, cached / 4),
+		magazine2048(globalTaskAllocator2048, cached / 4),
+		magazine4096(globalTaskAllocator4096, cached / 8) {}
+
+	TMagazine<TaskAllocator64, 64> magazine64;
+	TMagazine<TaskAllocator128, 64> magazine128;
+	TMagazine<TaskAllocator256, 32> magazine256;
+	TMagazine<TaskAllocator512, 32> magazine512;
+	TMagazine<TaskAllocator1024, 16> magazine1024;
+	TMagazine<TaskAllocator2048, 16> magazine2048;
+	TMagazine<TaskAllocator4096, 8> magazine4096;
+};
+
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+// VC6 does not support thread_local objects, use pass-through magazines (no caching) instead.
+static TaskMagazines& GetTaskMagazines() {
+	static TaskMagazines magazines(0);
+	return magazines;
+}
+#else
+// Trivially destructible, so it is still valid when tasks are allocated or freed after the magazines are destroyed in thread teardown.
+static thread_local bool taskMagazinesDestroyed = false;
+
+class ThreadTaskMagazines : public TaskMagazines {
+public:
+	ThreadTaskMagazines() : TaskMagazines(64) {}
+	~ThreadTaskMagazines() {
+		// magazines are drained after this, which never reenters them
+		taskMagazinesDestroyed = true;
+	}
+};
+
+static thread_local ThreadTaskMagazines taskMagazines;
+static inline TaskMagazines& GetTaskMagazines() {
+	if (!taskMagazinesDestroyed) {
+		return taskMagazines;
+	}
+
+	// pass-through magazines keep no state, so all threads can share them. Never destroyed.
+	static TaskMagazines* sharedMagazines = new TaskMagazines(0);
+	return *sharedMagazines;
+}
+#endif
+
+// 0 for [1, 64], 1 for [65, 128], ..., 6 for [2049, 4096]
+static inline size_t GetTaskSizeClass(size_t size) {
+	assert(size != 0);
+	return size <= 64 ? 0 : Math::Log2(Math::AlignmentTop(size - 1)) - 5;
+}
+
 ITask::ITask() : next(nullptr) {
 	queued = 0;
 	std::atomic_thread_fence(std::memory_order_release);
@@ -33,48 +106,52 @@ ITask::ITask() : next(nullptr) {
 ITask::~ITask() {}
 
 void* ITask::Allocate(size_t size) {
-	TSingleton<TaskInitializer>::Get();
+	TaskMagazines& magazines = GetTaskMagazines();
 
-	switch ((size + 63) / 64)
-	{
+	switch (GetTaskSizeClass(size)) {
 	case 0:
-		assert(false);
+		return magazines.magazine64.Allocate();
 	case 1:
-		return globalTaskAllocator64->Allocate();
+		return magazines.magazine128.Allocate();
 	case 2:
-		return globalTaskAllocator128->Allocate();
+		return magazines.magazine256.Allocate();
 	case 3:
+		return magazines.magazine512.Allocate();
 	case 4:
-		return globalTaskAllocator256->Allocate();
+		return magazines.magazine1024.Allocate();
 	case 5:
+		return magazines.magazine2048.Allocate();
 	case 6:
-	case 7:
-	case 8:
-		return globalTaskAllocator512->Allocate();
+		return magazines.magazine4096.Allocate();
 	default:
 		return ::operator new (size);
 	}
 }
 
 void ITask::Deallocate(void* p, size_t size) {
-	switch ((size + 63) / 64) {
+	TaskMagazines& magazines = GetTaskMagazines();
+
+	switch (GetTaskSizeClass(size)) {
 	case 0:
-		assert(false);
+		magazines.magazine64.Deallocate(p);
+		break;
 	case 1:
-		globalTaskAllocator64->Deallocate(p);
+		magazines.magazine128.Deallocate(p);
 		break;
 	case 2:
-		globalTaskAllocator128->Deallocate(p);
+		magazines.magazine256.Deallocate(p);
 		break;
 	case 3:
+		magazines.magazine512.Deallocate(p);
+		break;
 	case 4:
-		globalTaskAllocator256->Deallocate(p);
+		magazines.magazine1024.Deallocate(p);
 		break;
 	case 5:
+		magazines.magazine2048.Deallocate(p);
+		break;
 	case 6:
-	case 7:
-	case 8:
-		globalTaskAllocator512->Deallocate(p);
+		magazines.magazine4096.Deallocate(p);
 		break;
 	default:
 		::operator delete (p);
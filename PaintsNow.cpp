@@ -1,6 +1,27 @@
 #include "PaintsNow.h"
 
 #if !defined(_MSC_VER) || _MSC_VER > 1200
+#ifdef USE_MEMORY_ALLOCATOR
+#include "Interface/IMemory.h"
+
+// Replace global operator new/delete with thread-caching allocator
+void* operator new (size_t size) {
+	return PaintsNow::IMemory::AllocUnsized(size);
+}
+
+void operator delete (void* ptr) {
+	PaintsNow::IMemory::FreeUnsized(ptr);
+}
+
+void* operator new[](size_t size) {
+	return PaintsNow::IMemory::AllocUnsized(size);
+}
+
+void operator delete[](void* ptr) {
+	PaintsNow::IMemory::FreeUnsized(ptr);
+}
+
+#else
 #include <malloc.h>
 #include <stdlib.h>
 
@@ -38,4 +59,5 @@ void operator delete[](void* ptr) {
 #endif	
 }
 
+#endif
 #endif
\ No newline at end of file
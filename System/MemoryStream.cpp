@@ -125,6 +125,27 @@ bool MemoryStream::Write(const void* p, size_t& len) {
 	return true;
 }
 
+bool MemoryStream::WriteV(const IoVec* vectors, size_t count, size_t& len) {
+	// grow once for all vectors
+	len = 0;
+	for (size_t i = 0; i < count; i++) {
+		len += vectors[i].length;
+	}
+
+	if (!CheckSize(len)) {
+		len = 0;
+		return false;
+	}
+
+	for (size_t k = 0; k < count; k++) {
+		memcpy(buffer + offset, vectors[k].base, vectors[k].length);
+		offset += vectors[k].length;
+	}
+
+	totalSize = Math::Max(totalSize, (size_t)offset);
+	return true;
+}
+
 void MemoryStream::Flush() {
 
 }
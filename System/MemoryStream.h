@@ -20,6 +20,7 @@ namespace PaintsNow {
 		void SetEnd();
 		bool Read(void* p, size_t& len) override;
 		bool Write(const void* p, size_t& len) override;
+		bool WriteV(const IoVec* vectors, size_t count, size_t& len) override;
 		bool WriteDummy(size_t& len) override;
 		bool Seek(SEEK_OPTION option, int64_t offset) override;
 		bool Truncate(uint64_t length) override;
@@ -92,6 +92,17 @@ namespace PaintsNow {
 			return z;
 		}
 
+		// Compile-time version of AlignmentTop(n - 1) << 1, i.e. the smallest power of two not less than N.
+		template <size_t N, size_t P = 1, bool D = (P >= N)>
+		struct TRoundUpPowerOfTwo {
+			enum { value = TRoundUpPowerOfTwo<N, P * 2>::value };
+		};
+
+		template <size_t N, size_t P>
+		struct TRoundUpPowerOfTwo<N, P, true> {
+			enum { value = P };
+		};
+
 		template <class T>
 		T AlignmentRange(T a, T b) {
 			T top = AlignmentTop(a ^ b);
@@ -271,5 +282,42 @@ namespace std {
 			return false;
 		}
 	}
+
+	// Removes all but the last of each run of equivalent elements in sorted container, i.e. the elements binary_insert would keep.
+	template <class T, class P>
+	void binary_unique(T& container, const P& pred) {
+		typename T::iterator end = container.end();
+		typename T::iterator out = container.begin();
+		for (typename T::iterator it = container.begin(); it != end; ++it) {
+			typename T::iterator next = it;
+			if (++next == end || pred(*it, *next)) {
+				if (out != it) {
+					swap(*out, *it);
+				}
+
+				++out;
+			}
+		}
+
+		container.erase(out, end);
+	}
+
+	template <class T>
+	void binary_unique(T& container) {
+		binary_unique(container, less<typename T::value_type>());
+	}
+
+	// Bulk version of binary_insert: sorts container and removes duplicates in O(n log n), later elements win like repeated binary_insert calls.
+	// e.g. fill a std::vector<key_value<K, V> > with push_back, then build it once instead of inserting at O(n) each.
+	template <class T, class P>
+	void binary_build(T& container, const P& pred) {
+		stable_sort(container.begin(), container.end(), pred);
+		binary_unique(container, pred);
+	}
+
+	template <class T>
+	void binary_build(T& container) {
+		binary_build(container, less<typename T::value_type>());
+	}
 }
 
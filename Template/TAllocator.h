@@ -13,78 +13,191 @@
 
 namespace PaintsNow {
 	// Global allocator that allocates memory blocks to local allocators.
+	// Blocks are carved from power-of-two sized and aligned spans, the first N bytes of each span are reserved for its header.
+	// So the owner span of any block can be located by masking its address, and spans with free blocks are chained together.
+	// Spans are cut from virtual memory arenas which are never returned before destruction. Empty spans are kept
+	// committed up to the retention count, the others are decommitted (except for the header page) but their address ranges are still reserved for reusing.
+	// All bookkeeping is intrusive, so it never calls into global operator new.
+	// N = block size, K = min block count per span
 	template <size_t N, size_t K>
 	class TRootAllocator {
 	public:
-		TRootAllocator() { critical.store(0, std::memory_order_relaxed); }
+		// size_t constants, enums are int on some compilers and can not hold full 64-bit masks.
+		static const size_t BITS = 8 * sizeof(size_t);
+		static const size_t SPAN = Math::TRoundUpPowerOfTwo<N * (K + 1)>::value;
+		static const size_t COUNT = SPAN / N - 1 < BITS - 1 ? SPAN / N - 1 : BITS - 1;
+		static const size_t ARENA = SPAN > (size_t)IMemory::HUGE_PAGE_SIZE * 2 ? SPAN : (size_t)IMemory::HUGE_PAGE_SIZE * 2;
+
+		TRootAllocator() : freeHead(nullptr), emptyHead(nullptr), decommittedHead(nullptr), spanCount(0), emptyCount(0), retention(4), arena(nullptr), arenaOffset(ARENA) {
+			critical.store(0, std::memory_order_relaxed);
+			// spans are aligned to their size, so only spans of whole huge pages are never partially released.
+			pageType = SPAN >= IMemory::HUGE_PAGE_SIZE ? IMemory::PAGE_TRANSPARENT_HUGE : IMemory::PAGE_DEFAULT;
+		}
+
 		~TRootAllocator() {
 			pinObjects.clear();
-			assert(blocks.empty());
+			assert(spanCount == 0);
+
+			// all spans are returned, so the head span of each arena must be in one of the lists.
+			// collect them before unmapping since other spans of an arena may still be linked after its head.
+			Span* arenas = nullptr;
+			Span* heads[2] = { emptyHead, decommittedHead };
+			for (size_t i = 0; i < 2; i++) {
+				for (Span* span = heads[i]; span != nullptr; ) {
+					Span* next = span->next;
+					if ((reinterpret_cast<size_t>(span) & (ARENA - 1)) == 0) {
+						span->next = arenas;
+						arenas = span;
+					}
+
+					span = next;
+				}
+			}
+
+			while (arenas != nullptr) {
+				Span* next = arenas->next;
+				IMemory::UnmapVirtual(arenas, ARENA);
+				arenas = next;
+			}
 		}
 
+		// Returns nullptr if no arena can be mapped.
 		void* Allocate() {
 			static_assert(K < sizeof(size_t) * 8, "K is too large for root allocators.");
+			static_assert(sizeof(Span) <= N, "N is too small for root allocators.");
 
 			// do fast operations in critical section
 			SpinLock(critical);
-			for (size_t i = 0; i < blocks.size(); i++) {
-				Block& block = blocks[i];
-				if (block.bitmap != ((size_t)1 << K) - 1) {
-					size_t bit = block.bitmap + 1;
-					bit = bit & (~bit + 1);
-					size_t index = Math::Log2(bit);
-					block.bitmap |= bit;
-
-					SpinUnLock(critical);
-					return block.address + index * N;
+			Span* span = freeHead;
+			if (span != nullptr) {
+				assert(span->bitmap != FULL);
+				size_t bit = span->bitmap + 1;
+				bit = bit & (~bit + 1);
+				size_t index = Math::Log2(bit);
+				span->bitmap |= bit;
+
+				if (span->bitmap == FULL) {
+					Unlink(span);
 				}
+
+				SpinUnLock(critical);
+				return reinterpret_cast<uint8_t*>(span) + (index + 1) * N;
+			}
+
+			// take an empty span
+			bool committed = true;
+			if (emptyHead != nullptr) {
+				span = emptyHead;
+				emptyHead = span->next;
+				emptyCount--;
+			} else if (decommittedHead != nullptr) {
+				span = decommittedHead;
+				decommittedHead = span->next;
+				committed = false;
+			} else if (arenaOffset != ARENA) {
+				span = reinterpret_cast<Span*>(arena + arenaOffset);
+				arenaOffset += SPAN;
 			}
 
 			SpinUnLock(critical);
 
 			// real allocation, release the critical.
-			Block block;
-			block.address = reinterpret_cast<uint8_t*>(IMemory::AllocAligned(N * K, N));
-			block.bitmap = 1;
+			if (span == nullptr) {
+				span = NewArena();
+				if (span == nullptr) {
+					return nullptr;
+				}
+			} else if (!committed) {
+				Commit(span);
+			}
+
+			span->prev = span->next = nullptr;
+			span->bitmap = 1;
 
 			// write result back
 			SpinLock(critical);
-			blocks.emplace_back(block);
+			spanCount++;
+			if (span->bitmap != FULL) {
+				Link(span);
+			}
 			SpinUnLock(critical);
 
-			return block.address;
+			return reinterpret_cast<uint8_t*>(span) + N;
 		}
 
 		void Deallocate(void* p) {
-			void* t = nullptr;
+			Span* span = reinterpret_cast<Span*>(reinterpret_cast<size_t>(p) & ~(size_t)(SPAN - 1));
+			size_t index = (reinterpret_cast<uint8_t*>(p) - reinterpret_cast<uint8_t*>(span)) / N - 1;
+			assert(index < COUNT);
 
 			SpinLock(critical);
+			assert(span->bitmap & ((size_t)1 << index));
+			if (span->bitmap == FULL) {
+				Link(span);
+			}
 
-			// loop to find required one.
-			for (size_t i = 0; i < blocks.size(); i++) {
-				Block& block = blocks[i];
-				if (p >= block.address && p < block.address + N * K) {
-					size_t index = (reinterpret_cast<uint8_t*>(p) - block.address) / N;
-					assert(block.bitmap & ((size_t)1 << index));
-					block.bitmap &= ~((size_t)1 << index);
-
-					if (block.bitmap == 0) {
-						t = block.address;
-						blocks.erase(blocks.begin() + i);
-					}
+			span->bitmap &= ~((size_t)1 << index);
+			if (span->bitmap == 0) {
+				Unlink(span);
+				spanCount--;
 
-					break;
+				if (emptyCount < retention) {
+					span->next = emptyHead;
+					emptyHead = span;
+					emptyCount++;
+					span = nullptr;
 				}
+			} else {
+				span = nullptr;
 			}
 
 			SpinUnLock(critical);
 
-			if (t != nullptr) {
-				// do free
-				IMemory::FreeAligned(t);
+			if (span != nullptr) {
+				// decommit before publishing, or someone may take it while we are releasing its pages
+				Decommit(span);
+
+				SpinLock(critical);
+				span->next = decommittedHead;
+				decommittedHead = span;
+				SpinUnLock(critical);
 			}
 		}
 
+		// Decommit all retained empty spans, e.g. after a load spike.
+		void Trim() {
+			SpinLock(critical);
+			Span* spans = emptyHead;
+			emptyHead = nullptr;
+			emptyCount = 0;
+			SpinUnLock(critical);
+
+			while (spans != nullptr) {
+				Span* span = spans;
+				spans = spans->next;
+				Decommit(span);
+
+				SpinLock(critical);
+				span->next = decommittedHead;
+				decommittedHead = span;
+				SpinUnLock(critical);
+			}
+		}
+
+		// Max count of empty spans that keep their physical pages.
+		void SetRetention(size_t count) {
+			SpinLock(critical);
+			retention = count;
+			SpinUnLock(critical);
+		}
+
+		// Page type for arenas allocated after this call.
+		void SetPageType(IMemory::PAGE_TYPE type) {
+			SpinLock(critical);
+			pageType = type;
+			SpinUnLock(critical);
+		}
+
 		// We are not dll-friendly, as always.
 		static TRootAllocator& Get() {
 			static TRootAllocator allocator;
@@ -99,30 +212,129 @@ namespace PaintsNow {
 		}
 
 	protected:
-		struct Block {
-			uint8_t* address;
+		struct Span {
+			Span* prev;
+			Span* next;
 			size_t bitmap;
+			size_t keep; // only valid on arena heads, bytes of each span that stay committed
 		};
 
+		static const size_t FULL = ((size_t)1 << COUNT) - 1;
+
+		// the header page is always kept so that decommitted spans can be chained.
+		// arenas of huge pages keep the whole first huge page and release at huge page granularity, or they would be split.
+		static inline size_t GetKeep(Span* span) {
+			return reinterpret_cast<Span*>(reinterpret_cast<size_t>(span) & ~(size_t)(ARENA - 1))->keep;
+		}
+
+		static inline void Commit(Span* span) {
+			size_t keep = GetKeep(span);
+			if (SPAN > keep) {
+				IMemory::CommitVirtual(reinterpret_cast<uint8_t*>(span) + keep, SPAN - keep);
+			}
+		}
+
+		static inline void Decommit(Span* span) {
+			size_t keep = GetKeep(span);
+			if (SPAN > keep) {
+				IMemory::DecommitVirtual(reinterpret_cast<uint8_t*>(span) + keep, SPAN - keep);
+			}
+		}
+
+		Span* NewArena() {
+			SpinLock(critical);
+			IMemory::PAGE_TYPE type = pageType;
+			SpinUnLock(critical);
+
+			// out of address space or memory, the caller decides what to do
+			uint8_t* address = reinterpret_cast<uint8_t*>(IMemory::MapVirtual(ARENA, ARENA, type));
+			if (address == nullptr) {
+				return nullptr;
+			}
+
+			const size_t hugeKeep = SPAN < (size_t)IMemory::HUGE_PAGE_SIZE ? SPAN : (size_t)IMemory::HUGE_PAGE_SIZE;
+			reinterpret_cast<Span*>(address)->keep = type == IMemory::PAGE_DEFAULT ? (size_t)IMemory::DEFAULT_PAGE_SIZE : hugeKeep;
+
+			// take the first span and publish others.
+			SpinLock(critical);
+			if (arenaOffset != ARENA) {
+				// someone has allocated a new arena at the same time, recycle its remaining spans.
+				// they are never touched so they are treated as decommitted ones.
+				for (size_t offset = arenaOffset; offset != ARENA; offset += SPAN) {
+					Span* span = reinterpret_cast<Span*>(arena + offset);
+					span->next = decommittedHead;
+					decommittedHead = span;
+				}
+			}
+
+			arena = address;
+			arenaOffset = SPAN;
+			SpinUnLock(critical);
+
+			return reinterpret_cast<Span*>(address);
+		}
+
+		inline void Link(Span* span) {
+			span->prev = nullptr;
+			span->next = freeHead;
+			if (freeHead != nullptr) {
+				freeHead->prev = span;
+			}
+
+			freeHead = span;
+		}
+
+		inline void Unlink(Span* span) {
+			if (span->prev != nullptr) {
+				span->prev->next = span->next;
+			} else {
+				assert(freeHead == span);
+				freeHead = span->next;
+			}
+
+			if (span->next != nullptr) {
+				span->next->prev = span->prev;
+			}
+
+			span->prev = span->next = nullptr;
+		}
+
 	protected:
 		std::atomic<size_t> critical;
-		std::vector<Block> blocks;
+		Span* freeHead;
+		Span* emptyHead;
+		Span* decommittedHead;
+		size_t spanCount;
+		size_t emptyCount;
+		size_t retention;
+		uint8_t* arena;
+		size_t arenaOffset;
+		IMemory::PAGE_TYPE pageType;
 		std::vector<TShared<SharedTiny> > pinObjects;
 	};
 
+	template <size_t N, size_t K>
+	const size_t TRootAllocator<N, K>::BITS;
+	template <size_t N, size_t K>
+	const size_t TRootAllocator<N, K>::SPAN;
+	template <size_t N, size_t K>
+	const size_t TRootAllocator<N, K>::COUNT;
+	template <size_t N, size_t K>
+	const size_t TRootAllocator<N, K>::ARENA;
+	template <size_t N, size_t K>
+	const size_t TRootAllocator<N, K>::FULL;
+
 	// Local allocator, allocate memory with specified alignment requirements.
-	// K = element size, M = block size, R = max recycled block count, 0 for not limited
-	template <size_t K, size_t M = 8192, size_t R = 8, size_t S = sizeof(size_t) * 8 - 1>
+	// K = element size, M = block size, R = max recycled block count, 0 for not limited, S = min block count per root span, Root = root allocator type
+	template <size_t K, size_t M = 8192, size_t R = 8, size_t S = sizeof(size_t) * 8 - 1, class Root = TRootAllocator<M, S> >
 	class TAllocator : public TReflected<TAllocator<K, M, R>, SharedTiny> {
 	public:
 		typedef TReflected<TAllocator<K, M, R>, SharedTiny> BaseClass;
-		enum {
-			SIZE = M,
-			N = M / K,
-			BITS = 8 * sizeof(size_t),
-			BITMAPSIZE = (N + BITS - 1) / BITS,
-			MASK = BITS - 1
-		};
+		static const size_t SIZE = M;
+		static const size_t N = M / K;
+		static const size_t BITS = 8 * sizeof(size_t);
+		static const size_t BITMAPSIZE = (N + BITS - 1) / BITS;
+		static const size_t MASK = BITS - 1;
 
 		struct ControlBlock {
 			TAllocator* allocator;
@@ -138,20 +350,22 @@ namespace PaintsNow {
 	public:
 		TAllocator() {
 			static_assert(N / 2 * K > sizeof(ControlBlock), "N is too small");
+			// never grow the recycle list inside critical sections
+			recycled.reserve(R);
 			critical.store(0, std::memory_order_relaxed);
 			recycleCount.store(0, std::memory_order_relaxed);
 			controlBlock.store(nullptr, std::memory_order_release);
 		}
 
-		inline TRootAllocator<M, S>& GetRootAllocator() {
-			return TRootAllocator<M, S>::Get();
+		inline Root& GetRootAllocator() {
+			return Root::Get();
 		}
 
 		~TAllocator() override {
 			ControlBlock* p = (ControlBlock*)controlBlock.load(std::memory_order_acquire);
 
 			// deallocate all caches
-			TRootAllocator<M, S>& allocator = GetRootAllocator();
+			Root& allocator = GetRootAllocator();
 			if (p != nullptr) {
 				allocator.Deallocate(p);
 			}
@@ -189,6 +403,10 @@ namespace PaintsNow {
 
 					if (p == nullptr) {
 						p = reinterpret_cast<ControlBlock*>(GetRootAllocator().Allocate());
+						if (p == nullptr) {
+							return nullptr;
+						}
+
 						memset(p, 0, sizeof(ControlBlock));
 						p->allocator = this;
 						p->refCount.store(1, std::memory_order_relaxed); // newly allocated one, just set it to 1
@@ -239,6 +457,10 @@ namespace PaintsNow {
 						--(*(uint32_t*)&recycleCount);
 					} else {
 						p = reinterpret_cast<ControlBlock*>(GetRootAllocator().Allocate());
+						if (p == nullptr) {
+							return nullptr;
+						}
+
 						memset(p, 0, sizeof(ControlBlock));
 						p->allocator = this;
 						p->refCount.store(1, std::memory_order_relaxed); // newly allocated one, just set it to 1
@@ -375,6 +597,99 @@ namespace PaintsNow {
 		std::vector<ControlBlock*> recycled;
 	};
 
+	template <size_t K, size_t M, size_t R, size_t S, class Root>
+	const size_t TAllocator<K, M, R, S, Root>::SIZE;
+	template <size_t K, size_t M, size_t R, size_t S, class Root>
+	const size_t TAllocator<K, M, R, S, Root>::N;
+	template <size_t K, size_t M, size_t R, size_t S, class Root>
+	const size_t TAllocator<K, M, R, S, Root>::BITS;
+	template <size_t K, size_t M, size_t R, size_t S, class Root>
+	const size_t TAllocator<K, M, R, S, Root>::BITMAPSIZE;
+	template <size_t K, size_t M, size_t R, size_t S, class Root>
+	const size_t TAllocator<K, M, R, S, Root>::MASK;
+
+	// Thread-local front cache for TAllocator-like allocators.
+	// A magazine must be owned by only one thread, so Allocate/Deallocate do not touch any atomics until it runs empty or full.
+	// C = max cached element count, half of them are exchanged with the backing allocator in one refill/drain.
+	template <class A, size_t C = 32>
+	class TMagazine {
+	public:
+		TMagazine(A* alloc = nullptr, size_t cap = C) : allocator(alloc), capacity(cap), count(0) {
+			static_assert(C >= 2, "C is too small for magazines.");
+			assert(cap <= C);
+		}
+
+		~TMagazine() {
+			Clear();
+		}
+
+		void Attach(A* alloc, size_t cap = C) {
+			assert(cap <= C);
+			Clear();
+			allocator = alloc;
+			capacity = cap;
+		}
+
+		inline void* Allocate() {
+			if (count != 0) {
+				return slots[--count];
+			} else {
+				return Refill();
+			}
+		}
+
+		inline void Deallocate(void* p) {
+			if (count < capacity) {
+				slots[count++] = p;
+			} else {
+				Drain(p);
+			}
+		}
+
+		void Clear() {
+			while (count != 0) {
+				allocator->Deallocate(slots[--count]);
+			}
+		}
+
+	protected:
+		void* Refill() {
+			assert(count == 0);
+			// stop early if the backing allocator runs out of memory
+			void* p = allocator->Allocate();
+			if (p != nullptr) {
+				for (size_t n = capacity / 2; count < n; count++) {
+					if ((slots[count] = allocator->Allocate()) == nullptr) {
+						break;
+					}
+				}
+			}
+
+			return p;
+		}
+
+		void Drain(void* p) {
+			allocator->Deallocate(p);
+
+			// keep the recent half, they are more likely to be cache-hot.
+			size_t n = capacity / 2;
+			for (size_t i = 0; i < count - n; i++) {
+				allocator->Deallocate(slots[i]);
+			}
+
+			if (count > n) {
+				memmove(slots, slots + count - n, n * sizeof(void*));
+				count = n;
+			}
+		}
+
+	protected:
+		A* allocator;
+		size_t capacity;
+		size_t count;
+		void* slots[C];
+	};
+
 	// Allocate for objects
 	template <class T, size_t M = 8192, size_t Align = 64, size_t R = 8>
 	class TObjectAllocator : protected TAllocator<(sizeof(T) + Align - 1) & ~(Align - 1), M, R> {
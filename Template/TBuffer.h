@@ -6,10 +6,18 @@
 #pragma once
 #include "../PaintsNow.h"
 #include "../Interface/IType.h"
+#include "TAtomic.h"
 #include <string>
 
 namespace PaintsNow {
+	// Segment descriptor for scatter/gather I/O, same layout as POSIX iovec.
+	struct IoVec {
+		void* base;
+		size_t length;
+	};
+
 	// Memory buffer with some internal storage.
+	// Storage modes: stock (inline), managed (malloc), view (external, chainable) and shared (refcounted, copy-on-write).
 	template <class T, size_t N = (sizeof(T*) * 4 - sizeof(size_t)) / sizeof(T)>
 	class TBuffer {
 	public:
@@ -19,7 +27,9 @@ namespace PaintsNow {
 #endif
 		{
 			EXT_STORE_MASK = ((size_t)1 << (sizeof(size_t) * 8 - 1)),
-			DATA_VIEW_MASK = ((size_t)1 << (sizeof(size_t) * 8 - 2))
+			DATA_VIEW_MASK = ((size_t)1 << (sizeof(size_t) * 8 - 2)),
+			SHARED_MASK = ((size_t)1 << (sizeof(size_t) * 8 - 3)),
+			SIZE_MASK = ~(EXT_STORE_MASK | DATA_VIEW_MASK | SHARED_MASK)
 		};
 
 		TBuffer() : size(0) {
@@ -51,6 +61,8 @@ namespace PaintsNow {
 			if (IsManagedStorage()) {
 				assert(buffer != nullptr);
 				free(buffer);
+			} else if (IsSharedStorage()) {
+				ReleaseShared(GetSharedHeader());
 			}
 		}
 
@@ -58,6 +70,8 @@ namespace PaintsNow {
 			if (IsManagedStorage()) {
 				assert(buffer != nullptr);
 				free(buffer);
+			} else if (IsSharedStorage()) {
+				ReleaseShared(GetSharedHeader());
 			}
 
 			size = 0;
@@ -109,12 +123,37 @@ namespace PaintsNow {
 			return buffer;
 		}
 
-		bool IsManagedStorage() const { return (size & (DATA_VIEW_MASK | EXT_STORE_MASK)) == EXT_STORE_MASK; }
+		// Move managed storage into shared storage, so that later copies only add a reference.
+		// Mutable accesses to shared storage copy it first if it is referenced by others.
+		// Notice that pointers got from GetData() before copying are not tracked.
+		TBuffer& Share() {
+			if (IsManagedStorage()) {
+				size_t s = GetSize();
+				SharedHeader* header = reinterpret_cast<SharedHeader*>(malloc(sizeof(SharedHeader) + s * sizeof(T)));
+				header->refCount.store(1, std::memory_order_relaxed);
+				memcpy(reinterpret_cast<T*>(header + 1), buffer, s * sizeof(T));
+				free(buffer);
+
+				buffer = reinterpret_cast<T*>(header + 1);
+				size = s | EXT_STORE_MASK | SHARED_MASK;
+			}
+
+			return *this;
+		}
+
+		bool IsManagedStorage() const { return (size & (DATA_VIEW_MASK | EXT_STORE_MASK | SHARED_MASK)) == EXT_STORE_MASK; }
 		bool IsViewStorage() const { return !!(size & DATA_VIEW_MASK); }
 		bool IsStockStorage() const { return !(size & EXT_STORE_MASK); }
-		size_t GetSize() const { assert(size <= N || (size & ~(EXT_STORE_MASK | DATA_VIEW_MASK)) > N); return size & ~(EXT_STORE_MASK | DATA_VIEW_MASK); }
+		bool IsSharedStorage() const { return !!(size & SHARED_MASK); }
+		size_t GetSize() const { assert(size <= N || (size & SIZE_MASK) > N); return size & SIZE_MASK; }
 		const T* GetData() const { return IsStockStorage() ? stockStorage : buffer; }
-		T* GetData() { return IsStockStorage() ? stockStorage : buffer; }
+		T* GetData() {
+			if (IsSharedStorage()) {
+				MakeUnique();
+			}
+
+			return IsStockStorage() ? stockStorage : buffer;
+		}
 
 		size_t GetViewSize() const {
 			if (IsViewStorage()) {
@@ -131,6 +170,36 @@ namespace PaintsNow {
 			}
 		}
 
+		// Scatter/gather iterator over view chains, exports segments without flattening them.
+		// Non-view buffers are exported as a single segment.
+		class Segments {
+		public:
+			Segments(const TBuffer& buffer) : current(&buffer) {}
+
+			// Returns the count of filled vectors, zero if all segments are exported.
+			size_t Export(IoVec* vectors, size_t count) {
+				size_t i = 0;
+				while (current != nullptr && i < count) {
+					if (!current->Empty()) {
+						IoVec& v = vectors[i++];
+						v.base = const_cast<T*>(current->GetData());
+						v.length = current->GetSize() * sizeof(T);
+					}
+
+					current = current->IsViewStorage() ? current->next : nullptr;
+				}
+
+				return i;
+			}
+
+			bool Empty() const {
+				return current == nullptr;
+			}
+
+		private:
+			const TBuffer* current;
+		};
+
 		void Import(size_t offset, const T* ptr, size_t size, size_t repeat = 1) {
 			if (IsViewStorage()) {
 				TBuffer* p = this;
@@ -228,7 +297,7 @@ namespace PaintsNow {
 		bool operator == (const TBuffer& rhs) const {
 			assert(IsViewStorage() == rhs.IsViewStorage());
 			assert(!IsViewStorage() || (next == nullptr && rhs.next == nullptr));
-			if (size != rhs.size) return false;
+			if ((size & SIZE_MASK) != (rhs.size & SIZE_MASK)) return false;
 			if (size == 0) return true;
 
 			return memcmp(GetData(), rhs.GetData(), GetSize() * sizeof(T)) == 0;
@@ -240,8 +309,8 @@ namespace PaintsNow {
 			if (size == 0) {
 				return rhs.size != 0;
 			} else {
-				bool less = size < rhs.size;
-				size_t minSize = (less ? size : rhs.size) & (~(EXT_STORE_MASK | DATA_VIEW_MASK));
+				bool less = (size & SIZE_MASK) < (rhs.size & SIZE_MASK);
+				size_t minSize = (less ? size : rhs.size) & SIZE_MASK;
 				int result = memcmp(GetData(), rhs.GetData(), minSize * sizeof(T));
 				return result != 0 ? result < 0 : less;
 			}
@@ -269,7 +338,22 @@ namespace PaintsNow {
 
 		void Resize(size_t s) {
 			assert(!IsViewStorage());
-			if (IsStockStorage()) {
+			if (IsSharedStorage()) {
+				// back to managed (or stock) storage of the final size
+				SharedHeader* header = GetSharedHeader();
+				const T* orgBuffer = buffer;
+				size_t copySize = Math::Min(s, GetSize());
+				if (s > N) {
+					buffer = reinterpret_cast<T*>(malloc(s * sizeof(T)));
+					memcpy(buffer, orgBuffer, copySize * sizeof(T));
+					size = s | EXT_STORE_MASK;
+				} else {
+					memcpy(stockStorage, orgBuffer, copySize * sizeof(T));
+					size = s;
+				}
+
+				ReleaseShared(header);
+			} else if (IsStockStorage()) {
 				if (s > N) { // out of bound
 					T* newBuffer = reinterpret_cast<T*>(malloc(s * sizeof(T)));
 					memcpy(newBuffer, stockStorage, GetSize() * sizeof(T));
@@ -360,10 +444,48 @@ namespace PaintsNow {
 		}
 
 	protected:
+		struct SharedHeader {
+			std::atomic<size_t> refCount;
+			size_t reserved; // keep data aligned
+		};
+
+		SharedHeader* GetSharedHeader() const {
+			assert(IsSharedStorage());
+			return reinterpret_cast<SharedHeader*>(buffer) - 1;
+		}
+
+		static void ReleaseShared(SharedHeader* header) {
+			if (header->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				free(header);
+			}
+		}
+
+		// copy-on-write
+		void MakeUnique() {
+			SharedHeader* header = GetSharedHeader();
+			if (header->refCount.load(std::memory_order_acquire) != 1) {
+				size_t s = GetSize();
+				SharedHeader* newHeader = reinterpret_cast<SharedHeader*>(malloc(sizeof(SharedHeader) + s * sizeof(T)));
+				newHeader->refCount.store(1, std::memory_order_relaxed);
+				memcpy(reinterpret_cast<T*>(newHeader + 1), buffer, s * sizeof(T));
+				ReleaseShared(header);
+
+				buffer = reinterpret_cast<T*>(newHeader + 1);
+			}
+		}
+
 		void Copy(const TBuffer& rhs) {
+			if (this == &rhs) {
+				return;
+			}
+
 			if (rhs.IsViewStorage()) {
 				Clear();
 				memcpy(this, &rhs, sizeof(rhs));
+			} else if (rhs.IsSharedStorage()) {
+				rhs.GetSharedHeader()->refCount.fetch_add(1, std::memory_order_relaxed);
+				Clear();
+				memcpy(this, &rhs, sizeof(rhs));
 			} else {
 				size_t s = rhs.GetSize();
 				Resize(s);
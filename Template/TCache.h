@@ -12,6 +12,18 @@ namespace PaintsNow {
 	template <class T, size_t K>
 	class TCache {
 	public:
+		// Recyclable blocks are rounded up to buckets: 16 elements steps up to 256, then powers of two up to half of a pack.
+		enum {
+			BUCKET_GRANULARITY = 16,
+			BUCKET_COUNT = K > 9 ? K + 7 : 16
+		};
+
+		TCache() {
+			generations.resize(1);
+			generations[0].id = 0;
+			generations[0].head = allocator.GetPopHead();
+		}
+
 		TBuffer<T> New(uint32_t size, uint32_t alignment = 16) {
 			uint32_t pack = allocator.GetPackCount(alignment);
 			static_assert(alignof(TBuffer<T>) % sizeof(T) == 0, "TBuffer<T> must be aligned at least sizeof(T).");
@@ -50,6 +62,61 @@ namespace PaintsNow {
 			return allocator.Allocate(size, alignment);
 		}
 
+		// Generation tagged allocation. Blocks are recycled through per-bucket free lists of the generation.
+		T* Allocate(uint32_t size, uint32_t alignment, uint32_t generation) {
+			uint32_t bucket = GetBucket(size, alignment);
+			if (bucket != ~(uint32_t)0) {
+				Generation* g = GetGeneration(generation);
+				if (g != nullptr && g->freeLists[bucket] != nullptr) {
+					void* p = g->freeLists[bucket];
+					g->freeLists[bucket] = *reinterpret_cast<void**>(p);
+					return reinterpret_cast<T*>(p);
+				}
+
+				// always align recyclable blocks, they may be reused by other requests of the same bucket
+				return allocator.Allocate(GetBucketSize(bucket), BUCKET_GRANULARITY);
+			} else {
+				return allocator.Allocate(size, alignment);
+			}
+		}
+
+		void Deallocate(T* p, uint32_t size, uint32_t alignment, uint32_t generation) {
+			uint32_t bucket = GetBucket(size, alignment);
+			if (bucket != ~(uint32_t)0) {
+				Generation* g = GetGeneration(generation);
+				if (g != nullptr) {
+					*reinterpret_cast<void**>(p) = g->freeLists[bucket];
+					g->freeLists[bucket] = p;
+				}
+			}
+		}
+
+		uint32_t GetGeneration() const {
+			return generations.back().id;
+		}
+
+		// Start a new generation, following allocations begin with a new node.
+		uint32_t Advance() {
+			Generation g;
+			g.id = generations.back().id + 1;
+			g.head = allocator.Split();
+			generations.push_back(g);
+
+			return g.id;
+		}
+
+		// Retire the oldest generation if it is not the current one. All memory allocated in it becomes invalid.
+		// Its nodes are recycled for later allocations.
+		bool Retire() {
+			if (generations.size() > 1) {
+				allocator.Recycle(generations[1].head);
+				generations.erase(generations.begin());
+				return true;
+			} else {
+				return false;
+			}
+		}
+
 		void Link(TBuffer<T>& from, const TBuffer<T>& to) {
 			if (from.Empty()) {
 				from = to;
@@ -62,14 +129,56 @@ namespace PaintsNow {
 
 		void Reset() {
 			allocator.Reset(~(uint32_t)0);
+			ResetGenerations();
 		}
 
 		void Clear() {
 			allocator.Reset(0);
+			ResetGenerations();
 		}
 
 	protected:
+		struct Generation {
+			Generation() {
+				memset(freeLists, 0, sizeof(freeLists));
+			}
+
+			uint32_t id;
+			typename TQueueList<T, K>::Node* head;
+			void* freeLists[BUCKET_COUNT];
+		};
+
+		static uint32_t GetBucket(uint32_t size, uint32_t alignment) {
+			static_assert(sizeof(T) * BUCKET_GRANULARITY >= sizeof(void*), "Bucket too small.");
+			if (alignment > BUCKET_GRANULARITY || size > (1u << (K - 1))) {
+				return ~(uint32_t)0;
+			} else if (size <= 16 * BUCKET_GRANULARITY) {
+				return size == 0 ? 0 : (size - 1) / BUCKET_GRANULARITY;
+			} else {
+				return 16 + Math::LogAlignmentTop(size - 1) - 9;
+			}
+		}
+
+		static uint32_t GetBucketSize(uint32_t bucket) {
+			return bucket < 16 ? (bucket + 1) * BUCKET_GRANULARITY : 1u << (bucket - 16 + 9);
+		}
+
+		Generation* GetGeneration(uint32_t id) {
+			uint32_t index = id - generations[0].id;
+			assert(index < generations.size()); // must not be retired
+			return index < generations.size() ? &generations[index] : nullptr;
+		}
+
+		void ResetGenerations() {
+			uint32_t id = generations.back().id;
+			generations.resize(1);
+			generations[0] = Generation();
+			generations[0].id = id;
+			generations[0].head = allocator.GetPopHead();
+		}
+
 		TQueueList<T, K> allocator;
+		std::vector<Generation> generations;
 	};
 
 	typedef TCache<uint8_t, 12> BytesCache;
@@ -90,24 +199,27 @@ namespace PaintsNow {
 
 		typedef TCache<D, K> Allocator;
 		Allocator* allocator;
+		uint32_t generation;
 
-		TCacheAllocator(Allocator* alloc) : allocator(alloc) {}
-		TCacheAllocator(const TCacheAllocator& al) : allocator(al.allocator) {}
+		// Allocations are tagged with the current generation of alloc.
+		// Containers must not outlive the retirement of their generation.
+		TCacheAllocator(Allocator* alloc) : allocator(alloc), generation(alloc != nullptr ? alloc->GetGeneration() : 0) {}
+		TCacheAllocator(const TCacheAllocator& al) : allocator(al.allocator), generation(al.generation) {}
 
 #if defined(_MSC_VER) && _MSC_VER > 1200
 		// maybe a bug of VC (Debug Build), just add these lines to make compiler happy
 		template <class M>
-		TCacheAllocator(const TCacheAllocator<M, D, K>& rhs) : allocator(rhs.allocator) {}
+		TCacheAllocator(const TCacheAllocator<M, D, K>& rhs) : allocator(rhs.allocator), generation(rhs.generation) {}
 #endif
 
 		template <class M>
 		bool operator == (const M& rhs) const {
-			return allocator == rhs.allocator;
+			return allocator == rhs.allocator && generation == rhs.generation;
 		}
 
 		template <class M>
 		bool operator != (const M& rhs) const {
-			return allocator != rhs.allocator;
+			return allocator != rhs.allocator || generation != rhs.generation;
 		}
 
 		pointer address(reference x) const {
@@ -145,8 +257,8 @@ namespace PaintsNow {
 			assert(allocator != nullptr);
 			static_assert(sizeof(T) % sizeof(D) == 0, "Must be aligned.");
 			uint32_t count = safe_cast<uint32_t>(n * sizeof(T) / sizeof(D));
-			if (count <= Allocator::GetFullPackCount()) {
-				return reinterpret_cast<pointer>(allocator->NewLinear(count, safe_cast<uint32_t>(alignof(T))));
+			if (count <= Allocator::GetFullPackCount() / 2) {
+				return reinterpret_cast<pointer>(allocator->Allocate(count, safe_cast<uint32_t>(alignof(T)), generation));
 			} else {
 				return reinterpret_cast<pointer>(::operator new(sizeof(T) * n));
 			}
@@ -154,8 +266,9 @@ namespace PaintsNow {
 
 		forceinline void deallocate(T* p, size_t n) {
 			uint32_t count = safe_cast<uint32_t>(n * sizeof(T) / sizeof(D));
-			if (count <= Allocator::GetFullPackCount()) {
-				// do not deallocate in cache allocator.
+			if (count <= Allocator::GetFullPackCount() / 2) {
+				// recycle to free lists of its generation, memory is only returned on retirement
+				allocator->Deallocate(reinterpret_cast<D*>(p), count, safe_cast<uint32_t>(alignof(T)), generation);
 			} else {
 				::operator delete(p);
 			}
@@ -0,0 +1,457 @@
+// TConvert.h
+// Batch conversions between float and compressed formats: half floats, normalized and fixed-point integers
+//
+
+#pragma once
+
+#include "../PaintsNow.h"
+#include "../Interface/IType.h"
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+namespace PaintsNow {
+	namespace Math {
+		// Scalar conversions. Batch kernels below give identical results on every path.
+		// Round to nearest even like SSE conversions in default rounding mode, |value| < 2^31.
+		inline int32_t RoundToInt(float value) {
+			int32_t result = (int32_t)value;
+			float fraction = value - (float)result;
+			if (fraction > 0.5f || (fraction == 0.5f && (result & 1))) {
+				result++;
+			} else if (fraction < -0.5f || (fraction == -0.5f && (result & 1))) {
+				result--;
+			}
+
+			return result;
+		}
+
+		// IEEE 754 binary16, NaNs are quieted and keep their upper payload bits like F16C.
+		inline float HalfToFloat(uint16_t value) {
+			uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+			uint32_t exponent = (value >> 10) & 0x1F;
+			uint32_t mantissa = value & 0x3FF;
+			uint32_t bits;
+
+			if (exponent == 0x1F) {
+				bits = sign | 0x7F800000 | (mantissa << 13) | (mantissa != 0 ? 0x400000 : 0);
+			} else if (exponent != 0) {
+				bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+			} else if (mantissa == 0) {
+				bits = sign;
+			} else {
+				// denormal, normalize it
+				exponent = 113;
+				while (!(mantissa & 0x400)) {
+					mantissa <<= 1;
+					exponent--;
+				}
+
+				bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+			}
+
+			float result;
+			memcpy(&result, &bits, sizeof(result));
+			return result;
+		}
+
+		// Rounds to nearest even, overflows to infinity.
+		inline uint16_t FloatToHalf(float value) {
+			uint32_t bits;
+			memcpy(&bits, &value, sizeof(bits));
+			uint32_t sign = (bits >> 16) & 0x8000;
+			uint32_t abs = bits & 0x7FFFFFFF;
+
+			if (abs >= 0x7F800000) {
+				return (uint16_t)(sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 | ((abs >> 13) & 0x3FF) : 0));
+			} else if (abs >= 0x477FF000) {
+				return (uint16_t)(sign | 0x7C00);
+			} else if (abs >= 0x38800000) {
+				// rebias exponent, add half of dropped bits minus one plus the lowest kept bit for ties
+				return (uint16_t)(sign | ((abs + 0xC8000FFF + ((abs >> 13) & 1)) >> 13));
+			} else if (abs <= 0x33000000) {
+				return (uint16_t)sign;
+			} else {
+				// denormal, in units of 2^-24
+				uint32_t shift = 126 - (abs >> 23);
+				uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+				uint32_t result = mantissa >> shift;
+				uint32_t rest = mantissa & ((1u << shift) - 1);
+				uint32_t half = 1u << (shift - 1);
+				if (rest > half || (rest == half && (result & 1))) {
+					result++;
+				}
+
+				return (uint16_t)(sign | result);
+			}
+		}
+
+		// Normalized integers: unsigned types map to [0, 1], signed types to [-1, 1] with both lowest values at -1.
+		template <class D>
+		inline float NormToFloat(D value) {
+			return Math::Max((float)value / (float)std::numeric_limits<D>::max(), -1.0f);
+		}
+
+		// NaN converts to 0.
+		template <class D>
+		inline D FloatToNorm(float value) {
+			const float lower = std::numeric_limits<D>::is_signed ? -1.0f : 0.0f;
+			value = value == value ? Math::Min(Math::Max(value, lower), 1.0f) : 0.0f;
+			return (D)RoundToInt(value * (float)std::numeric_limits<D>::max());
+		}
+
+		// Fixed-point integers of up to 32 bits with fractionBits fraction bits.
+		template <class D>
+		inline float FixedToFloat(D value, uint32_t fractionBits) {
+			assert(fractionBits < 32);
+			return (float)value * (1.0f / (float)(1u << fractionBits));
+		}
+
+		// Saturates to the range of D, NaN converts to 0.
+		template <class D>
+		inline D FloatToFixed(float value, uint32_t fractionBits) {
+			assert(fractionBits < 32 && sizeof(D) <= sizeof(int32_t));
+			// largest float not above the maximum of 32-bit integers
+			const float upper = sizeof(D) < sizeof(int32_t) ? (float)std::numeric_limits<D>::max() : 2147483520.0f;
+			value *= (float)(1u << fractionBits);
+			value = value == value ? Math::Min(Math::Max(value, (float)std::numeric_limits<D>::min()), upper) : 0.0f;
+			return (D)RoundToInt(value);
+		}
+
+		// Batch kernels return the boundary between their part and the part left to the scalar loop.
+		// Widening kernels (output elements larger than input elements) work on trailing blocks back to front and return the number of leading elements left,
+		// others work on leading blocks front to back and return the number of elements processed.
+		// So in-place conversions, with in and out at the same address, never overwrite inputs not read yet.
+		template <class D>
+		inline size_t NormToFloatPacked(const D* in, float* out, size_t count) {
+			return count;
+		}
+
+		template <class D>
+		inline size_t FloatToNormPacked(const float* in, D* out, size_t count) {
+			return 0;
+		}
+
+		template <class D>
+		inline size_t FixedToFloatPacked(const D* in, float* out, size_t count, uint32_t fractionBits) {
+			return count;
+		}
+
+		template <class D>
+		inline size_t FloatToFixedPacked(const float* in, D* out, size_t count, uint32_t fractionBits) {
+			return 0;
+		}
+
+#ifdef USE_SSE
+		// 8 integers to two vectors of 32-bit lanes
+		inline void LoadIntegers(const uint8_t* in, __m128i& low, __m128i& high) {
+			__m128i zero = _mm_setzero_si128();
+			__m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)in), zero);
+			low = _mm_unpacklo_epi16(v, zero);
+			high = _mm_unpackhi_epi16(v, zero);
+		}
+
+		inline void LoadIntegers(const int8_t* in, __m128i& low, __m128i& high) {
+			__m128i v = _mm_loadl_epi64((const __m128i*)in);
+			v = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+			low = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+			high = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		}
+
+		inline void LoadIntegers(const uint16_t* in, __m128i& low, __m128i& high) {
+			__m128i zero = _mm_setzero_si128();
+			__m128i v = _mm_loadu_si128((const __m128i*)in);
+			low = _mm_unpacklo_epi16(v, zero);
+			high = _mm_unpackhi_epi16(v, zero);
+		}
+
+		inline void LoadIntegers(const int16_t* in, __m128i& low, __m128i& high) {
+			__m128i v = _mm_loadu_si128((const __m128i*)in);
+			low = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+			high = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		}
+
+		inline void LoadIntegers(const int32_t* in, __m128i& low, __m128i& high) {
+			low = _mm_loadu_si128((const __m128i*)in);
+			high = _mm_loadu_si128((const __m128i*)(in + 4));
+		}
+
+		// two vectors of 32-bit lanes, already in range of the target type, to 8 integers
+		inline void StoreIntegers(uint8_t* out, __m128i low, __m128i high) {
+			__m128i v = _mm_packs_epi32(low, high);
+			_mm_storel_epi64((__m128i*)out, _mm_packus_epi16(v, v));
+		}
+
+		inline void StoreIntegers(int8_t* out, __m128i low, __m128i high) {
+			__m128i v = _mm_packs_epi32(low, high);
+			_mm_storel_epi64((__m128i*)out, _mm_packs_epi16(v, v));
+		}
+
+		inline void StoreIntegers(uint16_t* out, __m128i low, __m128i high) {
+			// no unsigned saturation of 32-bit lanes before SSE4.1, sign-extend the low halves instead
+			low = _mm_srai_epi32(_mm_slli_epi32(low, 16), 16);
+			high = _mm_srai_epi32(_mm_slli_epi32(high, 16), 16);
+			_mm_storeu_si128((__m128i*)out, _mm_packs_epi32(low, high));
+		}
+
+		inline void StoreIntegers(int16_t* out, __m128i low, __m128i high) {
+			_mm_storeu_si128((__m128i*)out, _mm_packs_epi32(low, high));
+		}
+
+		inline void StoreIntegers(int32_t* out, __m128i low, __m128i high) {
+			_mm_storeu_si128((__m128i*)out, low);
+			_mm_storeu_si128((__m128i*)(out + 4), high);
+		}
+
+		// NaN lanes to 0
+		inline __m128 ZeroNaN(__m128 v) {
+			return _mm_and_ps(v, _mm_cmpeq_ps(v, v));
+		}
+
+		template <class D>
+		inline size_t NormToFloatPackedWith(const D* in, float* out, size_t count) {
+			__m128 scale = _mm_set_ps1((float)std::numeric_limits<D>::max());
+			__m128 lower = _mm_set_ps1(-1.0f);
+			size_t i = count;
+			for (; i >= 8; i -= 8) {
+				__m128i low, high;
+				LoadIntegers(in + i - 8, low, high);
+				_mm_storeu_ps(out + i - 8, _mm_max_ps(_mm_div_ps(_mm_cvtepi32_ps(low), scale), lower));
+				_mm_storeu_ps(out + i - 4, _mm_max_ps(_mm_div_ps(_mm_cvtepi32_ps(high), scale), lower));
+			}
+
+			return i;
+		}
+
+		template <class D>
+		inline size_t FloatToNormPackedWith(const float* in, D* out, size_t count) {
+			__m128 scale = _mm_set_ps1((float)std::numeric_limits<D>::max());
+			__m128 lower = _mm_set_ps1(std::numeric_limits<D>::is_signed ? -1.0f : 0.0f);
+			__m128 upper = _mm_set_ps1(1.0f);
+			size_t i = 0;
+			for (; i + 8 <= count; i += 8) {
+				__m128 low = _mm_min_ps(_mm_max_ps(ZeroNaN(_mm_loadu_ps(in + i)), lower), upper);
+				__m128 high = _mm_min_ps(_mm_max_ps(ZeroNaN(_mm_loadu_ps(in + i + 4)), lower), upper);
+				StoreIntegers(out + i, _mm_cvtps_epi32(_mm_mul_ps(low, scale)), _mm_cvtps_epi32(_mm_mul_ps(high, scale)));
+			}
+
+			return i;
+		}
+
+		template <class D>
+		inline size_t FixedToFloatPackedWith(const D* in, float* out, size_t count, uint32_t fractionBits) {
+			assert(fractionBits < 32);
+			__m128 unit = _mm_set_ps1(1.0f / (float)(1u << fractionBits));
+			size_t i = count;
+			for (; i >= 8; i -= 8) {
+				__m128i low, high;
+				LoadIntegers(in + i - 8, low, high);
+				_mm_storeu_ps(out + i - 8, _mm_mul_ps(_mm_cvtepi32_ps(low), unit));
+				_mm_storeu_ps(out + i - 4, _mm_mul_ps(_mm_cvtepi32_ps(high), unit));
+			}
+
+			return i;
+		}
+
+		template <class D>
+		inline size_t FloatToFixedPackedWith(const float* in, D* out, size_t count, uint32_t fractionBits) {
+			assert(fractionBits < 32);
+			__m128 scale = _mm_set_ps1((float)(1u << fractionBits));
+			__m128 lower = _mm_set_ps1((float)std::numeric_limits<D>::min());
+			__m128 upper = _mm_set_ps1(sizeof(D) < sizeof(int32_t) ? (float)std::numeric_limits<D>::max() : 2147483520.0f);
+			size_t i = 0;
+			for (; i + 8 <= count; i += 8) {
+				__m128 low = _mm_min_ps(_mm_max_ps(ZeroNaN(_mm_mul_ps(_mm_loadu_ps(in + i), scale)), lower), upper);
+				__m128 high = _mm_min_ps(_mm_max_ps(ZeroNaN(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale)), lower), upper);
+				StoreIntegers(out + i, _mm_cvtps_epi32(low), _mm_cvtps_epi32(high));
+			}
+
+			return i;
+		}
+
+		inline size_t NormToFloatPacked(const uint8_t* in, float* out, size_t count) {
+			return NormToFloatPackedWith(in, out, count);
+		}
+
+		inline size_t NormToFloatPacked(const int8_t* in, float* out, size_t count) {
+			return NormToFloatPackedWith(in, out, count);
+		}
+
+		inline size_t NormToFloatPacked(const uint16_t* in, float* out, size_t count) {
+			return NormToFloatPackedWith(in, out, count);
+		}
+
+		inline size_t NormToFloatPacked(const int16_t* in, float* out, size_t count) {
+			return NormToFloatPackedWith(in, out, count);
+		}
+
+		inline size_t FloatToNormPacked(const float* in, uint8_t* out, size_t count) {
+			return FloatToNormPackedWith(in, out, count);
+		}
+
+		inline size_t FloatToNormPacked(const float* in, int8_t* out, size_t count) {
+			return FloatToNormPackedWith(in, out, count);
+		}
+
+		inline size_t FloatToNormPacked(const float* in, uint16_t* out, size_t count) {
+			return FloatToNormPackedWith(in, out, count);
+		}
+
+		inline size_t FloatToNormPacked(const float* in, int16_t* out, size_t count) {
+			return FloatToNormPackedWith(in, out, count);
+		}
+
+		inline size_t FixedToFloatPacked(const int16_t* in, float* out, size_t count, uint32_t fractionBits) {
+			return FixedToFloatPackedWith(in, out, count, fractionBits);
+		}
+
+		inline size_t FixedToFloatPacked(const int32_t* in, float* out, size_t count, uint32_t fractionBits) {
+			return FixedToFloatPackedWith(in, out, count, fractionBits);
+		}
+
+		inline size_t FloatToFixedPacked(const float* in, int16_t* out, size_t count, uint32_t fractionBits) {
+			return FloatToFixedPackedWith(in, out, count, fractionBits);
+		}
+
+		inline size_t FloatToFixedPacked(const float* in, int32_t* out, size_t count, uint32_t fractionBits) {
+			return FloatToFixedPackedWith(in, out, count, fractionBits);
+		}
+
+#ifdef USE_F16C
+		inline size_t HalfToFloatPacked(const uint16_t* in, float* out, size_t count) {
+			size_t i = count;
+			for (; i >= 8; i -= 8) {
+				_mm256_storeu_ps(out + i - 8, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in + i - 8))));
+			}
+
+			return i;
+		}
+
+		inline size_t FloatToHalfPacked(const float* in, uint16_t* out, size_t count) {
+			size_t i = 0;
+			for (; i + 8 <= count; i += 8) {
+				_mm_storeu_si128((__m128i*)(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(in + i), 0));
+			}
+
+			return i;
+		}
+#else
+		// 4 halves in 32-bit lanes, by bit operations: rebias exponents, and renormalize denormals with a float subtraction
+		inline __m128 HalfToFloat4(__m128i value) {
+			__m128i exponentMask = _mm_set1_epi32(0x7C00 << 13);
+			__m128i rebias = _mm_set1_epi32(112 << 23);
+			__m128i bits = _mm_slli_epi32(_mm_and_si128(value, _mm_set1_epi32(0x7FFF)), 13);
+			__m128i exponent = _mm_and_si128(bits, exponentMask);
+			bits = _mm_add_epi32(bits, rebias);
+
+			// infinities and NaNs get the maximal exponent, NaNs are quieted
+			__m128i special = _mm_cmpeq_epi32(exponent, exponentMask);
+			__m128i nan = _mm_and_si128(special, _mm_cmpgt_epi32(_mm_and_si128(value, _mm_set1_epi32(0x3FF)), _mm_setzero_si128()));
+			bits = _mm_add_epi32(bits, _mm_and_si128(special, rebias));
+			bits = _mm_or_si128(bits, _mm_and_si128(nan, _mm_set1_epi32(0x400000)));
+
+			__m128i magic = _mm_set1_epi32(113 << 23);
+			__m128i denormal = _mm_castps_si128(_mm_sub_ps(_mm_castsi128_ps(_mm_add_epi32(bits, _mm_set1_epi32(1 << 23))), _mm_castsi128_ps(magic)));
+			__m128i tiny = _mm_cmpeq_epi32(exponent, _mm_setzero_si128());
+			bits = _mm_or_si128(_mm_and_si128(tiny, denormal), _mm_andnot_si128(tiny, bits));
+
+			return _mm_castsi128_ps(_mm_or_si128(bits, _mm_slli_epi32(_mm_and_si128(value, _mm_set1_epi32(0x8000)), 16)));
+		}
+
+		// 4 floats to halves in 32-bit lanes, same branches as FloatToHalf, denormals are rounded by a float addition
+		inline __m128i FloatToHalf4(__m128 value) {
+			__m128i bits = _mm_castps_si128(value);
+			__m128i sign = _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(0x8000));
+			__m128i abs = _mm_and_si128(bits, _mm_set1_epi32(0x7FFFFFFF));
+			__m128i infinity = _mm_set1_epi32(0x7C00);
+
+			__m128i normal = _mm_add_epi32(_mm_add_epi32(abs, _mm_set1_epi32((int)0xC8000FFF)), _mm_and_si128(_mm_srli_epi32(abs, 13), _mm_set1_epi32(1)));
+			normal = _mm_srli_epi32(normal, 13);
+			__m128 magic = _mm_castsi128_ps(_mm_set1_epi32(126 << 23));
+			__m128i denormal = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(abs), magic)), _mm_castps_si128(magic));
+			__m128i nan = _mm_or_si128(infinity, _mm_and_si128(_mm_cmpgt_epi32(abs, _mm_set1_epi32(0x7F800000)), _mm_or_si128(_mm_set1_epi32(0x200), _mm_and_si128(_mm_srli_epi32(abs, 13), _mm_set1_epi32(0x3FF)))));
+
+			__m128i mask = _mm_cmplt_epi32(abs, _mm_set1_epi32(0x38800000));
+			__m128i result = _mm_or_si128(_mm_and_si128(mask, denormal), _mm_andnot_si128(mask, normal));
+			mask = _mm_cmpgt_epi32(abs, _mm_set1_epi32(0x477FEFFF));
+			result = _mm_or_si128(_mm_and_si128(mask, infinity), _mm_andnot_si128(mask, result));
+			mask = _mm_cmpgt_epi32(abs, _mm_set1_epi32(0x7F7FFFFF));
+			result = _mm_or_si128(_mm_and_si128(mask, nan), _mm_andnot_si128(mask, result));
+
+			return _mm_or_si128(result, sign);
+		}
+
+		inline size_t HalfToFloatPacked(const uint16_t* in, float* out, size_t count) {
+			size_t i = count;
+			for (; i >= 8; i -= 8) {
+				__m128i low, high;
+				LoadIntegers(in + i - 8, low, high);
+				_mm_storeu_ps(out + i - 8, HalfToFloat4(low));
+				_mm_storeu_ps(out + i - 4, HalfToFloat4(high));
+			}
+
+			return i;
+		}
+
+		inline size_t FloatToHalfPacked(const float* in, uint16_t* out, size_t count) {
+			size_t i = 0;
+			for (; i + 8 <= count; i += 8) {
+				StoreIntegers(out + i, FloatToHalf4(_mm_loadu_ps(in + i)), FloatToHalf4(_mm_loadu_ps(in + i + 4)));
+			}
+
+			return i;
+		}
+#endif
+#else
+		inline size_t HalfToFloatPacked(const uint16_t* in, float* out, size_t count) {
+			return count;
+		}
+
+		inline size_t FloatToHalfPacked(const float* in, uint16_t* out, size_t count) {
+			return 0;
+		}
+#endif
+
+		// Batch conversions of count components, e.g. pass &vertices[0].data[0] and vertexCount * 4 for UShort4 / Float4 arrays.
+		// in and out may be the same address for converting in place, other overlaps are not allowed.
+		inline void ConvertHalfToFloat(const uint16_t* in, float* out, size_t count) {
+			for (size_t i = HalfToFloatPacked(in, out, count); i != 0; i--) {
+				out[i - 1] = HalfToFloat(in[i - 1]);
+			}
+		}
+
+		inline void ConvertFloatToHalf(const float* in, uint16_t* out, size_t count) {
+			for (size_t i = FloatToHalfPacked(in, out, count); i < count; i++) {
+				out[i] = FloatToHalf(in[i]);
+			}
+		}
+
+		template <class D>
+		void ConvertNormToFloat(const D* in, float* out, size_t count) {
+			for (size_t i = NormToFloatPacked(in, out, count); i != 0; i--) {
+				out[i - 1] = NormToFloat(in[i - 1]);
+			}
+		}
+
+		template <class D>
+		void ConvertFloatToNorm(const float* in, D* out, size_t count) {
+			for (size_t i = FloatToNormPacked(in, out, count); i < count; i++) {
+				out[i] = FloatToNorm<D>(in[i]);
+			}
+		}
+
+		template <class D>
+		void ConvertFixedToFloat(const D* in, float* out, size_t count, uint32_t fractionBits) {
+			for (size_t i = FixedToFloatPacked(in, out, count, fractionBits); i != 0; i--) {
+				out[i - 1] = FixedToFloat(in[i - 1], fractionBits);
+			}
+		}
+
+		template <class D>
+		void ConvertFloatToFixed(const float* in, D* out, size_t count, uint32_t fractionBits) {
+			for (size_t i = FloatToFixedPacked(in, out, count, fractionBits); i < count; i++) {
+				out[i] = FloatToFixed<D>(in[i], fractionBits);
+			}
+		}
+	}
+}
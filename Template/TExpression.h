@@ -0,0 +1,90 @@
+// TExpression.h
+// Lazy matrix chains, opt-in expression templates over TMatrix and TVector
+//
+
+#pragma once
+
+#include "TMatrix.h"
+
+namespace PaintsNow {
+	// Start of a chain, refers to the matrix without copying it.
+	template <class T, size_t m, size_t n>
+	struct TMatrixLeaf {
+		typedef T type;
+		enum { M = m, N = n };
+
+		TMatrixLeaf(const TMatrix<T, m, n>& mat) : matrix(mat) {}
+
+		inline const TVector<T, n>& Row(size_t i) const {
+			return matrix(i);
+		}
+
+		inline TVector<T, n> Apply(const TVector<T, m>& value) const {
+			return value * matrix;
+		}
+
+		inline const TMatrix<T, m, n>& Evaluate() const {
+			return matrix;
+		}
+
+		const TMatrix<T, m, n>& matrix;
+	};
+
+	// Product of chain L and a matrix of n columns. Nothing is computed until the chain is applied to a vector or evaluated.
+	// Chains keep references to their matrices, which must outlive them.
+	template <class L, size_t n>
+	struct TMatrixProduct {
+		typedef typename L::type type;
+		enum { M = L::M, K = L::N, N = n };
+
+		TMatrixProduct(const L& l, const TMatrix<type, K, N>& r) : lhs(l), rhs(r) {}
+
+		// Row i of the product, the row goes through each factor in turn so that no matrix temporaries are made.
+		// e.g. the translation row of a transform chain.
+		inline TVector<type, N> Row(size_t i) const {
+			return lhs.Row(i) * rhs;
+		}
+
+		// value * product, multiplies factors into value from left to right. Costs one vector-matrix product per factor
+		// instead of one matrix-matrix product per factor, evaluate the chain once instead for many vectors.
+		inline TVector<type, N> Apply(const TVector<type, M>& value) const {
+			return lhs.Apply(value) * rhs;
+		}
+
+		// Whole products go factor by factor, rows of each factor are loaded once for all rows then.
+		inline TMatrix<type, M, N> Evaluate() const {
+			return lhs.Evaluate() * rhs;
+		}
+
+		inline operator TMatrix<type, M, N>() const {
+			return Evaluate();
+		}
+
+		L lhs;
+		const TMatrix<type, K, N>& rhs;
+	};
+
+	template <class T, size_t m, size_t n, size_t p>
+	inline TMatrixProduct<TMatrixLeaf<T, m, n>, p> operator * (const TMatrixLeaf<T, m, n>& lhs, const TMatrix<T, n, p>& rhs) {
+		return TMatrixProduct<TMatrixLeaf<T, m, n>, p>(lhs, rhs);
+	}
+
+	template <class L, size_t n, class T, size_t k, size_t p>
+	inline TMatrixProduct<TMatrixProduct<L, n>, p> operator * (const TMatrixProduct<L, n>& lhs, const TMatrix<T, k, p>& rhs) {
+		return TMatrixProduct<TMatrixProduct<L, n>, p>(lhs, rhs);
+	}
+
+	template <class T, size_t m, class L, size_t n>
+	inline TVector<T, n> operator * (const TVector<T, m>& value, const TMatrixProduct<L, n>& rhs) {
+		return rhs.Apply(value);
+	}
+
+	namespace Math {
+		// Opt-in entry of lazy chains: v * (Chain(a) * b * c) is computed as v * a * b * c, and Chain(a) * b * c converts to TMatrix on demand.
+		// Plain TMatrix operators are not affected.
+		template <class T, size_t m, size_t n>
+		inline TMatrixLeaf<T, m, n> Chain(const TMatrix<T, m, n>& matrix) {
+			return TMatrixLeaf<T, m, n>(matrix);
+		}
+	}
+}
@@ -0,0 +1,365 @@
+// TFrustum.h
+// View frustum and box culling
+//
+
+#pragma once
+
+#include "../PaintsNow.h"
+#include "../Interface/IType.h"
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+namespace PaintsNow {
+	// Frustum planes in structure-of-arrays layout.
+	template <class T>
+	struct TFrustumPlanes {
+		enum { PLANE_COUNT = 6 };
+		T a[PLANE_COUNT];
+		T b[PLANE_COUNT];
+		T c[PLANE_COUNT];
+		T d[PLANE_COUNT];
+	};
+
+	// Batch kernels return how many leading boxes they have processed, always a multiple of 32 so that visibility words are not shared.
+	// Types without a kernel leave all boxes to the scalar loop.
+	template <class P, class V>
+	inline size_t CullPacked(const P&, const std::pair<V, V>*, size_t, uint32_t*) {
+		return 0;
+	}
+
+	template <class P, class T>
+	inline size_t CullSplit(const P&, const T*, const T*, const T*, const T*, const T*, const T*, size_t, uint32_t*) {
+		return 0;
+	}
+
+#ifdef USE_SSE
+	// Packs of boxes in structure-of-arrays layout, shared by culling and ray kernels (TRay.h).
+	struct BoxPack4f {
+		typedef __m128 value;
+		enum { COUNT = 4 };
+
+		static inline value Load(const float* p) { return _mm_loadu_ps(p); }
+		static inline value Set(float v) { return _mm_set_ps1(v); }
+		static inline void Store(float* p, value v) { _mm_storeu_ps(p, v); }
+		static inline value Add(value a, value b) { return _mm_add_ps(a, b); }
+		static inline value Sub(value a, value b) { return _mm_sub_ps(a, b); }
+		static inline value Mul(value a, value b) { return _mm_mul_ps(a, b); }
+		static inline value Min(value a, value b) { return _mm_min_ps(a, b); }
+		static inline value Max(value a, value b) { return _mm_max_ps(a, b); }
+		static inline value Or(value a, value b) { return _mm_or_ps(a, b); }
+		static inline value Less(value a, value b) { return _mm_cmplt_ps(a, b); }
+		static inline value Select(value mask, value a, value b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+		static inline value Zero() { return _mm_setzero_ps(); }
+		static inline uint32_t Mask(value v) { return (uint32_t)_mm_movemask_ps(v); }
+		static inline void Transpose(value& r0, value& r1, value& r2, value& r3) { _MM_TRANSPOSE4_PS(r0, r1, r2, r3); }
+
+		// 4 floats from boxes k (k = 0..3) into lanes
+		static inline void Gather(const float* p, size_t stride, value& r0, value& r1, value& r2, value& r3) {
+			r0 = _mm_loadu_ps(p);
+			r1 = _mm_loadu_ps(p + stride);
+			r2 = _mm_loadu_ps(p + stride * 2);
+			r3 = _mm_loadu_ps(p + stride * 3);
+			Transpose(r0, r1, r2, r3);
+		}
+	};
+
+#ifdef USE_AVX
+	// Boxes k and k + 4 share a register, in low and high lanes
+	struct BoxPack8f {
+		typedef __m256 value;
+		enum { COUNT = 8 };
+
+		static inline value Load(const float* p) { return _mm256_loadu_ps(p); }
+		static inline value Set(float v) { return _mm256_set1_ps(v); }
+		static inline void Store(float* p, value v) { _mm256_storeu_ps(p, v); }
+		static inline value Add(value a, value b) { return _mm256_add_ps(a, b); }
+		static inline value Sub(value a, value b) { return _mm256_sub_ps(a, b); }
+		static inline value Mul(value a, value b) { return _mm256_mul_ps(a, b); }
+		static inline value Min(value a, value b) { return _mm256_min_ps(a, b); }
+		static inline value Max(value a, value b) { return _mm256_max_ps(a, b); }
+		static inline value Or(value a, value b) { return _mm256_or_ps(a, b); }
+		static inline value Less(value a, value b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+		static inline value Select(value mask, value a, value b) { return _mm256_blendv_ps(b, a, mask); }
+		static inline value Zero() { return _mm256_setzero_ps(); }
+		static inline uint32_t Mask(value v) { return (uint32_t)_mm256_movemask_ps(v); }
+
+		static inline void Transpose(value& r0, value& r1, value& r2, value& r3) {
+			value t0 = _mm256_unpacklo_ps(r0, r1);
+			value t1 = _mm256_unpacklo_ps(r2, r3);
+			value t2 = _mm256_unpackhi_ps(r0, r1);
+			value t3 = _mm256_unpackhi_ps(r2, r3);
+			r0 = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+			r1 = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+			r2 = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+			r3 = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2));
+		}
+
+		static inline value Pair(const float* low, const float* high) {
+			return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(low)), _mm_loadu_ps(high), 1);
+		}
+
+		static inline void Gather(const float* p, size_t stride, value& r0, value& r1, value& r2, value& r3) {
+			r0 = Pair(p, p + stride * 4);
+			r1 = Pair(p + stride, p + stride * 5);
+			r2 = Pair(p + stride * 2, p + stride * 6);
+			r3 = Pair(p + stride * 3, p + stride * 7);
+			Transpose(r0, r1, r2, r3);
+		}
+	};
+#endif
+
+	// Visibility bits of a pack of boxes, the farthest corner of each box along the plane normal must not be behind any plane.
+	template <class F>
+	inline uint32_t CullPack(const TFrustumPlanes<float>& planes, typename F::value lowerX, typename F::value lowerY, typename F::value lowerZ, typename F::value upperX, typename F::value upperY, typename F::value upperZ) {
+		typedef typename F::value V;
+		V outside = F::Zero();
+		V zero = F::Zero();
+		for (size_t k = 0; k < TFrustumPlanes<float>::PLANE_COUNT; k++) {
+			V x = F::Mul(F::Set(planes.a[k]), planes.a[k] >= 0 ? upperX : lowerX);
+			V y = F::Mul(F::Set(planes.b[k]), planes.b[k] >= 0 ? upperY : lowerY);
+			V z = F::Mul(F::Set(planes.c[k]), planes.c[k] >= 0 ? upperZ : lowerZ);
+			// same order as TFrustum::Classify
+			outside = F::Or(outside, F::Less(F::Add(F::Add(F::Add(F::Set(planes.d[k]), x), y), z), zero));
+		}
+
+		return ~F::Mask(outside) & ((1u << F::COUNT) - 1);
+	}
+
+	// Loads F::COUNT boxes into a pack. Boxes are pairs of float vectors of N components, N = 3 or 4.
+	template <class F, class B>
+	inline void GatherBoxes(const std::pair<B, B>* boxes, typename F::value& lowerX, typename F::value& lowerY, typename F::value& lowerZ, typename F::value& upperX, typename F::value& upperY, typename F::value& upperZ) {
+		const size_t N = B::size;
+		const float* p = &boxes[0].first.data[0];
+		typename F::value t;
+		// lower: [0, 4), upper: [N, N + 4) or [N - 1, N + 3) for 3 components to stay in range
+		F::Gather(p, N * 2, lowerX, lowerY, lowerZ, t);
+		if (N == 4) {
+			F::Gather(p + N, N * 2, upperX, upperY, upperZ, t);
+		} else {
+			F::Gather(p + N - 1, N * 2, t, upperX, upperY, upperZ);
+		}
+	}
+
+	template <class F, class B>
+	inline size_t CullPackedWith(const TFrustumPlanes<float>& planes, const std::pair<B, B>* boxes, size_t count, uint32_t* visibility) {
+		typedef typename F::value V;
+		size_t i = 0;
+		for (; i + 32 <= count; i += 32) {
+			uint32_t word = 0;
+			for (size_t j = 0; j < 32; j += F::COUNT) {
+				V lowerX, lowerY, lowerZ, upperX, upperY, upperZ;
+				GatherBoxes<F>(boxes + i + j, lowerX, lowerY, lowerZ, upperX, upperY, upperZ);
+				word |= CullPack<F>(planes, lowerX, lowerY, lowerZ, upperX, upperY, upperZ) << j;
+			}
+
+			visibility[i >> 5] = word;
+		}
+
+		return i;
+	}
+
+	template <class F>
+	inline size_t CullSplitWith(const TFrustumPlanes<float>& planes, const float* lowerX, const float* lowerY, const float* lowerZ, const float* upperX, const float* upperY, const float* upperZ, size_t count, uint32_t* visibility) {
+		size_t i = 0;
+		for (; i + 32 <= count; i += 32) {
+			uint32_t word = 0;
+			for (size_t j = 0; j < 32; j += F::COUNT) {
+				size_t k = i + j;
+				word |= CullPack<F>(planes, F::Load(lowerX + k), F::Load(lowerY + k), F::Load(lowerZ + k), F::Load(upperX + k), F::Load(upperY + k), F::Load(upperZ + k)) << j;
+			}
+
+			visibility[i >> 5] = word;
+		}
+
+		return i;
+	}
+
+#ifdef USE_AVX
+	typedef BoxPack8f BoxPackf;
+#else
+	typedef BoxPack4f BoxPackf;
+#endif
+
+	inline size_t CullPacked(const TFrustumPlanes<float>& planes, const Float3Pair* boxes, size_t count, uint32_t* visibility) {
+		return CullPackedWith<BoxPackf>(planes, boxes, count, visibility);
+	}
+
+	inline size_t CullPacked(const TFrustumPlanes<float>& planes, const Float4Pair* boxes, size_t count, uint32_t* visibility) {
+		return CullPackedWith<BoxPackf>(planes, boxes, count, visibility);
+	}
+
+	inline size_t CullSplit(const TFrustumPlanes<float>& planes, const float* lowerX, const float* lowerY, const float* lowerZ, const float* upperX, const float* upperY, const float* upperZ, size_t count, uint32_t* visibility) {
+		return CullSplitWith<BoxPackf>(planes, lowerX, lowerY, lowerZ, upperX, upperY, upperZ, count, visibility);
+	}
+#endif
+
+	// Frustum planes extracted from a view-projection matrix in row-vector convention (clip = v * m, -w <= x, y, z <= w).
+	// Plane (a, b, c, d) keeps points with a * x + b * y + c * z + d >= 0.
+	// For projections with [0, w] depth the z >= -w plane is looser than the real bound, which only makes culling conservative.
+	template <class T>
+	class TFrustum {
+	public:
+		enum { OUTSIDE = 0, INTERSECT = 1, INSIDE = 2 };
+		enum { PLANE_COUNT = TFrustumPlanes<T>::PLANE_COUNT };
+
+		TFrustum() {
+			for (size_t i = 0; i < PLANE_COUNT; i++) {
+				planes[i] = TVector<T, 4>(T(0));
+				planes[i][3] = T(1);
+			}
+
+			Pack();
+		}
+
+		TFrustum(const TMatrix<T, 4, 4>& viewProjection) {
+			for (size_t i = 0; i < 3; i++) {
+				for (size_t j = 0; j < 4; j++) {
+					planes[i * 2][j] = viewProjection(j, 3) + viewProjection(j, i);
+					planes[i * 2 + 1][j] = viewProjection(j, 3) - viewProjection(j, i);
+				}
+			}
+
+			// normalized planes give real distances, so that boxes can be inflated by callers
+			for (size_t k = 0; k < PLANE_COUNT; k++) {
+				TVector<T, 4>& plane = planes[k];
+				T length = (T)sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+				if (length > T(0)) {
+					plane /= length;
+				}
+			}
+
+			Pack();
+		}
+
+		// left, right, bottom, top, far, near: planes 4 and 5 keep z >= -w and z <= w,
+		// and Math::MatrixPerspective maps the near plane to z = w and the far plane to z = -w.
+		inline const TVector<T, 4>& GetPlane(size_t index) const {
+			assert(index < PLANE_COUNT);
+			return planes[index];
+		}
+
+		// Classifies box [lower, upper] (3 components are used) as OUTSIDE, INTERSECT or INSIDE.
+		// Conservative: boxes near frustum edges may be reported as INTERSECT though they are outside.
+		uint32_t Classify(const T* lower, const T* upper) const {
+			uint32_t result = INSIDE;
+			for (size_t k = 0; k < PLANE_COUNT; k++) {
+				const TVector<T, 4>& plane = planes[k];
+				T maxDistance = plane[3], minDistance = plane[3];
+				for (size_t c = 0; c < 3; c++) {
+					if (plane[c] >= T(0)) {
+						maxDistance += plane[c] * upper[c];
+						minDistance += plane[c] * lower[c];
+					} else {
+						maxDistance += plane[c] * lower[c];
+						minDistance += plane[c] * upper[c];
+					}
+				}
+
+				if (maxDistance < T(0)) {
+					return OUTSIDE;
+				} else if (minDistance < T(0)) {
+					result = INTERSECT;
+				}
+			}
+
+			return result;
+		}
+
+		template <class K>
+		inline uint32_t Classify(const K& box) const {
+			return Classify(&box.first.data[0], &box.second.data[0]);
+		}
+
+		template <class K>
+		inline bool Test(const K& box) const {
+			return Classify(box) != OUTSIDE;
+		}
+
+		// Box of frustum corners, components beyond the third are left unbounded.
+		template <class K>
+		void GetBoundingBox(K& box) const {
+			T* lower = &box.first.data[0];
+			T* upper = &box.second.data[0];
+			for (size_t c = 0; c < K::first_type::size; c++) {
+				lower[c] = c < 3 ? std::numeric_limits<T>::max() : -std::numeric_limits<T>::max();
+				upper[c] = c < 3 ? -std::numeric_limits<T>::max() : std::numeric_limits<T>::max();
+			}
+
+			for (size_t i = 0; i < 8; i++) {
+				TVector<T, 3> corner = Intersect(planes[i & 1], planes[2 + ((i >> 1) & 1)], planes[4 + (i >> 2)]);
+				for (size_t c = 0; c < 3; c++) {
+					lower[c] = Math::Min(lower[c], corner[c]);
+					upper[c] = Math::Max(upper[c], corner[c]);
+				}
+			}
+		}
+
+		// Batch culling. Bit (i & 31) of visibility[i >> 5] is set if box i is not OUTSIDE, unused bits of the last word are cleared.
+		// visibility must hold (count + 31) / 32 words.
+		template <class V>
+		void Cull(const std::pair<V, V>* boxes, size_t count, uint32_t* visibility) const {
+			memset(visibility, 0, (count + 31) / 32 * sizeof(uint32_t));
+			for (size_t i = CullPacked(soa, boxes, count, visibility); i < count; i++) {
+				visibility[i >> 5] |= (uint32_t)Test(boxes[i]) << (i & 31);
+			}
+		}
+
+		// Structure-of-arrays version
+		void Cull(const T* lowerX, const T* lowerY, const T* lowerZ, const T* upperX, const T* upperY, const T* upperZ, size_t count, uint32_t* visibility) const {
+			memset(visibility, 0, (count + 31) / 32 * sizeof(uint32_t));
+			for (size_t i = CullSplit(soa, lowerX, lowerY, lowerZ, upperX, upperY, upperZ, count, visibility); i < count; i++) {
+				T lower[3] = { lowerX[i], lowerY[i], lowerZ[i] };
+				T upper[3] = { upperX[i], upperY[i], upperZ[i] };
+				visibility[i >> 5] |= (uint32_t)(Classify(lower, upper) != OUTSIDE) << (i & 31);
+			}
+		}
+
+	protected:
+		static TVector<T, 3> Intersect(const TVector<T, 4>& p, const TVector<T, 4>& q, const TVector<T, 4>& r) {
+			TVector<T, 3> u, v, w;
+			for (size_t c = 0; c < 3; c++) {
+				u[c] = p[c];
+				v[c] = q[c];
+				w[c] = r[c];
+			}
+
+			TVector<T, 3> vw = Math::CrossProduct(v, w), wu = Math::CrossProduct(w, u), uv = Math::CrossProduct(u, v);
+			T det = Math::DotProduct(u, vw);
+			return (vw * p[3] + wu * q[3] + uv * r[3]) * (T(-1) / det);
+		}
+
+		void Pack() {
+			for (size_t k = 0; k < PLANE_COUNT; k++) {
+				soa.a[k] = planes[k][0];
+				soa.b[k] = planes[k][1];
+				soa.c[k] = planes[k][2];
+				soa.d[k] = planes[k][3];
+			}
+		}
+
+		TVector<T, 4> planes[PLANE_COUNT];
+		TFrustumPlanes<T> soa;
+	};
+
+	// Adapts TKdTree::Query to frustum culling: query with the bounding box of the frustum (GetBoundingBox) as target key,
+	// the tree rejects subtrees outside of the box by its split planes, then nodes outside of the frustum are filtered here.
+	// Calls queryer(node) for the rest.
+	template <class T, class Q>
+	struct TFrustumQueryer {
+		TFrustumQueryer(const TFrustum<T>& f, Q& q) : frustum(f), queryer(q) {}
+
+		template <class K, class N>
+		inline bool operator () (const K&, N& node) {
+			if (frustum.Test(node.GetKey())) {
+				queryer(node);
+			}
+
+			return true;
+		}
+
+		const TFrustum<T>& frustum;
+		Q& queryer;
+	};
+}
@@ -2,12 +2,55 @@
 
 #include "../PaintsNow.h"
 #include "../Interface/IType.h"
+#include "../Interface/ITask.h"
 #include "TTagged.h"
 #include <algorithm>
 #include <cassert>
 #include <utility>
+#include <vector>
 
 namespace PaintsNow {
+	// Box overlap test for keys with lower bounds in the first half and upper bounds in the second half.
+	template <class T, class type, size_t N>
+	struct TBoxOverlap {
+		static inline bool Overlap(const T& lhs, const T& rhs) {
+			const type* l = reinterpret_cast<const type*>(&lhs);
+			const type* r = reinterpret_cast<const type*>(&rhs);
+			for (size_t i = 0; i < N / 2; i++) {
+				if (r[i + N / 2] < l[i] || l[i + N / 2] < r[i]) {
+					return false;
+				}
+			}
+
+			return true;
+		}
+	};
+
+#ifdef USE_SSE
+	template <>
+	struct TBoxOverlap<Float4Pair, float, 8> {
+		static inline bool Overlap(const Float4Pair& lhs, const Float4Pair& rhs) {
+			__m128 miss = _mm_or_ps(_mm_cmplt_ps(LoadVector4f(rhs.second), LoadVector4f(lhs.first)), _mm_cmplt_ps(LoadVector4f(lhs.second), LoadVector4f(rhs.first)));
+			return _mm_movemask_ps(miss) == 0;
+		}
+	};
+
+	template <>
+	struct TBoxOverlap<Float3Pair, float, 6> {
+		static inline bool Overlap(const Float3Pair& lhs, const Float3Pair& rhs) {
+			// the pair is 6 contiguous floats, load [0, 4) and [2, 6) then shift the upper one down
+			const float* l = &lhs.first.data[0];
+			const float* r = &rhs.first.data[0];
+			__m128 lmin = _mm_loadu_ps(l), rmin = _mm_loadu_ps(r);
+			__m128 lmax = _mm_loadu_ps(l + 2), rmax = _mm_loadu_ps(r + 2);
+			lmax = _mm_shuffle_ps(lmax, lmax, _MM_SHUFFLE(3, 3, 2, 1));
+			rmax = _mm_shuffle_ps(rmax, rmax, _MM_SHUFFLE(3, 3, 2, 1));
+			__m128 miss = _mm_or_ps(_mm_cmplt_ps(rmax, lmin), _mm_cmplt_ps(lmax, rmin));
+			return (_mm_movemask_ps(miss) & 7) == 0;
+		}
+	};
+#endif
+
 #ifndef _MSC_VER
 	template <class T, class prim_type = typename T::first_type, size_t N = prim_type::size * 2>
 #else
@@ -33,6 +76,36 @@ namespace PaintsNow {
 		static inline bool OverlapRight(const T& lhs, const T& rhs, uint16_t index) {
 			return index >= size / 2 || !(Get(rhs, index + size / 2) < Get(lhs, index));
 		}
+
+		static inline bool Overlap(const T& lhs, const T& rhs) {
+			return TBoxOverlap<T, type, N>::Overlap(lhs, rhs);
+		}
+
+		// Squared distance between boxes, zero if overlapped.
+		static inline type Distance(const T& lhs, const T& rhs) {
+			type sum = type(0);
+			for (uint16_t i = 0; i < size / 2; i++) {
+				type gap = Math::Max(Get(lhs, i) - Get(rhs, i + size / 2), Get(rhs, i) - Get(lhs, i + size / 2));
+				if (gap > type(0)) {
+					sum += gap * gap;
+				}
+			}
+
+			return sum;
+		}
+
+		// Lower bounds of squared distance from rhs to subtrees split by lhs, pairs with OverlapLeft/OverlapRight.
+		static inline type DistanceLeft(const T& lhs, const T& rhs, uint16_t index) {
+			if (index < size / 2) return type(0);
+			type gap = Get(rhs, index - size / 2) - Get(lhs, index);
+			return gap > type(0) ? gap * gap : type(0);
+		}
+
+		static inline type DistanceRight(const T& lhs, const T& rhs, uint16_t index) {
+			if (index >= size / 2) return type(0);
+			type gap = Get(lhs, index) - Get(rhs, index + size / 2);
+			return gap > type(0) ? gap * gap : type(0);
+		}
 	};
 
 	// KdTree with custom spatial structure
@@ -102,25 +175,264 @@ namespace PaintsNow {
 			return newRoot;
 		}
 
+		enum { QUERY_STACK_SIZE = 64 };
+
+		// Scapegoat balancing with alpha = 2 / 3. this must be the root and count is the node count after attaching.
+		// Attaches tree and rebuilds the smallest unbalanced subtree on its path if it goes too deep.
+		// Returns the new root.
+		inline TKdTree* AttachBalanced(TKdTree* tree, uint32_t count) {
+			assert(GetParent() == nullptr);
+			assert(tree != nullptr && tree != this);
+			assert(tree->leftNode == nullptr && tree->rightNode == nullptr && tree->GetParent() == nullptr);
+			CheckCycle();
+			uint32_t depth = Merge(tree);
+			CheckCycle();
+
+			if (depth > GetBalancedHeight(count)) {
+				TKdTree* scapegoat = FindScapegoat(tree);
+				if (scapegoat != nullptr) {
+					TKdTree* root = scapegoat->Rebalance();
+					if (root->GetParent() == nullptr) {
+						return root;
+					}
+				}
+			}
+
+			return this;
+		}
+
+		// Rebuilds the subtree into a balanced one in place, returns its new root.
+		TKdTree* Rebalance() {
+			TKdTree* parent = GetParent();
+			TKdTree** pp = parent == nullptr ? nullptr : parent->leftNode == this ? &parent->leftNode : &parent->rightNode;
+
+			std::vector<TKdTree*> nodes;
+			Collect(nodes);
+			for (size_t i = 0; i < nodes.size(); i++) {
+				TKdTree* node = nodes[i];
+				node->leftNode = node->rightNode = nullptr;
+				node->SetParent(nullptr);
+			}
+
+			TKdTree* root = Build(&nodes[0], 0, safe_cast<uint32_t>(nodes.size()), 0);
+			if (pp != nullptr) {
+				*pp = root;
+				root->SetParent(parent);
+			}
+
+			return root;
+		}
+
+		// Moves nodes to new keys in one pass. this must be the root and count is the node count of the tree.
+		// Large batches rebuild the whole tree, small ones detach and reattach moved nodes with balancing.
+		// Returns the new root.
+		template <class S>
+		TKdTree* UpdateBatch(TKdTree* const* nodes, const K* keys, uint32_t n, uint32_t count, S& selector) {
+			assert(GetParent() == nullptr);
+			if (n * 4 >= count) {
+				for (uint32_t i = 0; i < n; i++) {
+					nodes[i]->key = keys[i];
+				}
+
+				return Rebalance();
+			}
+
+			TKdTree* root = this;
+			for (uint32_t i = 0; i < n; i++) {
+				TKdTree* node = nodes[i];
+				if (node == root) {
+					root = node->Detach(selector);
+				} else {
+					TKdTree* newRoot = node->Detach(selector);
+					assert(newRoot == nullptr);
+				}
+
+				node->key = keys[i];
+			}
+
+			count -= n;
+			for (uint32_t j = 0; j < n; j++) {
+				if (root == nullptr) {
+					root = nodes[j];
+				} else {
+					root = root->AttachBalanced(nodes[j], ++count);
+				}
+			}
+
+			return root;
+		}
+
+		// Node count of the subtree.
+		uint32_t GetWeight() const {
+			uint32_t weight = 0;
+			const TKdTree* stack[QUERY_STACK_SIZE];
+			uint32_t top = 0;
+			const TKdTree* p = this;
+
+			while (true) {
+				weight++;
+				if (p->rightNode != nullptr) {
+					if (top < QUERY_STACK_SIZE) {
+						stack[top++] = p->rightNode;
+					} else {
+						weight += p->rightNode->GetWeight();
+					}
+				}
+
+				if (p->leftNode != nullptr) {
+					p = p->leftNode;
+				} else if (top != 0) {
+					p = stack[--top];
+				} else {
+					break;
+				}
+			}
+
+			return weight;
+		}
+
+		// Collects all nodes of the subtree.
+		void Collect(std::vector<TKdTree*>& nodes) {
+			size_t from = nodes.size();
+			nodes.push_back(this);
+			for (size_t i = from; i < nodes.size(); i++) {
+				TKdTree* node = nodes[i];
+				if (node->leftNode != nullptr) {
+					nodes.push_back(node->leftNode);
+				}
+
+				if (node->rightNode != nullptr) {
+					nodes.push_back(node->rightNode);
+				}
+			}
+		}
+
 		template <class Q>
 		inline void Query(const K& targetKey, Q& queryer) {
-			// ranged queryer
-			KeyType keyIndex = GetIndex();
-			if (queryer(targetKey, *this)) {
-				CheckCycle();
-				if (leftNode != nullptr && P::OverlapLeft(key, targetKey, keyIndex)) {
-					leftNode->Query(targetKey, queryer);
+			// ranged queryer, iterative with an explicit stack. Very deep subtrees fall back to recursion.
+			TKdTree* stack[QUERY_STACK_SIZE];
+			uint32_t top = 0;
+			TKdTree* p = this;
+
+			while (true) {
+				TKdTree* next = nullptr;
+				p->CheckCycle();
+				if (queryer(targetKey, *p)) {
+					KeyType keyIndex = p->GetIndex();
+					if (p->leftNode != nullptr && P::OverlapLeft(p->key, targetKey, keyIndex)) {
+						next = p->leftNode;
+					}
+
+					if (p->rightNode != nullptr && P::OverlapRight(p->key, targetKey, keyIndex)) {
+						if (next == nullptr) {
+							next = p->rightNode;
+						} else if (top < QUERY_STACK_SIZE) {
+							stack[top++] = p->rightNode;
+						} else {
+							next->Query(targetKey, queryer);
+							next = p->rightNode;
+						}
+					}
 				}
-				CheckCycle();
 
-				if (rightNode != nullptr && P::OverlapRight(key, targetKey, keyIndex)) {
-					rightNode->Query(targetKey, queryer);
+				if (next == nullptr) {
+					if (top == 0) break;
+					next = stack[--top];
 				}
 
-				CheckCycle();
+				p = next;
+			}
+		}
+
+		// Batch ranged queryer, traverses the tree once for all targets.
+		// Calls queryer(targetIndex, node) for each visited pair.
+		template <class Q>
+		void QueryBatch(const K* targetKeys, uint32_t targetCount, Q& queryer) {
+			struct Frame {
+				TKdTree* node;
+				uint32_t offset;
+				uint32_t count;
+			};
+
+			std::vector<uint32_t> actives(targetCount);
+			for (uint32_t i = 0; i < targetCount; i++) {
+				actives[i] = i;
+			}
+
+			std::vector<Frame> stack;
+			Frame frame = { this, 0, targetCount };
+
+			while (true) {
+				TKdTree* p = frame.node;
+				KeyType keyIndex = p->GetIndex();
+				uint32_t leftOffset = safe_cast<uint32_t>(actives.size());
+
+				// targets continuing to the left subtree
+				for (uint32_t i = 0; i < frame.count; i++) {
+					uint32_t index = actives[frame.offset + i];
+					if (queryer(index, *p)) {
+						if (p->leftNode != nullptr && P::OverlapLeft(p->key, targetKeys[index], keyIndex)) {
+							actives.push_back(index);
+						}
+
+						if (p->rightNode != nullptr && P::OverlapRight(p->key, targetKeys[index], keyIndex)) {
+							// mark right candidates, collected below
+							actives[frame.offset + i] = index | 0x80000000u;
+						}
+					}
+				}
+
+				uint32_t rightOffset = safe_cast<uint32_t>(actives.size());
+				for (uint32_t j = 0; j < frame.count; j++) {
+					uint32_t& v = actives[frame.offset + j];
+					if (v & 0x80000000u) {
+						v &= ~0x80000000u;
+						actives.push_back(v);
+					}
+				}
+
+				uint32_t end = safe_cast<uint32_t>(actives.size());
+				if (end != rightOffset) {
+					Frame right = { p->rightNode, rightOffset, end - rightOffset };
+					stack.push_back(right);
+				}
+
+				if (rightOffset != leftOffset) {
+					frame.node = p->leftNode;
+					frame.offset = leftOffset;
+					frame.count = rightOffset - leftOffset;
+				} else if (!stack.empty()) {
+					frame = stack.back();
+					stack.pop_back();
+					// all frames above are done
+					actives.resize(frame.offset + frame.count);
+				} else {
+					break;
+				}
 			}
 		}
 
+		typedef typename P::type DistanceType;
+		typedef std::pair<DistanceType, TKdTree*> NearestNode;
+
+		// k-nearest neighbors of targetKey by P::Distance. Fills results sorted by distance, returns the number found.
+		inline uint32_t QueryNearest(const K& targetKey, NearestNode* results, uint32_t count) {
+			uint32_t found = 0;
+			if (count != 0) {
+				QueryNearestFrom(this, DistanceType(0), targetKey, results, count, found);
+				std::sort_heap(results, results + found);
+			}
+
+			return found;
+		}
+
+		// Front-to-back ray traversal. Calls queryer(node, tmin) for each node whose key is hit within [tmin, tmax].
+		// queryer returns the new tmax (e.g. the distance of a confirmed hit), farther nodes are culled then.
+		template <class R, class Q>
+		inline void QueryRay(const R& origin, const R& direction, DistanceType tmin, DistanceType tmax, Q& queryer) {
+			QueryRayFrom(this, origin, direction, tmin, tmax, tmax, queryer);
+		}
+
 		inline const K& GetKey() const {
 			return key;
 		}
@@ -175,6 +487,139 @@ namespace PaintsNow {
 		}
 
 	protected:
+		static void QueryNearestFrom(TKdTree* p, DistanceType bound, const K& targetKey, NearestNode* results, uint32_t count, uint32_t& found) {
+			NearestNode stack[QUERY_STACK_SIZE];
+			uint32_t top = 0;
+
+			while (true) {
+				if (found < count || bound < results[0].first) {
+					p->CheckCycle();
+					DistanceType d = P::Distance(p->key, targetKey);
+					if (found < count) {
+						results[found++] = NearestNode(d, p);
+						std::push_heap(results, results + found);
+					} else if (d < results[0].first) {
+						std::pop_heap(results, results + found);
+						results[found - 1] = NearestNode(d, p);
+						std::push_heap(results, results + found);
+					}
+
+					KeyType keyIndex = p->GetIndex();
+					NearestNode left(Math::Max(bound, P::DistanceLeft(p->key, targetKey, keyIndex)), p->leftNode);
+					NearestNode right(Math::Max(bound, P::DistanceRight(p->key, targetKey, keyIndex)), p->rightNode);
+					if (left.second == nullptr || (right.second != nullptr && right.first < left.first)) {
+						std::swap(left, right);
+					}
+
+					// visit the nearer one first
+					if (right.second != nullptr) {
+						if (top < QUERY_STACK_SIZE) {
+							stack[top++] = right;
+						} else {
+							QueryNearestFrom(right.second, right.first, targetKey, results, count, found);
+						}
+					}
+
+					if (left.second != nullptr) {
+						p = left.second;
+						bound = left.first;
+						continue;
+					}
+				}
+
+				if (top == 0) break;
+				p = stack[--top].second;
+				bound = stack[top].first;
+			}
+		}
+
+		// Clips [tmin, tmax] to the part of the ray where origin + t * direction is above (or below) s.
+		static inline bool ClipRay(DistanceType o, DistanceType dir, DistanceType s, bool above, DistanceType& tmin, DistanceType& tmax) {
+			if (dir == DistanceType(0)) {
+				return above ? !(o < s) : !(s < o);
+			} else {
+				DistanceType t = (s - o) / dir;
+				if ((dir > DistanceType(0)) == above) {
+					tmin = Math::Max(tmin, t);
+				} else {
+					tmax = Math::Min(tmax, t);
+				}
+
+				return !(tmax < tmin);
+			}
+		}
+
+		struct RaySpan {
+			TKdTree* node;
+			DistanceType tmin;
+			DistanceType tmax;
+		};
+
+		template <class R, class Q>
+		static void QueryRayFrom(TKdTree* p, const R& origin, const R& direction, DistanceType tmin, DistanceType spanMax, DistanceType& tmax, Q& queryer) {
+			const uint16_t dimension = P::size / 2;
+			RaySpan stack[QUERY_STACK_SIZE];
+			uint32_t top = 0;
+
+			while (true) {
+				spanMax = Math::Min(spanMax, tmax);
+				if (!(spanMax < tmin)) {
+					p->CheckCycle();
+					// slab test on node key
+					DistanceType hitMin = tmin, hitMax = spanMax;
+					bool hit = true;
+					for (uint16_t d = 0; d < dimension && hit; d++) {
+						hit = ClipRay(origin[d], direction[d], P::Get(p->key, d), true, hitMin, hitMax)
+							&& ClipRay(origin[d], direction[d], P::Get(p->key, d + dimension), false, hitMin, hitMax);
+					}
+
+					if (hit) {
+						tmax = Math::Min(tmax, queryer(*p, hitMin));
+					}
+
+					// clip ray span to the half spaces of children
+					KeyType keyIndex = p->GetIndex();
+					RaySpan left = { p->leftNode, tmin, Math::Min(spanMax, tmax) };
+					RaySpan right = { p->rightNode, tmin, Math::Min(spanMax, tmax) };
+					if (keyIndex >= dimension) {
+						if (left.node != nullptr && !ClipRay(origin[keyIndex - dimension], direction[keyIndex - dimension], P::Get(p->key, keyIndex), false, left.tmin, left.tmax)) {
+							left.node = nullptr;
+						}
+					} else {
+						if (right.node != nullptr && !ClipRay(origin[keyIndex], direction[keyIndex], P::Get(p->key, keyIndex), true, right.tmin, right.tmax)) {
+							right.node = nullptr;
+						}
+					}
+
+					if (left.node == nullptr || (right.node != nullptr && right.tmin < left.tmin)) {
+						std::swap(left, right);
+					}
+
+					// visit the nearer one first
+					if (right.node != nullptr) {
+						if (top < QUERY_STACK_SIZE) {
+							stack[top++] = right;
+						} else {
+							QueryRayFrom(right.node, origin, direction, right.tmin, right.tmax, tmax, queryer);
+						}
+					}
+
+					if (left.node != nullptr) {
+						p = left.node;
+						tmin = left.tmin;
+						spanMax = left.tmax;
+						continue;
+					}
+				}
+
+				if (top == 0) break;
+				const RaySpan& span = stack[--top];
+				p = span.node;
+				tmin = span.tmin;
+				spanMax = span.tmax;
+			}
+		}
+
 		TKdTree* PlaceDown() {
 			TKdTree* savedParent = GetParent();
 			if (savedParent != nullptr) {
@@ -268,7 +713,8 @@ namespace PaintsNow {
 			return p;
 		}
 
-		inline void Merge(TKdTree* tree) {
+		// returns the depth of inserted tree
+		inline uint32_t Merge(TKdTree* tree) {
 			CheckCycle();
 			assert(tree->GetParent() == nullptr);
 			KeyType keyIndex = GetIndex();
@@ -278,9 +724,84 @@ namespace PaintsNow {
 			if (*ptr == nullptr) {
 				*ptr = tree;
 				tree->SetParent(this);
+				return 1;
 			} else {
-				(*ptr)->Merge(tree);
+				return (*ptr)->Merge(tree) + 1;
+			}
+		}
+
+		// floor(log(count) / log(1 / alpha)) with alpha = 2 / 3
+		static inline uint32_t GetBalancedHeight(uint32_t count) {
+			return (uint32_t)(log((double)Math::Max(count, (uint32_t)1)) / log(1.5));
+		}
+
+		// The lowest ancestor whose child on the path holds more than 2 / 3 of its weight.
+		static TKdTree* FindScapegoat(TKdTree* node) {
+			uint32_t weight = 1;
+			TKdTree* parent;
+			while ((parent = node->GetParent()) != nullptr) {
+				TKdTree* sibling = parent->leftNode == node ? parent->rightNode : parent->leftNode;
+				uint32_t parentWeight = weight + 1 + (sibling != nullptr ? sibling->GetWeight() : 0);
+				if (weight * 3 > parentWeight * 2) {
+					return parent;
+				}
+
+				node = parent;
+				weight = parentWeight;
+			}
+
+			return nullptr;
+		}
+
+		struct SplitLess {
+			SplitLess(KeyType i) : index(i) {}
+			bool operator () (const TKdTree* lhs, const TKdTree* rhs) const {
+				return P::Compare(rhs->key, lhs->key, index);
+			}
+
+			KeyType index;
+		};
+
+		// Median split on the widest axis of key centers, alternating lower and upper components by depth.
+		static TKdTree* Build(TKdTree** nodes, uint32_t begin, uint32_t end, uint32_t depth) {
+			if (begin >= end) return nullptr;
+
+			typedef typename P::type type;
+			const uint16_t dimension = P::size / 2;
+			type lower[P::size / 2], upper[P::size / 2];
+			for (uint32_t i = begin; i < end; i++) {
+				const K& k = nodes[i]->key;
+				for (uint16_t d = 0; d < dimension; d++) {
+					type center = P::Get(k, d) + P::Get(k, d + dimension);
+					lower[d] = i == begin ? center : Math::Min(lower[d], center);
+					upper[d] = i == begin ? center : Math::Max(upper[d], center);
+				}
+			}
+
+			uint16_t axis = 0;
+			for (uint16_t e = 1; e < dimension; e++) {
+				if (upper[axis] - lower[axis] < upper[e] - lower[e]) {
+					axis = e;
+				}
 			}
+
+			KeyType index = (KeyType)(axis + (depth & 1) * dimension);
+			uint32_t middle = (begin + end) >> 1;
+			std::nth_element(nodes + begin, nodes + middle, nodes + end, SplitLess(index));
+
+			TKdTree* node = nodes[middle];
+			node->SetIndex(index);
+			node->leftNode = Build(nodes, begin, middle, depth + 1);
+			node->rightNode = Build(nodes, middle + 1, end, depth + 1);
+			if (node->leftNode != nullptr) {
+				node->leftNode->SetParent(node);
+			}
+
+			if (node->rightNode != nullptr) {
+				node->rightNode->SetParent(node);
+			}
+
+			return node;
 		}
 
 		K key;													// 0	: Float3Pair => 24 Bytes
@@ -295,4 +816,717 @@ namespace PaintsNow {
 			} links;
 		};
 	};
+
+	// Miss mask of two boxes against a query, in the interleaved and negated layout used by TStaticKdTree.
+	// Bit 0 is set if the first box misses and bit 1 if the second one misses.
+	template <class T, size_t N>
+	struct TBoxMissMask {
+		static inline uint32_t Test(const T* query, const T* bounds) {
+			uint32_t mask = 0;
+			for (size_t i = 0; i < N; i++) {
+				mask |= (uint32_t)(query[i] < bounds[i]) << (i & 1);
+			}
+
+			return mask;
+		}
+	};
+
+#if defined(USE_SSE) && !(defined(_MSC_VER) && _MSC_VER <= 1200)
+	template <size_t N>
+	struct TBoxMissMask<float, N> {
+		static inline uint32_t Test(const float* query, const float* bounds) {
+			// N is always multiple of 4 (2 boxes * 2 bounds * dimension)
+			__m128 miss = _mm_cmplt_ps(_mm_loadu_ps(query), _mm_loadu_ps(bounds));
+			for (size_t i = 4; i < N; i += 4) {
+				miss = _mm_or_ps(miss, _mm_cmplt_ps(_mm_loadu_ps(query + i), _mm_loadu_ps(bounds + i)));
+			}
+
+			uint32_t mask = _mm_movemask_ps(miss);
+			return (mask | (mask >> 2)) & 3;
+		}
+	};
+#endif
+
+	// Static KdTree, built in bulk from all keys and stored as an implicit array.
+	// Node of range [begin, end) is the median at (begin + end) / 2, its children are medians of both halves.
+	// Each node keeps bounds of both child subtrees in structure-of-arrays layout: component-major, left and right interleaved,
+	// with upper bounds negated, so that both children are tested against a query with one vector comparison.
+	// Keys are boxes as TOverlap expects: the first half of components are lower bounds and the second half are upper bounds.
+	template <class K, class V = uint32_t, class P = TOverlap<K> >
+	class TStaticKdTree {
+	public:
+		typedef typename P::type type;
+		enum { size = P::size, dimension = P::size / 2, stride = P::size * 2 };
+		enum { QUERY_STACK_SIZE = 64 };
+
+		TStaticKdTree() : source(nullptr), sourceValues(nullptr) {}
+
+		void Clear() {
+			keys.clear();
+			values.clear();
+			bounds.clear();
+		}
+
+		inline uint32_t GetCount() const {
+			return safe_cast<uint32_t>(keys.size());
+		}
+
+		inline const K& GetKey(uint32_t index) const {
+			return keys[index];
+		}
+
+		inline const V& GetValue(uint32_t index) const {
+			return values[index];
+		}
+
+		inline V& GetValue(uint32_t index) {
+			return values[index];
+		}
+
+		void Build(const K* k, const V* v, uint32_t count) {
+			Prepare(k, v, count);
+			BuildRange(0, count, count, 0);
+			Finish();
+		}
+
+		// Parallel build on thread pool E (ThreadPool compatible).
+		// Subtrees larger than grain are split into tasks, the calling thread builds the left halves.
+		template <class E>
+		void Build(E& threadPool, const K* k, const V* v, uint32_t count, uint32_t grain = 4096) {
+			if (!threadPool.IsRunning() || count <= grain) {
+				Build(k, v, count);
+				return;
+			}
+
+			Prepare(k, v, count);
+			std::atomic<uint32_t> pending;
+			pending.store(0, std::memory_order_relaxed);
+			BuildParallel(threadPool, 0, count, count, 0, grain, pending);
+
+			uint32_t threadIndex = threadPool.GetCurrentThreadIndex();
+			if (threadIndex < threadPool.GetThreadCount()) {
+				threadPool.PollWait(pending, ~(uint32_t)0, 0);
+			}
+
+			// non-pooled threads can not poll, just wait for workers
+			while (pending.load(std::memory_order_acquire) != 0) {
+				YieldThread();
+			}
+
+			Finish();
+		}
+
+		// Calls queryer(key, value) for each key overlapping targetKey. Return false in queryer to stop.
+		template <class Q>
+		bool Query(const K& targetKey, Q& queryer) const {
+			type query[stride];
+			MakeQuery(targetKey, query);
+
+			const uint32_t count = GetCount();
+			Range stack[QUERY_STACK_SIZE];
+			uint32_t top = 0;
+			// root bounds are stored as the left child of the virtual node at count
+			Range range = { 0, count };
+			if (count == 0 || (TBoxMissMask<type, stride>::Test(query, &bounds[count * stride]) & 1)) {
+				return true;
+			}
+
+			while (true) {
+				uint32_t middle = (range.begin + range.end) >> 1;
+				if (P::Overlap(keys[middle], targetKey) && !queryer(keys[middle], values[middle])) {
+					return false;
+				}
+
+				uint32_t miss = TBoxMissMask<type, stride>::Test(query, &bounds[middle * stride]);
+				miss |= (uint32_t)(range.begin == middle) | ((uint32_t)(middle + 1 == range.end) << 1);
+
+				if (!(miss & 2)) {
+					// depth of balanced tree never exceeds stack size
+					assert(top < QUERY_STACK_SIZE);
+					Range right = { middle + 1, range.end };
+					stack[top++] = right;
+				}
+
+				if (!(miss & 1)) {
+					range.end = middle;
+				} else if (top != 0) {
+					range = stack[--top];
+				} else {
+					break;
+				}
+			}
+
+			return true;
+		}
+
+		// Batch query, traverses the tree once for all targets.
+		// Calls queryer(targetIndex, key, value) for each overlapping pair. Return false in queryer to stop.
+		template <class Q>
+		bool QueryBatch(const K* targetKeys, uint32_t targetCount, Q& queryer) const {
+			const uint32_t count = GetCount();
+			if (count == 0) {
+				return true;
+			}
+
+			std::vector<type> queries(targetCount * stride);
+			std::vector<uint32_t> actives;
+			actives.reserve(targetCount * 2);
+			for (uint32_t i = 0; i < targetCount; i++) {
+				MakeQuery(targetKeys[i], &queries[i * stride]);
+				if (!(TBoxMissMask<type, stride>::Test(&queries[i * stride], &bounds[count * stride]) & 1)) {
+					actives.push_back(i);
+				}
+			}
+
+			std::vector<Frame> stack;
+			Frame frame = { 0, count, 0, safe_cast<uint32_t>(actives.size()) };
+			if (frame.activeCount == 0) {
+				return true;
+			}
+
+			std::vector<uint32_t> rights;
+			while (true) {
+				uint32_t middle = (frame.begin + frame.end) >> 1;
+				uint32_t empty = (uint32_t)(frame.begin == middle) | ((uint32_t)(middle + 1 == frame.end) << 1);
+				uint32_t leftOffset = safe_cast<uint32_t>(actives.size());
+				rights.clear();
+
+				for (uint32_t i = 0; i < frame.activeCount; i++) {
+					uint32_t index = actives[frame.activeOffset + i];
+					if (P::Overlap(keys[middle], targetKeys[index]) && !queryer(index, keys[middle], values[middle])) {
+						return false;
+					}
+
+					uint32_t miss = TBoxMissMask<type, stride>::Test(&queries[index * stride], &bounds[middle * stride]) | empty;
+					if (!(miss & 1)) {
+						actives.push_back(index);
+					}
+
+					if (!(miss & 2)) {
+						rights.push_back(index);
+					}
+				}
+
+				uint32_t rightOffset = safe_cast<uint32_t>(actives.size());
+				if (!rights.empty()) {
+					actives.insert(actives.end(), rights.begin(), rights.end());
+					Frame right = { middle + 1, frame.end, rightOffset, safe_cast<uint32_t>(rights.size()) };
+					stack.push_back(right);
+				}
+
+				if (rightOffset != leftOffset) {
+					frame.end = middle;
+					frame.activeOffset = leftOffset;
+					frame.activeCount = rightOffset - leftOffset;
+				} else if (!stack.empty()) {
+					frame = stack.back();
+					stack.pop_back();
+					// all frames above are done
+					actives.resize(frame.activeOffset + frame.activeCount);
+				} else {
+					break;
+				}
+			}
+
+			return true;
+		}
+
+		// Hierarchical culling, e.g. with TFrustum. culler.Classify(lower, upper) returns 0 for boxes outside, 2 for boxes inside and 1 otherwise,
+		// lower and upper are arrays of dimension components. Subtrees outside are skipped and subtrees inside are reported without further tests.
+		// Calls queryer(key, value) for each key not outside. Return false in queryer to stop.
+		template <class C, class Q>
+		bool Cull(const C& culler, Q& queryer) const {
+			const uint32_t count = GetCount();
+			if (count == 0) {
+				return true;
+			}
+
+			CullRange stack[QUERY_STACK_SIZE];
+			uint32_t top = 0;
+			CullRange range = { 0, count, ClassifyBounds(culler, count, 0) };
+			if (range.state == 0) {
+				return true;
+			}
+
+			while (true) {
+				uint32_t middle = (range.begin + range.end) >> 1;
+				if (range.state == 2 || ClassifyKey(culler, keys[middle]) != 0) {
+					if (!queryer(keys[middle], values[middle])) {
+						return false;
+					}
+				}
+
+				CullRange left = { range.begin, middle, range.state };
+				CullRange right = { middle + 1, range.end, range.state };
+				if (range.state != 2) {
+					left.state = left.begin == left.end ? 0 : ClassifyBounds(culler, middle, 0);
+					right.state = right.begin == right.end ? 0 : ClassifyBounds(culler, middle, 1);
+				} else {
+					left.state = left.begin == left.end ? 0 : 2;
+					right.state = right.begin == right.end ? 0 : 2;
+				}
+
+				if (right.state != 0) {
+					assert(top < QUERY_STACK_SIZE);
+					stack[top++] = right;
+				}
+
+				if (left.state != 0) {
+					range = left;
+				} else if (top != 0) {
+					range = stack[--top];
+				} else {
+					break;
+				}
+			}
+
+			return true;
+		}
+
+		// Front-to-back ray traversal, e.g. with TRay. ray.Intersect(lower, upper, tmin, tmax) clips [tmin, tmax] to box [lower, upper]
+		// and returns false if nothing remains, lower and upper are arrays of dimension components.
+		// Calls queryer(key, value, tmin) for each key hit within [tmin, tmax], with the entry distance as tmin.
+		// queryer returns the new tmax (e.g. the distance of a confirmed hit), farther subtrees are culled then.
+		template <class R, class Q>
+		void QueryRay(const R& ray, type tmin, type tmax, Q& queryer) const {
+			const uint32_t count = GetCount();
+			RayRange stack[QUERY_STACK_SIZE];
+			uint32_t top = 0;
+			RayRange range = { 0, count, tmin };
+			if (count == 0 || !IntersectBounds(ray, count, 0, range.tmin, tmax)) {
+				return;
+			}
+
+			while (true) {
+				// entry distances only grow down the tree, so farther ranges stay culled
+				if (!(tmax < range.tmin)) {
+					uint32_t middle = (range.begin + range.end) >> 1;
+					type enter = tmin, leave = tmax;
+					if (IntersectKey(ray, keys[middle], enter, leave)) {
+						tmax = Math::Min(tmax, queryer(keys[middle], values[middle], enter));
+					}
+
+					RayRange left = { range.begin, middle, tmin };
+					RayRange right = { middle + 1, range.end, tmin };
+					bool leftHit = left.begin != left.end && IntersectBounds(ray, middle, 0, left.tmin, tmax);
+					bool rightHit = right.begin != right.end && IntersectBounds(ray, middle, 1, right.tmin, tmax);
+
+					// visit the nearer one first
+					if (!leftHit || (rightHit && right.tmin < left.tmin)) {
+						std::swap(left, right);
+						std::swap(leftHit, rightHit);
+					}
+
+					if (rightHit) {
+						assert(top < QUERY_STACK_SIZE);
+						stack[top++] = right;
+					}
+
+					if (leftHit) {
+						range = left;
+						continue;
+					}
+				}
+
+				if (top == 0) break;
+				range = stack[--top];
+			}
+		}
+
+	protected:
+		struct Range {
+			uint32_t begin;
+			uint32_t end;
+		};
+
+		struct CullRange {
+			uint32_t begin;
+			uint32_t end;
+			uint32_t state;
+		};
+
+		struct RayRange {
+			uint32_t begin;
+			uint32_t end;
+			type tmin;
+		};
+
+		template <class C>
+		inline uint32_t ClassifyBounds(const C& culler, uint32_t node, uint32_t side) const {
+			type lower[dimension], upper[dimension];
+			const type* slot = &bounds[node * stride + side];
+			for (uint32_t c = 0; c < dimension; c++) {
+				lower[c] = slot[2 * c];
+				upper[c] = -slot[2 * (c + dimension)];
+			}
+
+			return culler.Classify(lower, upper);
+		}
+
+		template <class C>
+		static inline uint32_t ClassifyKey(const C& culler, const K& key) {
+			type lower[dimension], upper[dimension];
+			for (uint32_t c = 0; c < dimension; c++) {
+				lower[c] = P::Get(key, c);
+				upper[c] = P::Get(key, c + dimension);
+			}
+
+			return culler.Classify(lower, upper);
+		}
+
+		template <class R>
+		inline bool IntersectBounds(const R& ray, uint32_t node, uint32_t side, type& tmin, type tmax) const {
+			type lower[dimension], upper[dimension];
+			const type* slot = &bounds[node * stride + side];
+			for (uint32_t c = 0; c < dimension; c++) {
+				lower[c] = slot[2 * c];
+				upper[c] = -slot[2 * (c + dimension)];
+			}
+
+			return ray.Intersect(lower, upper, tmin, tmax);
+		}
+
+		template <class R>
+		static inline bool IntersectKey(const R& ray, const K& key, type& tmin, type& tmax) {
+			type lower[dimension], upper[dimension];
+			for (uint32_t c = 0; c < dimension; c++) {
+				lower[c] = P::Get(key, c);
+				upper[c] = P::Get(key, c + dimension);
+			}
+
+			return ray.Intersect(lower, upper, tmin, tmax);
+		}
+
+		struct Frame {
+			uint32_t begin;
+			uint32_t end;
+			uint32_t activeOffset;
+			uint32_t activeCount;
+		};
+
+		// query[2 * c + side] is compared against bounds[2 * c + side]: a box misses if query < bounds for any component.
+		static inline void MakeQuery(const K& targetKey, type* query) {
+			for (uint32_t c = 0; c < dimension; c++) {
+				query[2 * c] = query[2 * c + 1] = P::Get(targetKey, c + dimension);
+				query[2 * (c + dimension)] = query[2 * (c + dimension) + 1] = -P::Get(targetKey, c);
+			}
+		}
+
+		struct Compare {
+			Compare(const K* k, uint32_t a) : source(k), axis(a) {}
+			bool operator () (uint32_t lhs, uint32_t rhs) const {
+				// compare by box centers (doubled)
+				return P::Get(source[lhs], axis) + P::Get(source[lhs], axis + dimension) < P::Get(source[rhs], axis) + P::Get(source[rhs], axis + dimension);
+			}
+
+			const K* source;
+			uint32_t axis;
+		};
+
+		void Prepare(const K* k, const V* v, uint32_t count) {
+			source = k;
+			sourceValues = v;
+			indices.resize(count);
+			for (uint32_t i = 0; i < count; i++) {
+				indices[i] = i;
+			}
+
+			// one more virtual node for root bounds
+			bounds.resize(0);
+			bounds.resize((count + 1) * stride, type(0));
+		}
+
+		void Finish() {
+			uint32_t count = safe_cast<uint32_t>(indices.size());
+			keys.resize(count);
+			values.resize(count);
+			for (uint32_t i = 0; i < count; i++) {
+				keys[i] = source[indices[i]];
+				values[i] = sourceValues[indices[i]];
+			}
+
+			std::vector<uint32_t>().swap(indices);
+			source = nullptr;
+			sourceValues = nullptr;
+		}
+
+		// Computes subtree bounds into the slot of its parent, then partitions the range around the median of the widest axis.
+		uint32_t Split(uint32_t begin, uint32_t end, uint32_t parent, uint32_t side) {
+			type box[size];
+			const K& first = source[indices[begin]];
+			for (uint32_t c = 0; c < size; c++) {
+				box[c] = P::Get(first, c);
+			}
+
+			for (uint32_t i = begin + 1; i < end; i++) {
+				const K& key = source[indices[i]];
+				for (uint32_t c = 0; c < dimension; c++) {
+					box[c] = Math::Min(box[c], P::Get(key, c));
+					box[c + dimension] = Math::Max(box[c + dimension], P::Get(key, c + dimension));
+				}
+			}
+
+			type* slot = &bounds[parent * stride + side];
+			for (uint32_t c = 0; c < dimension; c++) {
+				slot[2 * c] = box[c];
+				slot[2 * (c + dimension)] = -box[c + dimension];
+			}
+
+			uint32_t axis = 0;
+			for (uint32_t d = 1; d < dimension; d++) {
+				if (box[axis + dimension] - box[axis] < box[d + dimension] - box[d]) {
+					axis = d;
+				}
+			}
+
+			uint32_t middle = (begin + end) >> 1;
+			std::nth_element(indices.begin() + begin, indices.begin() + middle, indices.begin() + end, Compare(source, axis));
+
+			return middle;
+		}
+
+		void BuildRange(uint32_t begin, uint32_t end, uint32_t parent, uint32_t side) {
+			while (begin < end) {
+				uint32_t middle = Split(begin, end, parent, side);
+				BuildRange(begin, middle, middle, 0);
+				begin = middle + 1;
+				parent = middle;
+				side = 1;
+			}
+		}
+
+		template <class E>
+		class BuildTask : public TaskOnce {
+		public:
+			BuildTask(TStaticKdTree* t, E& pool, uint32_t b, uint32_t e, uint32_t p, uint32_t g, std::atomic<uint32_t>& c) : tree(t), threadPool(pool), begin(b), end(e), parent(p), grain(g), pending(c) {}
+
+			void Execute(void* context) override {
+				tree->BuildParallel(threadPool, begin, end, parent, 1, grain, pending);
+				pending.fetch_sub(1, std::memory_order_release);
+				ITask::Delete(this);
+			}
+
+			void Abort(void* context) override {
+				// the tree must be complete anyway
+				tree->BuildRange(begin, end, parent, 1);
+				pending.fetch_sub(1, std::memory_order_release);
+				ITask::Delete(this);
+			}
+
+			TStaticKdTree* tree;
+			E& threadPool;
+			uint32_t begin;
+			uint32_t end;
+			uint32_t parent;
+			uint32_t grain;
+			std::atomic<uint32_t>& pending;
+		};
+
+		template <class E>
+		void BuildParallel(E& threadPool, uint32_t begin, uint32_t end, uint32_t parent, uint32_t side, uint32_t grain, std::atomic<uint32_t>& pending) {
+			while (end - begin > grain) {
+				uint32_t middle = Split(begin, end, parent, side);
+				if (middle + 1 < end) {
+					pending.fetch_add(1, std::memory_order_relaxed);
+					ITask* task = new (ITask::Allocate(sizeof(BuildTask<E>))) BuildTask<E>(this, threadPool, middle + 1, end, middle, grain, pending);
+					if (!threadPool.Push(task)) {
+						task->Execute(nullptr);
+					}
+				}
+
+				end = middle;
+				parent = middle;
+				side = 0;
+			}
+
+			BuildRange(begin, end, parent, side);
+		}
+
+		std::vector<K> keys;
+		std::vector<V> values;
+		std::vector<type> bounds;
+
+		// build states
+		std::vector<uint32_t> indices;
+		const K* source;
+		const V* sourceValues;
+	};
+
+	// Double-buffered TStaticKdTree for concurrent reads during batched writes.
+	// One writer stages changes by handles and publishes a new snapshot atomically, readers on any thread query the current one.
+	// A buffer is rebuilt only after all readers of it have released, so readers always see a consistent version.
+	template <class K, class V = uint32_t, class P = TOverlap<K> >
+	class TSnapshotKdTree {
+	public:
+		typedef TStaticKdTree<K, V, P> Tree;
+
+		TSnapshotKdTree() {
+			current.store(0, std::memory_order_relaxed);
+			slots[0].readers.store(0, std::memory_order_relaxed);
+			slots[1].readers.store(0, std::memory_order_relaxed);
+		}
+
+		// Writer side, must be externally serialized.
+		uint32_t Insert(const K& key, const V& value) {
+			uint32_t handle;
+			if (!freeHandles.empty()) {
+				handle = freeHandles.back();
+				freeHandles.pop_back();
+				keys[handle] = key;
+				values[handle] = value;
+				alives[handle] = 1;
+			} else {
+				handle = safe_cast<uint32_t>(keys.size());
+				keys.push_back(key);
+				values.push_back(value);
+				alives.push_back(1);
+			}
+
+			return handle;
+		}
+
+		void Remove(uint32_t handle) {
+			assert(alives[handle]);
+			alives[handle] = 0;
+			freeHandles.push_back(handle);
+		}
+
+		void Update(uint32_t handle, const K& key) {
+			assert(alives[handle]);
+			keys[handle] = key;
+		}
+
+		void UpdateBatch(const uint32_t* handles, const K* k, uint32_t count) {
+			for (uint32_t i = 0; i < count; i++) {
+				Update(handles[i], k[i]);
+			}
+		}
+
+		inline const K& GetKey(uint32_t handle) const {
+			return keys[handle];
+		}
+
+		inline V& GetValue(uint32_t handle) {
+			return values[handle];
+		}
+
+		// Publishes staged changes as a new snapshot.
+		void Publish() {
+			uint32_t back = current.load(std::memory_order_relaxed) ^ 1;
+			while (slots[back].readers.load() != 0) {
+				YieldThread();
+			}
+
+			Compact();
+			slots[back].tree.Build(buildKeys.empty() ? nullptr : &buildKeys[0], buildValues.empty() ? nullptr : &buildValues[0], safe_cast<uint32_t>(buildKeys.size()));
+			current.store(back);
+		}
+
+		// Publishes with parallel build on thread pool E (ThreadPool compatible).
+		template <class E>
+		void Publish(E& threadPool) {
+			uint32_t back = current.load(std::memory_order_relaxed) ^ 1;
+			if (threadPool.GetCurrentThreadIndex() < threadPool.GetThreadCount()) {
+				threadPool.PollWait(slots[back].readers, ~(uint32_t)0, 0);
+			}
+
+			while (slots[back].readers.load() != 0) {
+				YieldThread();
+			}
+
+			Compact();
+			slots[back].tree.Build(threadPool, buildKeys.empty() ? nullptr : &buildKeys[0], buildValues.empty() ? nullptr : &buildValues[0], safe_cast<uint32_t>(buildKeys.size()));
+			current.store(back);
+		}
+
+		// Reader side, can be called from any thread.
+		// Acquire() pins the current snapshot, use GetSnapshot() to access it and Release() when finished.
+		uint32_t Acquire() {
+			while (true) {
+				uint32_t index = current.load();
+				slots[index].readers.fetch_add(1);
+				// the writer may have flipped and started rebuilding before we pinned it
+				if (current.load() == index) {
+					return index;
+				}
+
+				slots[index].readers.fetch_sub(1, std::memory_order_release);
+			}
+		}
+
+		inline const Tree& GetSnapshot(uint32_t token) const {
+			return slots[token].tree;
+		}
+
+		inline void Release(uint32_t token) {
+			slots[token].readers.fetch_sub(1, std::memory_order_release);
+		}
+
+		template <class Q>
+		bool Query(const K& targetKey, Q& queryer) {
+			uint32_t token = Acquire();
+			bool result = slots[token].tree.Query(targetKey, queryer);
+			Release(token);
+
+			return result;
+		}
+
+		template <class Q>
+		bool QueryBatch(const K* targetKeys, uint32_t targetCount, Q& queryer) {
+			uint32_t token = Acquire();
+			bool result = slots[token].tree.QueryBatch(targetKeys, targetCount, queryer);
+			Release(token);
+
+			return result;
+		}
+
+		template <class C, class Q>
+		bool Cull(const C& culler, Q& queryer) {
+			uint32_t token = Acquire();
+			bool result = slots[token].tree.Cull(culler, queryer);
+			Release(token);
+
+			return result;
+		}
+
+		template <class R, class Q>
+		void QueryRay(const R& ray, typename Tree::type tmin, typename Tree::type tmax, Q& queryer) {
+			uint32_t token = Acquire();
+			slots[token].tree.QueryRay(ray, tmin, tmax, queryer);
+			Release(token);
+		}
+
+	protected:
+		void Compact() {
+			buildKeys.clear();
+			buildValues.clear();
+			for (size_t i = 0; i < keys.size(); i++) {
+				if (alives[i]) {
+					buildKeys.push_back(keys[i]);
+					buildValues.push_back(values[i]);
+				}
+			}
+		}
+
+		// Reader counts are written by every query, so they are kept a cache line apart from current and from the trees.
+		// Padded instead of aligned, so snapshots can still be allocated with plain new.
+		struct Slot {
+			std::atomic<uint32_t> readers;
+			uint8_t readersPadding[CPU_CACHELINE_SIZE - sizeof(uint32_t)];
+			Tree tree;
+			uint8_t treePadding[CPU_CACHELINE_SIZE];
+		};
+
+		std::atomic<uint32_t> current;
+		uint8_t currentPadding[CPU_CACHELINE_SIZE - sizeof(uint32_t)];
+		Slot slots[2];
+
+		// staging states of writer
+		std::vector<K> keys;
+		std::vector<V> values;
+		std::vector<uint8_t> alives;
+		std::vector<uint32_t> freeHandles;
+		std::vector<K> buildKeys;
+		std::vector<V> buildValues;
+	};
 }
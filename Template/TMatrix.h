@@ -172,7 +172,26 @@ namespace PaintsNow {
 	}
 #endif
 
-#ifdef USE_SSE
+#if defined(USE_AVX512)
+	template <>
+	inline TMatrix<float, 4, 4> operator * (const TMatrix<float, 4, 4>& lhs, const TMatrix<float, 4, 4>& rhs) {
+		// whole matrix in one register, in-lane permutes broadcast lhs(i, k) to row i
+		TMatrix<float, 4, 4> ret;
+		__m512 l = _mm512_loadu_ps(&lhs.data[0][0]);
+		__m512 r0 = _mm512_broadcast_f32x4(LoadVector4f(rhs(0)));
+		__m512 r1 = _mm512_broadcast_f32x4(LoadVector4f(rhs(1)));
+		__m512 r2 = _mm512_broadcast_f32x4(LoadVector4f(rhs(2)));
+		__m512 r3 = _mm512_broadcast_f32x4(LoadVector4f(rhs(3)));
+
+		__m512 a = _mm512_mul_ps(_mm512_permute_ps(l, _MM_SHUFFLE(0, 0, 0, 0)), r0);
+		a = _mm512_fmadd_ps(_mm512_permute_ps(l, _MM_SHUFFLE(1, 1, 1, 1)), r1, a);
+		a = _mm512_fmadd_ps(_mm512_permute_ps(l, _MM_SHUFFLE(2, 2, 2, 2)), r2, a);
+		a = _mm512_fmadd_ps(_mm512_permute_ps(l, _MM_SHUFFLE(3, 3, 3, 3)), r3, a);
+		_mm512_storeu_ps(&ret.data[0][0], a);
+
+		return ret;
+	}
+#elif defined(USE_SSE)
 	template <>
 	inline TMatrix<float, 4, 4> operator * (const TMatrix<float, 4, 4>& lhs, const TMatrix<float, 4, 4>& rhs) {
 		// SIMD from glm library
@@ -258,6 +277,48 @@ namespace PaintsNow {
 	}
 #endif
 
+#if defined(USE_AVX512)
+	template <>
+	inline TMatrix<double, 4, 4> operator * (const TMatrix<double, 4, 4>& lhs, const TMatrix<double, 4, 4>& rhs) {
+		// two rows per register, permutes within 256-bit lanes broadcast lhs(i, k) to row i
+		TMatrix<double, 4, 4> ret;
+		__m512d r0 = _mm512_broadcast_f64x4(_mm256_loadu_pd(&rhs.data[0][0]));
+		__m512d r1 = _mm512_broadcast_f64x4(_mm256_loadu_pd(&rhs.data[1][0]));
+		__m512d r2 = _mm512_broadcast_f64x4(_mm256_loadu_pd(&rhs.data[2][0]));
+		__m512d r3 = _mm512_broadcast_f64x4(_mm256_loadu_pd(&rhs.data[3][0]));
+
+		for (size_t i = 0; i < 4; i += 2) {
+			__m512d l = _mm512_loadu_pd(&lhs.data[i][0]);
+			__m512d a = _mm512_mul_pd(_mm512_permutex_pd(l, _MM_SHUFFLE(0, 0, 0, 0)), r0);
+			a = _mm512_fmadd_pd(_mm512_permutex_pd(l, _MM_SHUFFLE(1, 1, 1, 1)), r1, a);
+			a = _mm512_fmadd_pd(_mm512_permutex_pd(l, _MM_SHUFFLE(2, 2, 2, 2)), r2, a);
+			a = _mm512_fmadd_pd(_mm512_permutex_pd(l, _MM_SHUFFLE(3, 3, 3, 3)), r3, a);
+			_mm512_storeu_pd(&ret.data[i][0], a);
+		}
+
+		return ret;
+	}
+#elif defined(USE_AVX)
+	template <>
+	inline TMatrix<double, 4, 4> operator * (const TMatrix<double, 4, 4>& lhs, const TMatrix<double, 4, 4>& rhs) {
+		TMatrix<double, 4, 4> ret;
+		__m256d r0 = LoadVector4d(rhs(0));
+		__m256d r1 = LoadVector4d(rhs(1));
+		__m256d r2 = LoadVector4d(rhs(2));
+		__m256d r3 = LoadVector4d(rhs(3));
+
+		for (size_t i = 0; i < 4; i++) {
+			__m256d m0 = _mm256_mul_pd(r0, _mm256_broadcast_sd(&lhs.data[i][0]));
+			__m256d m1 = _mm256_mul_pd(r1, _mm256_broadcast_sd(&lhs.data[i][1]));
+			__m256d m2 = _mm256_mul_pd(r2, _mm256_broadcast_sd(&lhs.data[i][2]));
+			__m256d m3 = _mm256_mul_pd(r3, _mm256_broadcast_sd(&lhs.data[i][3]));
+			ret(i) = StoreVector4d(_mm256_add_pd(_mm256_add_pd(m0, m1), _mm256_add_pd(m2, m3)));
+		}
+
+		return ret;
+	}
+#endif
+
 	template <class T, size_t m, size_t n>
 	TVector<T, n> operator * (const TVector<T, m>& value, const TMatrix<T, m, n>& rhs) {
 		TVector<T, n> ret;
@@ -616,6 +677,533 @@ namespace PaintsNow {
 			return result;
 		}
 #endif
+
+#ifdef USE_AVX2
+		// _mm_shuffle_ps for 4 doubles: lanes 0, 1 from a and lanes 2, 3 from b
+		template <int imm>
+		inline __m256d Shuffle4d(__m256d a, __m256d b) {
+			return _mm256_blend_pd(_mm256_permute4x64_pd(a, imm), _mm256_permute4x64_pd(b, imm), 0xC);
+		}
+
+		inline __m256d Dot4d(__m256d a, __m256d b) {
+			__m256d t = _mm256_mul_pd(a, b);
+			t = _mm256_add_pd(t, _mm256_permute4x64_pd(t, _MM_SHUFFLE(2, 3, 0, 1)));
+			return _mm256_add_pd(t, _mm256_permute4x64_pd(t, _MM_SHUFFLE(1, 0, 3, 2)));
+		}
+
+		// From GLM, _mm_shuffle_ps is emulated with cross-lane permutes
+		template <>
+		inline TMatrix<double, 4, 4> Inverse(const TMatrix<double, 4, 4>& m) {
+			TMatrix<double, 4, 4> result;
+			__m256d in[4];
+			in[0] = LoadVector4d(m(0));
+			in[1] = LoadVector4d(m(1));
+			in[2] = LoadVector4d(m(2));
+			in[3] = LoadVector4d(m(3));
+
+			__m256d Fac0;
+			{
+				//	valType SubFactor00 = m[2][2] * m[3][3] - m[3][2] * m[2][3];
+				//	valType SubFactor00 = m[2][2] * m[3][3] - m[3][2] * m[2][3];
+				//	valType SubFactor06 = m[1][2] * m[3][3] - m[3][2] * m[1][3];
+				//	valType SubFactor13 = m[1][2] * m[2][3] - m[2][2] * m[1][3];
+
+				__m256d Swp0a = Shuffle4d<_MM_SHUFFLE(3, 3, 3, 3)>(in[3], in[2]);
+				__m256d Swp0b = Shuffle4d<_MM_SHUFFLE(2, 2, 2, 2)>(in[3], in[2]);
+
+				__m256d Swp00 = Shuffle4d<_MM_SHUFFLE(2, 2, 2, 2)>(in[2], in[1]);
+				__m256d Swp01 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0a, Swp0a);
+				__m256d Swp02 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0b, Swp0b);
+				__m256d Swp03 = Shuffle4d<_MM_SHUFFLE(3, 3, 3, 3)>(in[2], in[1]);
+
+				__m256d Mul00 = _mm256_mul_pd(Swp00, Swp01);
+				__m256d Mul01 = _mm256_mul_pd(Swp02, Swp03);
+				Fac0 = _mm256_sub_pd(Mul00, Mul01);
+			}
+
+			__m256d Fac1;
+			{
+				//	valType SubFactor01 = m[2][1] * m[3][3] - m[3][1] * m[2][3];
+				//	valType SubFactor01 = m[2][1] * m[3][3] - m[3][1] * m[2][3];
+				//	valType SubFactor07 = m[1][1] * m[3][3] - m[3][1] * m[1][3];
+				//	valType SubFactor14 = m[1][1] * m[2][3] - m[2][1] * m[1][3];
+
+				__m256d Swp0a = Shuffle4d<_MM_SHUFFLE(3, 3, 3, 3)>(in[3], in[2]);
+				__m256d Swp0b = Shuffle4d<_MM_SHUFFLE(1, 1, 1, 1)>(in[3], in[2]);
+
+				__m256d Swp00 = Shuffle4d<_MM_SHUFFLE(1, 1, 1, 1)>(in[2], in[1]);
+				__m256d Swp01 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0a, Swp0a);
+				__m256d Swp02 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0b, Swp0b);
+				__m256d Swp03 = Shuffle4d<_MM_SHUFFLE(3, 3, 3, 3)>(in[2], in[1]);
+
+				__m256d Mul00 = _mm256_mul_pd(Swp00, Swp01);
+				__m256d Mul01 = _mm256_mul_pd(Swp02, Swp03);
+				Fac1 = _mm256_sub_pd(Mul00, Mul01);
+			}
+
+			__m256d Fac2;
+			{
+				//	valType SubFactor02 = m[2][1] * m[3][2] - m[3][1] * m[2][2];
+				//	valType SubFactor02 = m[2][1] * m[3][2] - m[3][1] * m[2][2];
+				//	valType SubFactor08 = m[1][1] * m[3][2] - m[3][1] * m[1][2];
+				//	valType SubFactor15 = m[1][1] * m[2][2] - m[2][1] * m[1][2];
+
+				__m256d Swp0a = Shuffle4d<_MM_SHUFFLE(2, 2, 2, 2)>(in[3], in[2]);
+				__m256d Swp0b = Shuffle4d<_MM_SHUFFLE(1, 1, 1, 1)>(in[3], in[2]);
+
+				__m256d Swp00 = Shuffle4d<_MM_SHUFFLE(1, 1, 1, 1)>(in[2], in[1]);
+				__m256d Swp01 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0a, Swp0a);
+				__m256d Swp02 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0b, Swp0b);
+				__m256d Swp03 = Shuffle4d<_MM_SHUFFLE(2, 2, 2, 2)>(in[2], in[1]);
+
+				__m256d Mul00 = _mm256_mul_pd(Swp00, Swp01);
+				__m256d Mul01 = _mm256_mul_pd(Swp02, Swp03);
+				Fac2 = _mm256_sub_pd(Mul00, Mul01);
+			}
+
+			__m256d Fac3;
+			{
+				//	valType SubFactor03 = m[2][0] * m[3][3] - m[3][0] * m[2][3];
+				//	valType SubFactor03 = m[2][0] * m[3][3] - m[3][0] * m[2][3];
+				//	valType SubFactor09 = m[1][0] * m[3][3] - m[3][0] * m[1][3];
+				//	valType SubFactor16 = m[1][0] * m[2][3] - m[2][0] * m[1][3];
+
+				__m256d Swp0a = Shuffle4d<_MM_SHUFFLE(3, 3, 3, 3)>(in[3], in[2]);
+				__m256d Swp0b = Shuffle4d<_MM_SHUFFLE(0, 0, 0, 0)>(in[3], in[2]);
+
+				__m256d Swp00 = Shuffle4d<_MM_SHUFFLE(0, 0, 0, 0)>(in[2], in[1]);
+				__m256d Swp01 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0a, Swp0a);
+				__m256d Swp02 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0b, Swp0b);
+				__m256d Swp03 = Shuffle4d<_MM_SHUFFLE(3, 3, 3, 3)>(in[2], in[1]);
+
+				__m256d Mul00 = _mm256_mul_pd(Swp00, Swp01);
+				__m256d Mul01 = _mm256_mul_pd(Swp02, Swp03);
+				Fac3 = _mm256_sub_pd(Mul00, Mul01);
+			}
+
+			__m256d Fac4;
+			{
+				//	valType SubFactor04 = m[2][0] * m[3][2] - m[3][0] * m[2][2];
+				//	valType SubFactor04 = m[2][0] * m[3][2] - m[3][0] * m[2][2];
+				//	valType SubFactor10 = m[1][0] * m[3][2] - m[3][0] * m[1][2];
+				//	valType SubFactor17 = m[1][0] * m[2][2] - m[2][0] * m[1][2];
+
+				__m256d Swp0a = Shuffle4d<_MM_SHUFFLE(2, 2, 2, 2)>(in[3], in[2]);
+				__m256d Swp0b = Shuffle4d<_MM_SHUFFLE(0, 0, 0, 0)>(in[3], in[2]);
+
+				__m256d Swp00 = Shuffle4d<_MM_SHUFFLE(0, 0, 0, 0)>(in[2], in[1]);
+				__m256d Swp01 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0a, Swp0a);
+				__m256d Swp02 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0b, Swp0b);
+				__m256d Swp03 = Shuffle4d<_MM_SHUFFLE(2, 2, 2, 2)>(in[2], in[1]);
+
+				__m256d Mul00 = _mm256_mul_pd(Swp00, Swp01);
+				__m256d Mul01 = _mm256_mul_pd(Swp02, Swp03);
+				Fac4 = _mm256_sub_pd(Mul00, Mul01);
+			}
+
+			__m256d Fac5;
+			{
+				//	valType SubFactor05 = m[2][0] * m[3][1] - m[3][0] * m[2][1];
+				//	valType SubFactor05 = m[2][0] * m[3][1] - m[3][0] * m[2][1];
+				//	valType SubFactor12 = m[1][0] * m[3][1] - m[3][0] * m[1][1];
+				//	valType SubFactor18 = m[1][0] * m[2][1] - m[2][0] * m[1][1];
+
+				__m256d Swp0a = Shuffle4d<_MM_SHUFFLE(1, 1, 1, 1)>(in[3], in[2]);
+				__m256d Swp0b = Shuffle4d<_MM_SHUFFLE(0, 0, 0, 0)>(in[3], in[2]);
+
+				__m256d Swp00 = Shuffle4d<_MM_SHUFFLE(0, 0, 0, 0)>(in[2], in[1]);
+				__m256d Swp01 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0a, Swp0a);
+				__m256d Swp02 = Shuffle4d<_MM_SHUFFLE(2, 0, 0, 0)>(Swp0b, Swp0b);
+				__m256d Swp03 = Shuffle4d<_MM_SHUFFLE(1, 1, 1, 1)>(in[2], in[1]);
+
+				__m256d Mul00 = _mm256_mul_pd(Swp00, Swp01);
+				__m256d Mul01 = _mm256_mul_pd(Swp02, Swp03);
+				Fac5 = _mm256_sub_pd(Mul00, Mul01);
+			}
+
+			__m256d SignA = _mm256_set_pd(1.0, -1.0, 1.0, -1.0);
+			__m256d SignB = _mm256_set_pd(-1.0, 1.0, -1.0, 1.0);
+
+			// m[1][0]
+			// m[0][0]
+			// m[0][0]
+			// m[0][0]
+			__m256d Temp0 = Shuffle4d<_MM_SHUFFLE(0, 0, 0, 0)>(in[1], in[0]);
+			__m256d Vec0 = Shuffle4d<_MM_SHUFFLE(2, 2, 2, 0)>(Temp0, Temp0);
+
+			// m[1][1]
+			// m[0][1]
+			// m[0][1]
+			// m[0][1]
+			__m256d Temp1 = Shuffle4d<_MM_SHUFFLE(1, 1, 1, 1)>(in[1], in[0]);
+			__m256d Vec1 = Shuffle4d<_MM_SHUFFLE(2, 2, 2, 0)>(Temp1, Temp1);
+
+			// m[1][2]
+			// m[0][2]
+			// m[0][2]
+			// m[0][2]
+			__m256d Temp2 = Shuffle4d<_MM_SHUFFLE(2, 2, 2, 2)>(in[1], in[0]);
+			__m256d Vec2 = Shuffle4d<_MM_SHUFFLE(2, 2, 2, 0)>(Temp2, Temp2);
+
+			// m[1][3]
+			// m[0][3]
+			// m[0][3]
+			// m[0][3]
+			__m256d Temp3 = Shuffle4d<_MM_SHUFFLE(3, 3, 3, 3)>(in[1], in[0]);
+			__m256d Vec3 = Shuffle4d<_MM_SHUFFLE(2, 2, 2, 0)>(Temp3, Temp3);
+
+			// col0
+			// + (Vec1[0] * Fac0[0] - Vec2[0] * Fac1[0] + Vec3[0] * Fac2[0]),
+			// - (Vec1[1] * Fac0[1] - Vec2[1] * Fac1[1] + Vec3[1] * Fac2[1]),
+			// + (Vec1[2] * Fac0[2] - Vec2[2] * Fac1[2] + Vec3[2] * Fac2[2]),
+			// - (Vec1[3] * Fac0[3] - Vec2[3] * Fac1[3] + Vec3[3] * Fac2[3]),
+			__m256d Mul00 = _mm256_mul_pd(Vec1, Fac0);
+			__m256d Mul01 = _mm256_mul_pd(Vec2, Fac1);
+			__m256d Mul02 = _mm256_mul_pd(Vec3, Fac2);
+			__m256d Sub00 = _mm256_sub_pd(Mul00, Mul01);
+			__m256d Add00 = _mm256_add_pd(Sub00, Mul02);
+			__m256d Inv0 = _mm256_mul_pd(SignB, Add00);
+
+			// col1
+			// - (Vec0[0] * Fac0[0] - Vec2[0] * Fac3[0] + Vec3[0] * Fac4[0]),
+			// + (Vec0[0] * Fac0[1] - Vec2[1] * Fac3[1] + Vec3[1] * Fac4[1]),
+			// - (Vec0[0] * Fac0[2] - Vec2[2] * Fac3[2] + Vec3[2] * Fac4[2]),
+			// + (Vec0[0] * Fac0[3] - Vec2[3] * Fac3[3] + Vec3[3] * Fac4[3]),
+			__m256d Mul03 = _mm256_mul_pd(Vec0, Fac0);
+			__m256d Mul04 = _mm256_mul_pd(Vec2, Fac3);
+			__m256d Mul05 = _mm256_mul_pd(Vec3, Fac4);
+			__m256d Sub01 = _mm256_sub_pd(Mul03, Mul04);
+			__m256d Add01 = _mm256_add_pd(Sub01, Mul05);
+			__m256d Inv1 = _mm256_mul_pd(SignA, Add01);
+
+			// col2
+			// + (Vec0[0] * Fac1[0] - Vec1[0] * Fac3[0] + Vec3[0] * Fac5[0]),
+			// - (Vec0[0] * Fac1[1] - Vec1[1] * Fac3[1] + Vec3[1] * Fac5[1]),
+			// + (Vec0[0] * Fac1[2] - Vec1[2] * Fac3[2] + Vec3[2] * Fac5[2]),
+			// - (Vec0[0] * Fac1[3] - Vec1[3] * Fac3[3] + Vec3[3] * Fac5[3]),
+			__m256d Mul06 = _mm256_mul_pd(Vec0, Fac1);
+			__m256d Mul07 = _mm256_mul_pd(Vec1, Fac3);
+			__m256d Mul08 = _mm256_mul_pd(Vec3, Fac5);
+			__m256d Sub02 = _mm256_sub_pd(Mul06, Mul07);
+			__m256d Add02 = _mm256_add_pd(Sub02, Mul08);
+			__m256d Inv2 = _mm256_mul_pd(SignB, Add02);
+
+			// col3
+			// - (Vec1[0] * Fac2[0] - Vec1[0] * Fac4[0] + Vec2[0] * Fac5[0]),
+			// + (Vec1[0] * Fac2[1] - Vec1[1] * Fac4[1] + Vec2[1] * Fac5[1]),
+			// - (Vec1[0] * Fac2[2] - Vec1[2] * Fac4[2] + Vec2[2] * Fac5[2]),
+			// + (Vec1[0] * Fac2[3] - Vec1[3] * Fac4[3] + Vec2[3] * Fac5[3]));
+			__m256d Mul09 = _mm256_mul_pd(Vec0, Fac2);
+			__m256d Mul10 = _mm256_mul_pd(Vec1, Fac4);
+			__m256d Mul11 = _mm256_mul_pd(Vec2, Fac5);
+			__m256d Sub03 = _mm256_sub_pd(Mul09, Mul10);
+			__m256d Add03 = _mm256_add_pd(Sub03, Mul11);
+			__m256d Inv3 = _mm256_mul_pd(SignA, Add03);
+
+			__m256d Row0 = Shuffle4d<_MM_SHUFFLE(0, 0, 0, 0)>(Inv0, Inv1);
+			__m256d Row1 = Shuffle4d<_MM_SHUFFLE(0, 0, 0, 0)>(Inv2, Inv3);
+			__m256d Row2 = Shuffle4d<_MM_SHUFFLE(2, 0, 2, 0)>(Row0, Row1);
+
+			//	valType Determinant = m[0][0] * Inverse[0][0]
+			//						+ m[0][1] * Inverse[1][0]
+			//						+ m[0][2] * Inverse[2][0]
+			//						+ m[0][3] * Inverse[3][0];
+			__m256d Det0 = Dot4d(in[0], Row2);
+			__m256d Rcp0 = _mm256_div_pd(_mm256_set1_pd(1.0), Det0);
+
+			//	Inverse /= Determinant;
+			result(0) = StoreVector4d(_mm256_mul_pd(Inv0, Rcp0));
+			result(1) = StoreVector4d(_mm256_mul_pd(Inv1, Rcp0));
+			result(2) = StoreVector4d(_mm256_mul_pd(Inv2, Rcp0));
+			result(3) = StoreVector4d(_mm256_mul_pd(Inv3, Rcp0));
+			return result;
+		}
+#endif
+
+		// Batch versions of Inverse and QuickInverse, out may be the same array as in.
+		template <class T>
+		void Inverse(const TMatrix<T, 4, 4>* in, TMatrix<T, 4, 4>* out, size_t count) {
+			for (size_t i = 0; i < count; i++) {
+				out[i] = Inverse(in[i]);
+			}
+		}
+
+		template <class T>
+		void QuickInverse(const TMatrix<T, 4, 4>* in, TMatrix<T, 4, 4>* out, size_t count) {
+			for (size_t i = 0; i < count; i++) {
+				out[i] = QuickInverse(in[i]);
+			}
+		}
+
+#ifdef USE_SSE
+		// Packs of matrices in structure-of-arrays form: e[r * 4 + c] holds element (r, c) of every matrix in the pack.
+		struct MatrixPack4f {
+			typedef float type;
+			typedef __m128 value;
+			enum { COUNT = 4 };
+
+			static value Add(value a, value b) { return _mm_add_ps(a, b); }
+			static value Sub(value a, value b) { return _mm_sub_ps(a, b); }
+			static value Mul(value a, value b) { return _mm_mul_ps(a, b); }
+			static value Div(value a, value b) { return _mm_div_ps(a, b); }
+			static value Set(float v) { return _mm_set_ps1(v); }
+			static value Zero() { return _mm_setzero_ps(); }
+
+			static void Transpose(value& r0, value& r1, value& r2, value& r3) {
+				_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+			}
+
+			static void Load(const TMatrix<float, 4, 4>* m, value e[16]) {
+				for (size_t r = 0; r < 4; r++) {
+					value* p = e + r * 4;
+					p[0] = LoadVector4f(m[0](r));
+					p[1] = LoadVector4f(m[1](r));
+					p[2] = LoadVector4f(m[2](r));
+					p[3] = LoadVector4f(m[3](r));
+					Transpose(p[0], p[1], p[2], p[3]);
+				}
+			}
+
+			static void Store(TMatrix<float, 4, 4>* m, value e[16]) {
+				for (size_t r = 0; r < 4; r++) {
+					value* p = e + r * 4;
+					Transpose(p[0], p[1], p[2], p[3]);
+					m[0](r) = StoreVector4f(p[0]);
+					m[1](r) = StoreVector4f(p[1]);
+					m[2](r) = StoreVector4f(p[2]);
+					m[3](r) = StoreVector4f(p[3]);
+				}
+			}
+		};
+
+#ifdef USE_AVX
+		// Matrix k in the low lane and matrix k + 4 in the high lane
+		struct MatrixPack8f {
+			typedef float type;
+			typedef __m256 value;
+			enum { COUNT = 8 };
+
+			static value Add(value a, value b) { return _mm256_add_ps(a, b); }
+			static value Sub(value a, value b) { return _mm256_sub_ps(a, b); }
+			static value Mul(value a, value b) { return _mm256_mul_ps(a, b); }
+			static value Div(value a, value b) { return _mm256_div_ps(a, b); }
+			static value Set(float v) { return _mm256_set1_ps(v); }
+			static value Zero() { return _mm256_setzero_ps(); }
+
+			static void Transpose(value& r0, value& r1, value& r2, value& r3) {
+				value t0 = _mm256_unpacklo_ps(r0, r1);
+				value t1 = _mm256_unpacklo_ps(r2, r3);
+				value t2 = _mm256_unpackhi_ps(r0, r1);
+				value t3 = _mm256_unpackhi_ps(r2, r3);
+				r0 = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+				r1 = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+				r2 = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+				r3 = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2));
+			}
+
+			static void Load(const TMatrix<float, 4, 4>* m, value e[16]) {
+				for (size_t r = 0; r < 4; r++) {
+					value* p = e + r * 4;
+					for (size_t k = 0; k < 4; k++) {
+						p[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(LoadVector4f(m[k](r))), LoadVector4f(m[k + 4](r)), 1);
+					}
+
+					Transpose(p[0], p[1], p[2], p[3]);
+				}
+			}
+
+			static void Store(TMatrix<float, 4, 4>* m, value e[16]) {
+				for (size_t r = 0; r < 4; r++) {
+					value* p = e + r * 4;
+					Transpose(p[0], p[1], p[2], p[3]);
+					for (size_t k = 0; k < 4; k++) {
+						m[k](r) = StoreVector4f(_mm256_castps256_ps128(p[k]));
+						m[k + 4](r) = StoreVector4f(_mm256_extractf128_ps(p[k], 1));
+					}
+				}
+			}
+		};
+
+		struct MatrixPack4d {
+			typedef double type;
+			typedef __m256d value;
+			enum { COUNT = 4 };
+
+			static value Add(value a, value b) { return _mm256_add_pd(a, b); }
+			static value Sub(value a, value b) { return _mm256_sub_pd(a, b); }
+			static value Mul(value a, value b) { return _mm256_mul_pd(a, b); }
+			static value Div(value a, value b) { return _mm256_div_pd(a, b); }
+			static value Set(double v) { return _mm256_set1_pd(v); }
+			static value Zero() { return _mm256_setzero_pd(); }
+
+			static void Transpose(value& r0, value& r1, value& r2, value& r3) {
+				value t0 = _mm256_unpacklo_pd(r0, r1);
+				value t1 = _mm256_unpackhi_pd(r0, r1);
+				value t2 = _mm256_unpacklo_pd(r2, r3);
+				value t3 = _mm256_unpackhi_pd(r2, r3);
+				r0 = _mm256_permute2f128_pd(t0, t2, 0x20);
+				r1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+				r2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+				r3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+			}
+
+			static void Load(const TMatrix<double, 4, 4>* m, value e[16]) {
+				for (size_t r = 0; r < 4; r++) {
+					value* p = e + r * 4;
+					p[0] = LoadVector4d(m[0](r));
+					p[1] = LoadVector4d(m[1](r));
+					p[2] = LoadVector4d(m[2](r));
+					p[3] = LoadVector4d(m[3](r));
+					Transpose(p[0], p[1], p[2], p[3]);
+				}
+			}
+
+			static void Store(TMatrix<double, 4, 4>* m, value e[16]) {
+				for (size_t r = 0; r < 4; r++) {
+					value* p = e + r * 4;
+					Transpose(p[0], p[1], p[2], p[3]);
+					m[0](r) = StoreVector4d(p[0]);
+					m[1](r) = StoreVector4d(p[1]);
+					m[2](r) = StoreVector4d(p[2]);
+					m[3](r) = StoreVector4d(p[3]);
+				}
+			}
+		};
+#endif
+
+		// Cofactor expansion with shared 2x2 sub-determinants, in place on a pack.
+		// Like the SIMD single-matrix versions, singular matrices are not checked.
+		template <class P>
+		inline void InversePack(typename P::value e[16]) {
+			typedef typename P::value V;
+			V s0 = P::Sub(P::Mul(e[0], e[5]), P::Mul(e[4], e[1]));
+			V s1 = P::Sub(P::Mul(e[0], e[6]), P::Mul(e[4], e[2]));
+			V s2 = P::Sub(P::Mul(e[0], e[7]), P::Mul(e[4], e[3]));
+			V s3 = P::Sub(P::Mul(e[1], e[6]), P::Mul(e[5], e[2]));
+			V s4 = P::Sub(P::Mul(e[1], e[7]), P::Mul(e[5], e[3]));
+			V s5 = P::Sub(P::Mul(e[2], e[7]), P::Mul(e[6], e[3]));
+
+			V c5 = P::Sub(P::Mul(e[10], e[15]), P::Mul(e[14], e[11]));
+			V c4 = P::Sub(P::Mul(e[9], e[15]), P::Mul(e[13], e[11]));
+			V c3 = P::Sub(P::Mul(e[9], e[14]), P::Mul(e[13], e[10]));
+			V c2 = P::Sub(P::Mul(e[8], e[15]), P::Mul(e[12], e[11]));
+			V c1 = P::Sub(P::Mul(e[8], e[14]), P::Mul(e[12], e[10]));
+			V c0 = P::Sub(P::Mul(e[8], e[13]), P::Mul(e[12], e[9]));
+
+			V det = P::Add(P::Add(P::Sub(P::Mul(s0, c5), P::Mul(s1, c4)), P::Add(P::Mul(s2, c3), P::Mul(s3, c2))), P::Sub(P::Mul(s5, c0), P::Mul(s4, c1)));
+
+			V r[16];
+			r[0] = P::Add(P::Sub(P::Mul(e[5], c5), P::Mul(e[6], c4)), P::Mul(e[7], c3));
+			r[1] = P::Sub(P::Sub(P::Mul(e[2], c4), P::Mul(e[1], c5)), P::Mul(e[3], c3));
+			r[2] = P::Add(P::Sub(P::Mul(e[13], s5), P::Mul(e[14], s4)), P::Mul(e[15], s3));
+			r[3] = P::Sub(P::Sub(P::Mul(e[10], s4), P::Mul(e[9], s5)), P::Mul(e[11], s3));
+			r[4] = P::Sub(P::Sub(P::Mul(e[6], c2), P::Mul(e[4], c5)), P::Mul(e[7], c1));
+			r[5] = P::Add(P::Sub(P::Mul(e[0], c5), P::Mul(e[2], c2)), P::Mul(e[3], c1));
+			r[6] = P::Sub(P::Sub(P::Mul(e[14], s2), P::Mul(e[12], s5)), P::Mul(e[15], s1));
+			r[7] = P::Add(P::Sub(P::Mul(e[8], s5), P::Mul(e[10], s2)), P::Mul(e[11], s1));
+			r[8] = P::Add(P::Sub(P::Mul(e[4], c4), P::Mul(e[5], c2)), P::Mul(e[7], c0));
+			r[9] = P::Sub(P::Sub(P::Mul(e[1], c2), P::Mul(e[0], c4)), P::Mul(e[3], c0));
+			r[10] = P::Add(P::Sub(P::Mul(e[12], s4), P::Mul(e[13], s2)), P::Mul(e[15], s0));
+			r[11] = P::Sub(P::Sub(P::Mul(e[9], s2), P::Mul(e[8], s4)), P::Mul(e[11], s0));
+			r[12] = P::Sub(P::Sub(P::Mul(e[5], c1), P::Mul(e[4], c3)), P::Mul(e[6], c0));
+			r[13] = P::Add(P::Sub(P::Mul(e[0], c3), P::Mul(e[1], c1)), P::Mul(e[2], c0));
+			r[14] = P::Sub(P::Sub(P::Mul(e[13], s1), P::Mul(e[12], s3)), P::Mul(e[14], s0));
+			r[15] = P::Add(P::Sub(P::Mul(e[8], s3), P::Mul(e[9], s1)), P::Mul(e[10], s0));
+
+			V idet = P::Div(P::Set(1), det);
+			for (size_t i = 0; i < 16; i++) {
+				e[i] = P::Mul(r[i], idet);
+			}
+		}
+
+		// Same as QuickInverse, in place on a pack.
+		template <class P>
+		inline void QuickInversePack(typename P::value e[16]) {
+			typedef typename P::value V;
+			V one = P::Set(1);
+			V s[3];
+			for (size_t i = 0; i < 3; i++) {
+				const V* row = e + i * 4;
+				s[i] = P::Div(one, P::Add(P::Add(P::Mul(row[0], row[0]), P::Mul(row[1], row[1])), P::Mul(row[2], row[2])));
+			}
+
+			V r[16];
+			for (size_t i = 0; i < 3; i++) {
+				for (size_t j = 0; j < 3; j++) {
+					r[i * 4 + j] = P::Mul(e[j * 4 + i], s[j]);
+				}
+
+				r[i * 4 + 3] = P::Zero();
+				const V* row = e + i * 4;
+				r[12 + i] = P::Sub(P::Zero(), P::Mul(P::Add(P::Add(P::Mul(row[0], e[12]), P::Mul(row[1], e[13])), P::Mul(row[2], e[14])), s[i]));
+			}
+
+			r[15] = one;
+			for (size_t k = 0; k < 16; k++) {
+				e[k] = r[k];
+			}
+		}
+
+		template <class P, bool quick>
+		inline size_t InverseBatch(const TMatrix<typename P::type, 4, 4>* in, TMatrix<typename P::type, 4, 4>* out, size_t count) {
+			typename P::value e[16];
+			size_t i = 0;
+			for (; i + P::COUNT <= count; i += P::COUNT) {
+				P::Load(in + i, e);
+				if (quick) {
+					QuickInversePack<P>(e);
+				} else {
+					InversePack<P>(e);
+				}
+
+				P::Store(out + i, e);
+			}
+
+			return i;
+		}
+
+		template <bool quick>
+		inline void InverseBatch(const TMatrix<float, 4, 4>* in, TMatrix<float, 4, 4>* out, size_t count) {
+			size_t i = 0;
+#ifdef USE_AVX
+			i = InverseBatch<MatrixPack8f, quick>(in, out, count);
+#endif
+			// a 4-wide pack loses to the single-matrix SSE Inverse, but not to QuickInverse
+			if (quick) {
+				i += InverseBatch<MatrixPack4f, true>(in + i, out + i, count - i);
+			}
+
+			for (; i < count; i++) {
+				out[i] = quick ? QuickInverse(in[i]) : Inverse(in[i]);
+			}
+		}
+
+		inline void Inverse(const TMatrix<float, 4, 4>* in, TMatrix<float, 4, 4>* out, size_t count) {
+			InverseBatch<false>(in, out, count);
+		}
+
+		inline void QuickInverse(const TMatrix<float, 4, 4>* in, TMatrix<float, 4, 4>* out, size_t count) {
+			InverseBatch<true>(in, out, count);
+		}
+
+#ifdef USE_AVX
+		template <bool quick>
+		inline void InverseBatch(const TMatrix<double, 4, 4>* in, TMatrix<double, 4, 4>* out, size_t count) {
+			for (size_t i = InverseBatch<MatrixPack4d, quick>(in, out, count); i < count; i++) {
+				out[i] = quick ? QuickInverse(in[i]) : Inverse(in[i]);
+			}
+		}
+
+		inline void Inverse(const TMatrix<double, 4, 4>* in, TMatrix<double, 4, 4>* out, size_t count) {
+			InverseBatch<false>(in, out, count);
+		}
+
+		inline void QuickInverse(const TMatrix<double, 4, 4>* in, TMatrix<double, 4, 4>* out, size_t count) {
+			InverseBatch<true>(in, out, count);
+		}
+#endif
+#endif
+
 		template <class T, size_t n>
 		inline TMatrix<T, n, n> MatrixScale(const TVector<T, n>& v) {
 			TMatrix<T, n, n> mat = TMatrix<T, n, n>::Identity();
@@ -792,6 +1380,254 @@ namespace PaintsNow {
 			return r;
 		}
 
+		// Batch kernels return how many leading elements they have processed, the rest is left to scalar code.
+		template <bool point, class T>
+		inline size_t TransformBatchPacked(const TMatrix<T, 4, 4>&, const T*, T*, size_t) {
+			return 0;
+		}
+
+		template <bool point, class T>
+		inline size_t TransformBatchSplit(const TMatrix<T, 4, 4>&, const T*, const T*, const T*, T*, T*, T*, size_t) {
+			return 0;
+		}
+
+		template <class T>
+		inline size_t TransformBatchHomogeneous(const TMatrix<T, 4, 4>&, const TVector<T, 4>*, TVector<T, 4>*, size_t) {
+			return 0;
+		}
+
+#ifdef USE_SSE
+		// 4 packed xyz points (a, b, c) to x, y, z vectors and back.
+		// Only in-lane shuffles are used, so the 256 bit versions handle two groups at once.
+#define DEINTERLEAVE3(shuffle, x, y, z, a, b, c) \
+		x = shuffle(shuffle(a, a, _MM_SHUFFLE(3, 3, 0, 0)), shuffle(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0)); \
+		y = shuffle(shuffle(a, b, _MM_SHUFFLE(3, 0, 2, 1)), shuffle(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0)); \
+		z = shuffle(shuffle(a, b, _MM_SHUFFLE(1, 1, 2, 2)), shuffle(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+
+#define INTERLEAVE3(shuffle, a, b, c, x, y, z) \
+		a = shuffle(shuffle(x, y, _MM_SHUFFLE(0, 0, 0, 0)), shuffle(z, x, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0)); \
+		b = shuffle(shuffle(y, z, _MM_SHUFFLE(1, 1, 1, 1)), shuffle(x, y, _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0)); \
+		c = shuffle(shuffle(z, x, _MM_SHUFFLE(3, 3, 2, 2)), shuffle(y, z, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+
+		// (x, y, z) = (x, y, z, point) * m, c[] holds the broadcasted matrix elements. Points are divided by w.
+#define TRANSFORM3(add, mul, div, x, y, z, c, point) \
+		if (point) { \
+			w = add(add(mul(x, c[3]), mul(y, c[7])), add(mul(z, c[11]), c[15])); \
+			u = div(add(add(mul(x, c[0]), mul(y, c[4])), add(mul(z, c[8]), c[12])), w); \
+			v = div(add(add(mul(x, c[1]), mul(y, c[5])), add(mul(z, c[9]), c[13])), w); \
+			z = div(add(add(mul(x, c[2]), mul(y, c[6])), add(mul(z, c[10]), c[14])), w); \
+		} else { \
+			u = add(add(mul(x, c[0]), mul(y, c[4])), mul(z, c[8])); \
+			v = add(add(mul(x, c[1]), mul(y, c[5])), mul(z, c[9])); \
+			z = add(add(mul(x, c[2]), mul(y, c[6])), mul(z, c[10])); \
+		} \
+		x = u; \
+		y = v;
+
+		template <bool point>
+		inline size_t TransformBatchPacked(const TMatrix<float, 4, 4>& m, const float* in, float* out, size_t count) {
+			size_t i = 0;
+#ifdef USE_AVX
+			__m256 d[16];
+			for (size_t k = 0; k < 16; k++) {
+				d[k] = _mm256_set1_ps(m.data[k >> 2][k & 3]);
+			}
+
+			for (; i + 8 <= count; i += 8) {
+				const float* p = in + i * 3;
+				__m256 a = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p)), _mm_loadu_ps(p + 12), 1);
+				__m256 b = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 16), 1);
+				__m256 c = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 20), 1);
+				__m256 x, y, z, u, v, w;
+				DEINTERLEAVE3(_mm256_shuffle_ps, x, y, z, a, b, c);
+				TRANSFORM3(_mm256_add_ps, _mm256_mul_ps, _mm256_div_ps, x, y, z, d, point);
+				INTERLEAVE3(_mm256_shuffle_ps, a, b, c, x, y, z);
+
+				float* q = out + i * 3;
+				_mm_storeu_ps(q, _mm256_castps256_ps128(a));
+				_mm_storeu_ps(q + 4, _mm256_castps256_ps128(b));
+				_mm_storeu_ps(q + 8, _mm256_castps256_ps128(c));
+				_mm_storeu_ps(q + 12, _mm256_extractf128_ps(a, 1));
+				_mm_storeu_ps(q + 16, _mm256_extractf128_ps(b, 1));
+				_mm_storeu_ps(q + 20, _mm256_extractf128_ps(c, 1));
+			}
+#endif
+			__m128 e[16];
+			for (size_t k = 0; k < 16; k++) {
+				e[k] = _mm_set_ps1(m.data[k >> 2][k & 3]);
+			}
+
+			for (; i + 4 <= count; i += 4) {
+				const float* p = in + i * 3;
+				__m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4), c = _mm_loadu_ps(p + 8);
+				__m128 x, y, z, u, v, w;
+				DEINTERLEAVE3(_mm_shuffle_ps, x, y, z, a, b, c);
+				TRANSFORM3(_mm_add_ps, _mm_mul_ps, _mm_div_ps, x, y, z, e, point);
+				INTERLEAVE3(_mm_shuffle_ps, a, b, c, x, y, z);
+
+				float* q = out + i * 3;
+				_mm_storeu_ps(q, a);
+				_mm_storeu_ps(q + 4, b);
+				_mm_storeu_ps(q + 8, c);
+			}
+
+			return i;
+		}
+
+		template <bool point>
+		inline size_t TransformBatchSplit(const TMatrix<float, 4, 4>& m, const float* inX, const float* inY, const float* inZ, float* outX, float* outY, float* outZ, size_t count) {
+			size_t i = 0;
+#ifdef USE_AVX
+			__m256 d[16];
+			for (size_t k = 0; k < 16; k++) {
+				d[k] = _mm256_set1_ps(m.data[k >> 2][k & 3]);
+			}
+
+			for (; i + 8 <= count; i += 8) {
+				__m256 x = _mm256_loadu_ps(inX + i), y = _mm256_loadu_ps(inY + i), z = _mm256_loadu_ps(inZ + i);
+				__m256 u, v, w;
+				TRANSFORM3(_mm256_add_ps, _mm256_mul_ps, _mm256_div_ps, x, y, z, d, point);
+				_mm256_storeu_ps(outX + i, x);
+				_mm256_storeu_ps(outY + i, y);
+				_mm256_storeu_ps(outZ + i, z);
+			}
+#endif
+			__m128 e[16];
+			for (size_t k = 0; k < 16; k++) {
+				e[k] = _mm_set_ps1(m.data[k >> 2][k & 3]);
+			}
+
+			for (; i + 4 <= count; i += 4) {
+				__m128 x = _mm_loadu_ps(inX + i), y = _mm_loadu_ps(inY + i), z = _mm_loadu_ps(inZ + i);
+				__m128 u, v, w;
+				TRANSFORM3(_mm_add_ps, _mm_mul_ps, _mm_div_ps, x, y, z, e, point);
+				_mm_storeu_ps(outX + i, x);
+				_mm_storeu_ps(outY + i, y);
+				_mm_storeu_ps(outZ + i, z);
+			}
+
+			return i;
+		}
+
+#undef TRANSFORM3
+#undef INTERLEAVE3
+#undef DEINTERLEAVE3
+
+		inline size_t TransformBatchHomogeneous(const TMatrix<float, 4, 4>& m, const TVector<float, 4>* in, TVector<float, 4>* out, size_t count) {
+			size_t i = 0;
+#ifdef USE_AVX
+			// two vectors per register, one in each lane
+			__m256 r0 = _mm256_broadcast_ps((const __m128*)&m.data[0][0]);
+			__m256 r1 = _mm256_broadcast_ps((const __m128*)&m.data[1][0]);
+			__m256 r2 = _mm256_broadcast_ps((const __m128*)&m.data[2][0]);
+			__m256 r3 = _mm256_broadcast_ps((const __m128*)&m.data[3][0]);
+
+			for (; i + 2 <= count; i += 2) {
+				__m256 v = _mm256_loadu_ps(in[i].data);
+				__m256 a0 = _mm256_add_ps(_mm256_mul_ps(_mm256_permute_ps(v, _MM_SHUFFLE(0, 0, 0, 0)), r0), _mm256_mul_ps(_mm256_permute_ps(v, _MM_SHUFFLE(1, 1, 1, 1)), r1));
+				__m256 a1 = _mm256_add_ps(_mm256_mul_ps(_mm256_permute_ps(v, _MM_SHUFFLE(2, 2, 2, 2)), r2), _mm256_mul_ps(_mm256_permute_ps(v, _MM_SHUFFLE(3, 3, 3, 3)), r3));
+				_mm256_storeu_ps(out[i].data, _mm256_add_ps(a0, a1));
+			}
+#else
+			__m128 r0 = LoadVector4f(m(0));
+			__m128 r1 = LoadVector4f(m(1));
+			__m128 r2 = LoadVector4f(m(2));
+			__m128 r3 = LoadVector4f(m(3));
+
+			for (; i < count; i++) {
+				__m128 v = LoadVector4f(in[i]);
+				__m128 a0 = _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)), r0), _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)), r1));
+				__m128 a1 = _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2)), r2), _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3)), r3));
+				out[i] = StoreVector4f(_mm_add_ps(a0, a1));
+			}
+#endif
+			return i;
+		}
+#endif
+
+		// Scalar tails sum in the same order as the SIMD kernels and the SSE vector-matrix product,
+		// so results do not depend on where an element falls in the array.
+		template <bool point, class T>
+		void TransformBatch(const TMatrix<T, 4, 4>& m, const T* inX, const T* inY, const T* inZ, T* outX, T* outY, T* outZ, size_t count) {
+			const T m00 = m(0, 0), m01 = m(0, 1), m02 = m(0, 2), m03 = m(0, 3);
+			const T m10 = m(1, 0), m11 = m(1, 1), m12 = m(1, 2), m13 = m(1, 3);
+			const T m20 = m(2, 0), m21 = m(2, 1), m22 = m(2, 2), m23 = m(2, 3);
+			const T m30 = m(3, 0), m31 = m(3, 1), m32 = m(3, 2), m33 = m(3, 3);
+
+			for (size_t i = TransformBatchSplit<point>(m, inX, inY, inZ, outX, outY, outZ, count); i < count; i++) {
+				T x = inX[i], y = inY[i], z = inZ[i];
+				if (point) {
+					T w = (x * m03 + y * m13) + (z * m23 + m33);
+					outX[i] = ((x * m00 + y * m10) + (z * m20 + m30)) / w;
+					outY[i] = ((x * m01 + y * m11) + (z * m21 + m31)) / w;
+					outZ[i] = ((x * m02 + y * m12) + (z * m22 + m32)) / w;
+				} else {
+					outX[i] = x * m00 + y * m10 + z * m20;
+					outY[i] = x * m01 + y * m11 + z * m21;
+					outZ[i] = x * m02 + y * m12 + z * m22;
+				}
+			}
+		}
+
+		template <bool point, class T>
+		void TransformBatch(const TMatrix<T, 4, 4>& m, const TVector<T, 3>* in, TVector<T, 3>* out, size_t count) {
+			assert(sizeof(TVector<T, 3>) == sizeof(T) * 3);
+			if (count == 0) {
+				return;
+			}
+
+			const T m00 = m(0, 0), m01 = m(0, 1), m02 = m(0, 2), m03 = m(0, 3);
+			const T m10 = m(1, 0), m11 = m(1, 1), m12 = m(1, 2), m13 = m(1, 3);
+			const T m20 = m(2, 0), m21 = m(2, 1), m22 = m(2, 2), m23 = m(2, 3);
+			const T m30 = m(3, 0), m31 = m(3, 1), m32 = m(3, 2), m33 = m(3, 3);
+
+			for (size_t i = TransformBatchPacked<point>(m, in[0].data, out[0].data, count); i < count; i++) {
+				T x = in[i][0], y = in[i][1], z = in[i][2];
+				if (point) {
+					T w = (x * m03 + y * m13) + (z * m23 + m33);
+					out[i][0] = ((x * m00 + y * m10) + (z * m20 + m30)) / w;
+					out[i][1] = ((x * m01 + y * m11) + (z * m21 + m31)) / w;
+					out[i][2] = ((x * m02 + y * m12) + (z * m22 + m32)) / w;
+				} else {
+					out[i][0] = x * m00 + y * m10 + z * m20;
+					out[i][1] = x * m01 + y * m11 + z * m21;
+					out[i][2] = x * m02 + y * m12 + z * m22;
+				}
+			}
+		}
+
+		// Batch versions of Transform, the matrix stays in registers for the whole array.
+		// Points are extended with w = 1 and divided by the result w, vectors ignore translation.
+		// out may be the same array as in. See TParallel.h for thread pool versions.
+		template <class T>
+		void TransformPoints(const TMatrix<T, 4, 4>& m, const TVector<T, 3>* in, TVector<T, 3>* out, size_t count) {
+			TransformBatch<true>(m, in, out, count);
+		}
+
+		template <class T>
+		void TransformVectors(const TMatrix<T, 4, 4>& m, const TVector<T, 3>* in, TVector<T, 3>* out, size_t count) {
+			TransformBatch<false>(m, in, out, count);
+		}
+
+		// Structure-of-arrays versions
+		template <class T>
+		void TransformPoints(const TMatrix<T, 4, 4>& m, const T* inX, const T* inY, const T* inZ, T* outX, T* outY, T* outZ, size_t count) {
+			TransformBatch<true>(m, inX, inY, inZ, outX, outY, outZ, count);
+		}
+
+		template <class T>
+		void TransformVectors(const TMatrix<T, 4, 4>& m, const T* inX, const T* inY, const T* inZ, T* outX, T* outY, T* outZ, size_t count) {
+			TransformBatch<false>(m, inX, inY, inZ, outX, outY, outZ, count);
+		}
+
+		// Homogeneous version, out[i] = in[i] * m
+		template <class T>
+		void TransformPoints(const TMatrix<T, 4, 4>& m, const TVector<T, 4>* in, TVector<T, 4>* out, size_t count) {
+			for (size_t i = TransformBatchHomogeneous(m, in, out, count); i < count; i++) {
+				out[i] = in[i] * m;
+			}
+		}
+
 		template <class T>
 		void IntersectTriangle(TVector<T, 3>& res, TVector<T, 2>& uv, const TVector<T, 3> face[3], const std::pair<TVector<T, 3>, TVector<T, 3> >& vec) {
 			// handle size!!!!
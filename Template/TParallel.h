@@ -0,0 +1,373 @@
+// TParallel.h
+// Parallel range loops on thread pool, and batch math built on them.
+//
+
+#pragma once
+
+#include "../PaintsNow.h"
+#include "../Interface/ITask.h"
+#include "TAtomic.h"
+#include "TMatrix.h"
+#include <limits>
+
+namespace PaintsNow {
+	template <class F>
+	class ParallelForTask : public TaskOnce {
+	public:
+		ParallelForTask(F& k, size_t b, size_t e, std::atomic<uint32_t>& c) : kernel(k), begin(b), end(e), pending(c) {}
+
+		void Execute(void*) override {
+			kernel(begin, end);
+			pending.fetch_sub(1, std::memory_order_release);
+			ITask::Delete(this);
+		}
+
+		void Abort(void* context) override {
+			// the range must be done anyway
+			Execute(context);
+		}
+
+		F& kernel;
+		size_t begin;
+		size_t end;
+		std::atomic<uint32_t>& pending;
+	};
+
+	// Calls kernel(begin, end) on disjoint ranges covering [0, count) on thread pool E (ThreadPool compatible), returns when all ranges are done.
+	// Ranges are at least grain long, and at most 4 ranges per thread are created. The calling thread takes the first range.
+	template <class E, class F>
+	void ParallelFor(E& threadPool, F& kernel, size_t count, size_t grain = 4096) {
+		size_t threadCount = threadPool.GetThreadCount();
+		if (!threadPool.IsRunning() || count <= grain || threadCount == 0) {
+			kernel((size_t)0, count);
+			return;
+		}
+
+		size_t split = threadCount * 4;
+		size_t step = Math::Max(grain, (count + split - 1) / split);
+		std::atomic<uint32_t> pending;
+		pending.store(0, std::memory_order_relaxed);
+
+		for (size_t begin = step; begin < count; begin += step) {
+			pending.fetch_add(1, std::memory_order_relaxed);
+			ITask* task = new (ITask::Allocate(sizeof(ParallelForTask<F>))) ParallelForTask<F>(kernel, begin, Math::Min(begin + step, count), pending);
+			if (!threadPool.Push(task)) {
+				task->Execute(nullptr);
+			}
+		}
+
+		kernel((size_t)0, step);
+
+		if (threadPool.GetCurrentThreadIndex() < threadCount) {
+			// no sleeping, the default delay is far longer than the ranges take, keep running pool tasks instead
+			threadPool.PollWait(pending, ~(uint32_t)0, 0, 0);
+		}
+
+		// non-pooled threads can not poll, just wait for workers
+		while (pending.load(std::memory_order_acquire) != 0) {
+			YieldThread();
+		}
+	}
+
+	// Order preserving maps of keys to integers for radix sort. Unsigned integers map to themselves, signed integers flip the sign bit.
+	template <class K, bool signedKey = std::numeric_limits<K>::is_signed>
+	struct RadixKey {
+		static K Encode(K key) {
+			return key;
+		}
+	};
+
+	template <class K>
+	struct RadixKey<K, true> {
+		static K Encode(K key) {
+			return key ^ std::numeric_limits<K>::min();
+		}
+	};
+
+	// Floating point numbers flip the sign bit of positives and all bits of negatives, -0 goes before +0 and NaNs go to the ends by sign.
+	template <>
+	struct RadixKey<float, true> {
+		static uint32_t Encode(float key) {
+			uint32_t bits;
+			memcpy(&bits, &key, sizeof(bits));
+			return bits ^ ((uint32_t)((int32_t)bits >> 31) | 0x80000000u);
+		}
+	};
+
+	template <>
+	struct RadixKey<double, true> {
+		static uint64_t Encode(double key) {
+			uint64_t bits;
+			memcpy(&bits, &key, sizeof(bits));
+			return bits ^ ((uint64_t)((int64_t)bits >> 63) | ((uint64_t)1 << 63));
+		}
+	};
+
+	template <class K>
+	struct RadixHistogramKernel {
+		RadixHistogramKernel(const K* k, size_t c, size_t b, uint32_t s, size_t* h) : keys(k), count(c), blockSize(b), shift(s), histograms(h) {}
+		void operator () (size_t begin, size_t end) {
+			for (size_t b = begin; b < end; b++) {
+				size_t* counts = histograms + b * 256;
+				memset(counts, 0, 256 * sizeof(size_t));
+				for (size_t i = b * blockSize, n = Math::Min(i + blockSize, count); i < n; i++) {
+					counts[(RadixKey<K>::Encode(keys[i]) >> shift) & 0xFF]++;
+				}
+			}
+		}
+
+		const K* keys;
+		size_t count;
+		size_t blockSize;
+		uint32_t shift;
+		size_t* histograms;
+	};
+
+	template <class K, class V>
+	struct RadixScatterKernel {
+		RadixScatterKernel(const K* k, const V* v, K* ok, V* ov, size_t c, size_t b, uint32_t s, size_t* o) : keys(k), values(v), outKeys(ok), outValues(ov), count(c), blockSize(b), shift(s), offsets(o) {}
+		void operator () (size_t begin, size_t end) {
+			for (size_t b = begin; b < end; b++) {
+				size_t* positions = offsets + b * 256;
+				size_t i = b * blockSize, n = Math::Min(i + blockSize, count);
+				if (values != nullptr) {
+					for (; i < n; i++) {
+						size_t k = positions[(RadixKey<K>::Encode(keys[i]) >> shift) & 0xFF]++;
+						outKeys[k] = keys[i];
+						outValues[k] = values[i];
+					}
+				} else {
+					for (; i < n; i++) {
+						outKeys[positions[(RadixKey<K>::Encode(keys[i]) >> shift) & 0xFF]++] = keys[i];
+					}
+				}
+			}
+		}
+
+		const K* keys;
+		const V* values;
+		K* outKeys;
+		V* outValues;
+		size_t count;
+		size_t blockSize;
+		uint32_t shift;
+		size_t* offsets;
+	};
+
+	template <class T>
+	struct ParallelCopyKernel {
+		ParallelCopyKernel(const T* i, T* o) : in(i), out(o) {}
+		void operator () (size_t begin, size_t end) {
+			std::copy(in + begin, in + end, out + begin);
+		}
+
+		const T* in;
+		T* out;
+	};
+
+	// Stable LSD radix sort of integer or floating point keys on thread pool E, 8 bits per pass, values (may be null) are moved along with keys.
+	// e.g. sorting object indices by Morton codes or depths. tempKeys and tempValues must hold count elements, results are in keys and values.
+	// Each pass counts digits of key blocks in parallel, then scatters blocks in parallel to offsets prefixed from the counts.
+	// Passes where all keys have the same digit are skipped, so keys with unused high bits cost less.
+	template <class E, class K, class V>
+	void RadixSort(E& threadPool, K* keys, V* values, size_t count, K* tempKeys, V* tempValues, size_t grain = 16384) {
+		if (count <= 1) return;
+
+		size_t split = Math::Max((size_t)1, (size_t)threadPool.GetThreadCount() * 4);
+		size_t blockSize = Math::Max(grain, (count + split - 1) / split);
+		size_t blockCount = (count + blockSize - 1) / blockSize;
+		std::vector<size_t> histograms(blockCount * 256);
+
+		K* sourceKeys = keys;
+		V* sourceValues = values;
+		K* targetKeys = tempKeys;
+		V* targetValues = tempValues;
+
+		for (uint32_t shift = 0; shift < sizeof(K) * 8; shift += 8) {
+			RadixHistogramKernel<K> histogramKernel(sourceKeys, count, blockSize, shift, &histograms[0]);
+			ParallelFor(threadPool, histogramKernel, blockCount, 1);
+
+			// digit-major prefix sums, blocks of the same digit are placed in order to keep the sort stable
+			bool trivial = false;
+			size_t offset = 0;
+			for (size_t d = 0; d < 256; d++) {
+				size_t start = offset;
+				for (size_t b = 0; b < blockCount; b++) {
+					size_t c = histograms[b * 256 + d];
+					histograms[b * 256 + d] = offset;
+					offset += c;
+				}
+
+				trivial = trivial || offset - start == count;
+			}
+
+			if (!trivial) {
+				RadixScatterKernel<K, V> scatterKernel(sourceKeys, sourceValues, targetKeys, targetValues, count, blockSize, shift, &histograms[0]);
+				ParallelFor(threadPool, scatterKernel, blockCount, 1);
+				std::swap(sourceKeys, targetKeys);
+				std::swap(sourceValues, targetValues);
+			}
+		}
+
+		if (sourceKeys != keys) {
+			ParallelCopyKernel<K> copyKeys(sourceKeys, keys);
+			ParallelFor(threadPool, copyKeys, count, grain);
+			if (values != nullptr) {
+				ParallelCopyKernel<V> copyValues(sourceValues, values);
+				ParallelFor(threadPool, copyValues, count, grain);
+			}
+		}
+	}
+
+	template <class E, class K>
+	void RadixSort(E& threadPool, K* keys, size_t count, K* tempKeys, size_t grain = 16384) {
+		RadixSort(threadPool, keys, (K*)nullptr, count, tempKeys, (K*)nullptr, grain);
+	}
+
+	template <class T, class P>
+	struct SortBlocksKernel {
+		SortBlocksKernel(T* d, size_t c, size_t b, const P& p) : data(d), count(c), blockSize(b), pred(p) {}
+		void operator () (size_t begin, size_t end) {
+			for (size_t b = begin; b < end; b++) {
+				std::stable_sort(data + b * blockSize, data + Math::Min((b + 1) * blockSize, count), pred);
+			}
+		}
+
+		T* data;
+		size_t count;
+		size_t blockSize;
+		const P& pred;
+	};
+
+	// Number of elements taken from a among the first k elements of the stable merge of a and b, elements of a go first on ties.
+	template <class T, class P>
+	size_t MergeRank(size_t k, const T* a, size_t m, const T* b, size_t n, const P& pred) {
+		size_t low = k > n ? k - n : 0;
+		size_t high = Math::Min(k, m);
+		while (low < high) {
+			size_t i = (low + high) / 2;
+			if (!pred(b[k - i - 1], a[i])) {
+				low = i + 1;
+			} else {
+				high = i;
+			}
+		}
+
+		return low;
+	}
+
+	// Merges adjacent sorted runs of width elements into runs of width * 2, ranges of output are split by MergeRank so that long merges run in parallel too.
+	template <class T, class P>
+	struct MergeRunsKernel {
+		MergeRunsKernel(const T* i, T* o, size_t c, size_t w, const P& p) : in(i), out(o), count(c), width(w), pred(p) {}
+		void operator () (size_t begin, size_t end) {
+			while (begin < end) {
+				size_t start = begin - begin % (width * 2);
+				size_t middle = Math::Min(start + width, count);
+				size_t stop = Math::Min(middle + width, count);
+				size_t last = Math::Min(end, stop);
+				const T* a = in + start;
+				const T* b = in + middle;
+				size_t k0 = begin - start, k1 = last - start;
+				size_t i0 = MergeRank(k0, a, middle - start, b, stop - middle, pred);
+				size_t i1 = MergeRank(k1, a, middle - start, b, stop - middle, pred);
+				std::merge(a + i0, a + i1, b + (k0 - i0), b + (k1 - i1), out + begin, pred);
+				begin = last;
+			}
+		}
+
+		const T* in;
+		T* out;
+		size_t count;
+		size_t width;
+		const P& pred;
+	};
+
+	// Stable merge sort on thread pool E, blocks are sorted in parallel and then merged in parallel rounds. temp must hold count elements.
+	// Sort a std::vector<key_value<K, V> > with it and then call std::binary_unique to bulk-build a flat map like std::binary_build does.
+	template <class E, class T, class P>
+	void MergeSort(E& threadPool, T* data, size_t count, const P& pred, T* temp, size_t grain = 16384) {
+		size_t split = (size_t)threadPool.GetThreadCount() * 2;
+		if (count <= grain || split == 0 || !threadPool.IsRunning()) {
+			std::stable_sort(data, data + count, pred);
+			return;
+		}
+
+		size_t blockSize = Math::Max(grain, (count + split - 1) / split);
+		SortBlocksKernel<T, P> sortKernel(data, count, blockSize, pred);
+		ParallelFor(threadPool, sortKernel, (count + blockSize - 1) / blockSize, 1);
+
+		T* source = data;
+		T* target = temp;
+		for (size_t width = blockSize; width < count; width *= 2) {
+			MergeRunsKernel<T, P> mergeKernel(source, target, count, width, pred);
+			ParallelFor(threadPool, mergeKernel, count, grain);
+			std::swap(source, target);
+		}
+
+		if (source != data) {
+			ParallelCopyKernel<T> copyKernel(source, data);
+			ParallelFor(threadPool, copyKernel, count, grain);
+		}
+	}
+
+	template <class E, class T>
+	void MergeSort(E& threadPool, T* data, size_t count, T* temp, size_t grain = 16384) {
+		MergeSort(threadPool, data, count, std::less<T>(), temp, grain);
+	}
+
+	namespace Math {
+		template <class T, bool point>
+		struct TransformPackedKernel {
+			TransformPackedKernel(const TMatrix<T, 4, 4>& m, const TVector<T, 3>* i, TVector<T, 3>* o) : matrix(m), in(i), out(o) {}
+			void operator () (size_t begin, size_t end) {
+				TransformBatch<point>(matrix, in + begin, out + begin, end - begin);
+			}
+
+			const TMatrix<T, 4, 4>& matrix;
+			const TVector<T, 3>* in;
+			TVector<T, 3>* out;
+		};
+
+		template <class T, bool point>
+		struct TransformSplitKernel {
+			TransformSplitKernel(const TMatrix<T, 4, 4>& m, const T* x, const T* y, const T* z, T* ox, T* oy, T* oz) : matrix(m), inX(x), inY(y), inZ(z), outX(ox), outY(oy), outZ(oz) {}
+			void operator () (size_t begin, size_t end) {
+				TransformBatch<point>(matrix, inX + begin, inY + begin, inZ + begin, outX + begin, outY + begin, outZ + begin, end - begin);
+			}
+
+			const TMatrix<T, 4, 4>& matrix;
+			const T* inX;
+			const T* inY;
+			const T* inZ;
+			T* outX;
+			T* outY;
+			T* outZ;
+		};
+
+		// Thread pool versions of batch transforms in TMatrix.h, small arrays are processed on the calling thread.
+		template <class E, class T>
+		void TransformPoints(E& threadPool, const TMatrix<T, 4, 4>& m, const TVector<T, 3>* in, TVector<T, 3>* out, size_t count, size_t grain = 16384) {
+			TransformPackedKernel<T, true> kernel(m, in, out);
+			ParallelFor(threadPool, kernel, count, grain);
+		}
+
+		template <class E, class T>
+		void TransformVectors(E& threadPool, const TMatrix<T, 4, 4>& m, const TVector<T, 3>* in, TVector<T, 3>* out, size_t count, size_t grain = 16384) {
+			TransformPackedKernel<T, false> kernel(m, in, out);
+			ParallelFor(threadPool, kernel, count, grain);
+		}
+
+		template <class E, class T>
+		void TransformPoints(E& threadPool, const TMatrix<T, 4, 4>& m, const T* inX, const T* inY, const T* inZ, T* outX, T* outY, T* outZ, size_t count, size_t grain = 16384) {
+			TransformSplitKernel<T, true> kernel(m, inX, inY, inZ, outX, outY, outZ);
+			ParallelFor(threadPool, kernel, count, grain);
+		}
+
+		template <class E, class T>
+		void TransformVectors(E& threadPool, const TMatrix<T, 4, 4>& m, const T* inX, const T* inY, const T* inZ, T* outX, T* outY, T* outZ, size_t count, size_t grain = 16384) {
+			TransformSplitKernel<T, false> kernel(m, inX, inY, inZ, outX, outY, outZ);
+			ParallelFor(threadPool, kernel, count, grain);
+		}
+	}
+}
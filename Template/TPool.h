@@ -12,141 +12,155 @@ namespace PaintsNow {
 	class TPool {
 	public:
 		typedef TPool PoolBase;
-		TPool(Allocator& alloc, uint32_t count) : allocator(alloc), maxCount(count), currentCount(0), head(nullptr) {}
+		TPool(Allocator& alloc, uint32_t count) : allocator(alloc), maxCount(count), currentCount(0), critical(0), head(0) {}
 
 		~TPool() {
 			Clear();
 		}
 
-		TPool(rvalue<TPool> rhs) : allocator(((TPool&)rhs).allocator), maxCount(((TPool&)rhs).maxCount), currentCount(((TPool&)rhs).currentCount), head(((TPool&)rhs).head) {
-			rhs.head = nullptr;
+		TPool(rvalue<TPool> rhs) : allocator(((TPool&)rhs).allocator), maxCount(((TPool&)rhs).maxCount), currentCount(((TPool&)rhs).currentCount.load(std::memory_order_relaxed)), critical(0), head(((TPool&)rhs).LoadHead()) {
+			rhs.StoreHead(0);
+			rhs.currentCount.store(0, std::memory_order_relaxed);
 		}
 
 		T* Acquire() {
-			if (head != nullptr) {
-				T* p = head;
-				head = head->next;
-				currentCount--;
+			uint64_t org = LoadHead();
+			T* p = Pointer(org);
+			if (p != nullptr) {
+				StoreHead(Tagged(p->next, org + ((uint64_t)1 << POINTER_BITS)));
+				p->next = nullptr;
+				currentCount.fetch_sub(1, std::memory_order_relaxed);
 				return p;
 			} else {
-				T* p = allocator.allocate(1);
+				p = allocator.allocate(1);
 				allocator.construct(p);
 				return p;
 			}
 		}
 
+		// Lock-free pop. head carries a generation tag that changes on every update, so a CAS based on a stale p->next always fails.
+		// p may already be taken by another thread when we read p->next, which is still fine because the safe paths never free nodes.
 		T* AcquireSafe() {
-			std::atomic<T*>& h = *reinterpret_cast<std::atomic<T*>*>(&head);
-			T* p = (T*)h.exchange(nullptr, std::memory_order_relaxed);
-
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+			SpinLock(critical);
+			T* p = Pointer(head);
 			if (p != nullptr) {
-				T* next = p->next;
-				p->next = nullptr;
-
-				if (next != nullptr) {
-					T* t = (T*)h.exchange(next, std::memory_order_release);
-					while (t != nullptr) {
-						T* q = t;
-						t = t->next;
-						q->next = (T*)h.load(std::memory_order_acquire);
-
-						while (!h.compare_exchange_weak(q->next, q, std::memory_order_release)) {}
-					}
+				head = Tagged(p->next, head + ((uint64_t)1 << POINTER_BITS));
+			}
+			SpinUnLock(critical);
+#else
+			uint64_t org = head.load(std::memory_order_acquire);
+			T* p;
+			while ((p = Pointer(org)) != nullptr) {
+				if (head.compare_exchange_weak(org, Tagged(p->next, org + ((uint64_t)1 << POINTER_BITS)), std::memory_order_acquire)) {
+					break;
 				}
-
-				std::atomic<uint32_t>& count = *reinterpret_cast<std::atomic<uint32_t>*>(&currentCount);
-				count.fetch_sub(1, std::memory_order_release);
-				return p;
-			} else {
-				T* p = allocator.allocate(1);
-				allocator.construct(p);
+			}
+#endif
+			if (p != nullptr) {
+				p->next = nullptr;
+				currentCount.fetch_sub(1, std::memory_order_relaxed);
 				return p;
 			}
+
+			p = allocator.allocate(1);
+			allocator.construct(p);
+			return p;
 		}
 
 		void Release(T* item) {
 			assert(item->next == nullptr);
-			if (currentCount < maxCount) {
-				item->next = head;
-				head = item;
+			if (currentCount.load(std::memory_order_relaxed) < maxCount) {
+				uint64_t org = LoadHead();
+				item->next = Pointer(org);
+				StoreHead(Tagged(item, org + ((uint64_t)1 << POINTER_BITS)));
 
-				currentCount++;
+				currentCount.fetch_add(1, std::memory_order_relaxed);
 			} else {
 				allocator.destroy(item);
 				allocator.deallocate(item, 1);
 			}
 		}
 
+		// Never frees item even if the pool is full, since a concurrent AcquireSafe may still read its next.
+		// So the pool can hold more than maxCount items, but never more than the peak count of items in use.
 		void ReleaseSafe(T* item) {
 			assert(item->next == nullptr);
-
-			if (currentCount < maxCount) {
-				std::atomic<T*>& h = *reinterpret_cast<std::atomic<T*>*>(&head);
-				item->next = h.load(std::memory_order_acquire);
-
-				while (!h.compare_exchange_weak(item->next, item, std::memory_order_release)) {}
-
-				std::atomic<uint32_t>& count = *reinterpret_cast<std::atomic<uint32_t>*>(&currentCount);
-				count.fetch_add(1, std::memory_order_release);
-			} else {
-				allocator.destroy(item);
-				allocator.deallocate(item, 1);
-			}
+			currentCount.fetch_add(1, std::memory_order_relaxed);
+
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+			SpinLock(critical);
+			item->next = Pointer(head);
+			head = Tagged(item, head + ((uint64_t)1 << POINTER_BITS));
+			SpinUnLock(critical);
+#else
+			uint64_t org = head.load(std::memory_order_relaxed);
+			do {
+				item->next = Pointer(org);
+			} while (!head.compare_exchange_weak(org, Tagged(item, org + ((uint64_t)1 << POINTER_BITS)), std::memory_order_release));
+#endif
 		}
 
 		void Clear() {
-			T* p = head, *q = head;
+			T* p = Pointer(LoadHead()), *q = p;
 			while (p != nullptr) {
 				p = p->next;
+				q->next = nullptr;
 				allocator.destroy(q);
 				allocator.deallocate(q, 1);
 				q = p;
 			}
 
-			head = nullptr;
-			currentCount = 0;
+			StoreHead(0);
+			currentCount.store(0, std::memory_order_relaxed);
 		}
 
 	protected:
-		TPool& operator = (const TPool& rhs);
-		Allocator& allocator;
-		uint32_t maxCount;
-		uint32_t currentCount;
-		T* head;
-	};
+		// Pointer lives in the low bits of head, the generation tag in the remaining high bits.
+		// User space addresses fit in 48 bits on all supported 64-bit platforms.
+		enum { POINTER_BITS = sizeof(void*) == 8 ? 48 : 32 };
 
-	template <class T, class H, bool lock = true>
-	class TLocalPool : public TPool<T, TLocalPool<T, H, lock> > {
-	public:
-		TLocalPool(H& h, uint32_t count) : TPool<T, TLocalPool<T, H, lock> >(*this, count), host(h) {}
+		static uint64_t PointerMask() {
+			return ((uint64_t)1 << POINTER_BITS) - 1;
+		}
 
-		T* allocate(size_t n) {
-			assert(n == 1);
-			if (lock) {
-				return host.AcquireSafe();
-			} else {
-				return host.Acquire();
-			}
+		static T* Pointer(uint64_t value) {
+			return reinterpret_cast<T*>((size_t)(value & PointerMask()));
 		}
 
-		void construct(T*) {}
-		void destroy(T*) {}
+		static uint64_t Tagged(T* p, uint64_t tag) {
+			assert(((uint64_t)reinterpret_cast<size_t>(p) & ~PointerMask()) == 0);
+			return (tag & ~PointerMask()) | (uint64_t)reinterpret_cast<size_t>(p);
+		}
 
-		void deallocate(T* p, size_t n) {
-			assert(n == 1);
-			if (lock) {
-				host.ReleaseSafe(p);
-			} else {
-				host.Release(p);
-			}
+		// Plain accessors for the unsafe paths, which must not race with the safe ones.
+		uint64_t LoadHead() const {
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+			return head;
+#else
+			return head.load(std::memory_order_relaxed);
+#endif
 		}
 
-	private:
-		void ReleaseSafe(T* item);
-		T* AcquireSafe();
+		void StoreHead(uint64_t value) {
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+			head = value;
+#else
+			head.store(value, std::memory_order_relaxed);
+#endif
+		}
 
-	protected:
-		H& host;
+		TPool& operator = (const TPool& rhs);
+		Allocator& allocator;
+		uint32_t maxCount;
+		std::atomic<uint32_t> currentCount;
+		std::atomic<uint32_t> critical;
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+		// std::atomic only supports 32 bit operations here, so safe head updates are done under critical.
+		uint64_t head;
+#else
+		std::atomic<uint64_t> head;
+#endif
 	};
 }
 
@@ -1,5 +1,5 @@
 // TQueue.h
-// One to one queue, kfifo.
+// One to one queue, kfifo. And bounded many to many queue.
 // PaintDream (paintdream@paintdream.com)
 //
 
@@ -18,7 +18,9 @@ namespace PaintsNow {
 		TQueue(rvalue<TQueue> q) {
 			TQueue& queue = q;
 			pushIndex = queue.pushIndex;
+			popIndexCache = queue.popIndexCache;
 			popIndex = queue.popIndex;
+			pushIndexCache = queue.pushIndexCache;
 			ringBuffer = queue.ringBuffer;
 			next = queue.next;
 			queue.ringBuffer = nullptr;
@@ -30,7 +32,7 @@ namespace PaintsNow {
 		};
 
 		typedef TRootAllocator<sizeof(T) * N, C> Allocator;
-		TQueue() : pushIndex(0), popIndex(0), next(nullptr) {
+		TQueue() : pushIndex(0), popIndexCache(0), popIndex(0), pushIndexCache(0), next(nullptr) {
 			// leave uninitialized
 			ringBuffer = new (Allocator::Get().Allocate()) T[N];
 		}
@@ -66,8 +68,11 @@ namespace PaintsNow {
 #if defined(_MSC_VER) && _MSC_VER <= 1200
 		inline bool Push(const T& t) {
 			uint32_t nextIndex = (pushIndex + 1) & Mask;
-			if (nextIndex == popIndex) {
-				return false; // full
+			if (nextIndex == popIndexCache) {
+				popIndexCache = popIndex;
+				if (nextIndex == popIndexCache) {
+					return false; // full
+				}
 			}
 
 			ringBuffer[pushIndex] = t;
@@ -79,8 +84,11 @@ namespace PaintsNow {
 		template <class D>
 		inline bool Push(rvalue<D> t) {
 			uint32_t nextIndex = (pushIndex + 1) & Mask;
-			if (nextIndex == popIndex) {
-				return false; // full
+			if (nextIndex == popIndexCache) {
+				popIndexCache = popIndex;
+				if (nextIndex == popIndexCache) {
+					return false; // full
+				}
 			}
 
 			ringBuffer[pushIndex] = t;
@@ -92,8 +100,11 @@ namespace PaintsNow {
 		template <class D>
 		inline bool Push(D&& t) {
 			uint32_t nextIndex = (pushIndex + 1) & Mask;
-			if (nextIndex == popIndex) {
-				return false; // full
+			if (nextIndex == popIndexCache) {
+				popIndexCache = popIndex;
+				if (nextIndex == popIndexCache) {
+					return false; // full
+				}
 			}
 
 			ringBuffer[pushIndex] = std::forward<D>(t);
@@ -107,6 +118,43 @@ namespace PaintsNow {
 			popIndex = (popIndex + 1) & Mask;
 		}
 
+		// Batch operations, only one fence for each batch.
+		// The opposite index is only reloaded when the cached one is not enough.
+		// Return the count of elements actually pushed/popped.
+		inline uint32_t PushRange(const T* items, uint32_t count) {
+			uint32_t space = (popIndexCache - pushIndex - 1) & Mask;
+			if (space < count) {
+				popIndexCache = popIndex;
+				space = (popIndexCache - pushIndex - 1) & Mask;
+				count = Math::Min(count, space);
+			}
+
+			for (uint32_t i = 0; i < count; i++) {
+				ringBuffer[(pushIndex + i) & Mask] = items[i];
+			}
+
+			std::atomic_thread_fence(std::memory_order_release);
+			pushIndex = (pushIndex + count) & Mask;
+			return count;
+		}
+
+		inline uint32_t PopRange(T* items, uint32_t count) {
+			uint32_t size = (pushIndexCache - popIndex) & Mask;
+			if (size < count) {
+				pushIndexCache = pushIndex;
+				size = (pushIndexCache - popIndex) & Mask;
+				count = Math::Min(count, size);
+			}
+
+			for (uint32_t i = 0; i < count; i++) {
+				items[i] = ringBuffer[(popIndex + i) & Mask];
+			}
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			popIndex = (popIndex + count) & Mask;
+			return count;
+		}
+
 		// for prefetch
 		inline const T& Predict() const {
 			return ringBuffer[(popIndex + 1) & Mask];
@@ -117,7 +165,10 @@ namespace PaintsNow {
 			assert(count < N);
 			// Make alignment
 			count += (uint32_t)(alignment - Math::Alignment(pushIndex)) & (alignment - 1);
-			if (count >= N - 1 - Count()) return nullptr;
+			if (count >= N - 1 - ((pushIndex + N - popIndexCache) & Mask)) {
+				popIndexCache = popIndex;
+				if (count >= N - 1 - Count()) return nullptr;
+			}
 
 			uint32_t retIndex = pushIndex;
 			uint32_t nextIndex = pushIndex + count;
@@ -140,7 +191,7 @@ namespace PaintsNow {
 		}
 
 		inline void Reset() {
-			pushIndex = popIndex = 0;
+			pushIndex = popIndexCache = popIndex = pushIndexCache = 0;
 		}
 
 		inline T& Top() {
@@ -177,17 +228,23 @@ namespace PaintsNow {
 		inline bool Empty() const {
 			return popIndex == pushIndex;
 		}
+
+		// Consumer side, false means not empty for sure without touching the producer's index.
+		inline bool MaybeEmpty() const {
+			return popIndex == pushIndexCache;
+		}
 		
 		inline uint32_t Count() const {
 			return (pushIndex + N - popIndex) & Mask;
 		}
 
+		// Producer side, may be conservative since it uses the cached pop index.
 		inline uint32_t GetPackCount(uint32_t alignment) const {
 			assert(N >= alignment);
 			uint32_t index = pushIndex + (uint32_t)(alignment - Math::Alignment(pushIndex)) & (alignment - 1);
 
-			if (popIndex > pushIndex) {
-				return popIndex > index ? popIndex - index : 0;
+			if (popIndexCache > pushIndex) {
+				return popIndexCache > index ? popIndexCache - index : 0;
 			} else {
 				return N - index;
 			}
@@ -214,8 +271,14 @@ namespace PaintsNow {
 		}
 
 	protected:
+		// Producer and consumer indices live on separate cache lines, each with a private copy of the opposite one.
+		// Padded instead of aligned, so TQueueList can still allocate nodes with plain new.
 		uint32_t pushIndex;
+		uint32_t popIndexCache;
+		uint8_t pushPadding[CPU_CACHELINE_SIZE - sizeof(uint32_t) * 2];
 		uint32_t popIndex;
+		uint32_t pushIndexCache;
+		uint8_t popPadding[CPU_CACHELINE_SIZE - sizeof(uint32_t) * 2];
 		T* ringBuffer;
 	public:
 		TQueue* next;
@@ -310,6 +373,43 @@ namespace PaintsNow {
 			std::atomic_thread_fence(std::memory_order_release);
 		}
 #endif
+		inline void PushRange(const T* items, uint32_t count) {
+			uint32_t n = pushHead->PushRange(items, count);
+			while (n != count) { // full
+				items += n;
+				count -= n;
+
+				if (pushHead->next == nullptr) {
+					Node* p = new Node();
+					n = p->PushRange(items, count);
+
+					pushHead->next = p;
+					std::atomic_thread_fence(std::memory_order_release);
+					pushHead = p;
+				} else {
+					pushHead = pushHead->next;
+					n = pushHead->PushRange(items, count);
+				}
+			}
+		}
+
+		inline uint32_t PopRange(T* items, uint32_t count) {
+			uint32_t total = 0;
+			while (true) {
+				total += popHead->PopRange(items + total, count - total);
+
+				if (popHead->MaybeEmpty() && popHead->Empty() && popHead != pushHead) {
+					Node* p = popHead;
+					popHead = popHead->next;
+					delete p;
+				} else if (total == count || popHead->MaybeEmpty()) {
+					break;
+				}
+			}
+
+			return total;
+		}
+
 		inline T& Top() {
 			return popHead->Top();
 		}
@@ -393,6 +493,54 @@ namespace PaintsNow {
 			return popHead->Empty();
 		}
 
+		inline Node* GetPopHead() const {
+			return popHead;
+		}
+
+		// Make following allocations start from a fresh node, returns it.
+		inline Node* Split() {
+			if (!pushHead->Empty()) {
+				if (pushHead->next == nullptr) {
+					Node* p = new Node();
+					pushHead->next = p;
+					std::atomic_thread_fence(std::memory_order_release);
+				}
+
+				pushHead = pushHead->next;
+				assert(pushHead->Empty());
+			}
+
+			return pushHead;
+		}
+
+		// Not thread safe. Reset nodes from popHead to until (exclusive) and move them to the end for reusing.
+		inline void Recycle(Node* until) {
+			if (popHead == until) {
+				return;
+			}
+
+			Node* first = popHead;
+			Node* last = first;
+			while (true) {
+				last->Reset();
+				if (last->next == until) {
+					break;
+				}
+
+				last = last->next;
+				assert(last != nullptr);
+			}
+
+			Node* tail = until;
+			while (tail->next != nullptr) {
+				tail = tail->next;
+			}
+
+			popHead = until;
+			last->next = nullptr;
+			tail->next = first;
+		}
+
 		struct Iterator {
 			Iterator(Node* n, typename Node::Iterator t) : p(n), it(t) {}
 			Iterator& operator ++ () {
@@ -467,5 +615,243 @@ namespace PaintsNow {
 			return true;
 		}
 	};
+
+	// Many-read-many-write bounded queue, per-slot sequence numbers (Dmitry Vyukov's design).
+	// A slot is writable at position pos when its sequence equals pos, and readable when it equals pos + 1.
+	template <class T, size_t K = 8>
+	class TMPMCQueue {
+	public:
+		enum {
+			N = 1 << K,
+			Mask = N - 1
+		};
+
+		struct Slot {
+			std::atomic<size_t> sequence;
+			T value;
+		};
+
+		typedef TRootAllocator<sizeof(Slot) * N, 16> Allocator;
+		TMPMCQueue() {
+			slots = new (Allocator::Get().Allocate()) Slot[N];
+			for (size_t i = 0; i < N; i++) {
+				slots[i].sequence.store(i, std::memory_order_relaxed);
+			}
+
+			pushIndex.store(0, std::memory_order_relaxed);
+			popIndex.store(0, std::memory_order_release);
+		}
+
+		~TMPMCQueue() {
+			for (size_t i = 0; i < N; i++) {
+				slots[i].~Slot();
+			}
+
+			Allocator::Get().Deallocate(slots);
+		}
+
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+		bool TryPush(const T& t) {
+			size_t pos;
+			Slot* slot = AcquirePush(pos);
+			if (slot == nullptr) {
+				return false; // full
+			}
+
+			slot->value = t;
+			slot->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+#else
+		template <class D>
+		bool TryPush(D&& t) {
+			size_t pos;
+			Slot* slot = AcquirePush(pos);
+			if (slot == nullptr) {
+				return false; // full
+			}
+
+			slot->value = std::forward<D>(t);
+			slot->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+#endif
+
+		bool TryPop(T& t) {
+			size_t pos;
+			Slot* slot = AcquirePop(pos);
+			if (slot == nullptr) {
+				return false; // empty
+			}
+
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+			t = slot->value;
+#else
+			t = std::move(slot->value);
+#endif
+			slot->sequence.store(pos + N, std::memory_order_release);
+			return true;
+		}
+
+		// Batch variants claim a run of ready slots with a single CAS on the shared index.
+		// Return the count of elements actually pushed/popped, which may be less than count.
+		template <class I>
+		size_t TryPushRange(I begin, size_t count) {
+			size_t pos = pushIndex.load(std::memory_order_relaxed);
+			size_t n;
+			while (true) {
+				n = 0;
+				while (n < count && n < N && slots[(pos + n) & Mask].sequence.load(std::memory_order_acquire) == pos + n) {
+					n++;
+				}
+
+				if (n == 0) {
+					size_t current = pushIndex.load(std::memory_order_relaxed);
+					if (current == pos) {
+						return 0; // full
+					}
+
+					pos = current;
+				} else if (pushIndex.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+
+			for (size_t i = 0; i < n; i++, ++begin) {
+				Slot& slot = slots[(pos + i) & Mask];
+				slot.value = *begin;
+				slot.sequence.store(pos + i + 1, std::memory_order_release);
+			}
+
+			return n;
+		}
+
+		template <class O>
+		size_t TryPopRange(O output, size_t count) {
+			size_t pos = popIndex.load(std::memory_order_relaxed);
+			size_t n;
+			while (true) {
+				n = 0;
+				while (n < count && n < N && slots[(pos + n) & Mask].sequence.load(std::memory_order_acquire) == pos + n + 1) {
+					n++;
+				}
+
+				if (n == 0) {
+					size_t current = popIndex.load(std::memory_order_relaxed);
+					if (current == pos) {
+						return 0; // empty
+					}
+
+					pos = current;
+				} else if (popIndex.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+
+			for (size_t i = 0; i < n; i++, ++output) {
+				Slot& slot = slots[(pos + i) & Mask];
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+				*output = slot.value;
+#else
+				*output = std::move(slot.value);
+#endif
+				slot.sequence.store(pos + i + N, std::memory_order_release);
+			}
+
+			return n;
+		}
+
+		// Blocking variants. P is a poller like ThreadPool, which runs other tasks on the current thread while waiting.
+		// Return false if the poller stops running before the operation completes.
+		template <class P>
+		bool Push(P& poller, const T& t, uint32_t delay = 0) {
+			uint32_t threadIndex = poller.GetCurrentThreadIndex();
+			while (!TryPush(t)) {
+				if (!poller.IsRunning()) {
+					return false;
+				}
+
+				poller.PollDelay(threadIndex, delay);
+			}
+
+			return true;
+		}
+
+		template <class P>
+		bool Pop(P& poller, T& t, uint32_t delay = 0) {
+			uint32_t threadIndex = poller.GetCurrentThreadIndex();
+			while (!TryPop(t)) {
+				if (!poller.IsRunning()) {
+					return false;
+				}
+
+				poller.PollDelay(threadIndex, delay);
+			}
+
+			return true;
+		}
+
+		// Approximate when accessed concurrently.
+		size_t Count() const {
+			size_t pop = popIndex.load(std::memory_order_acquire);
+			size_t push = pushIndex.load(std::memory_order_acquire);
+			return push - pop;
+		}
+
+		bool Empty() const {
+			return Count() == 0;
+		}
+
+		static uint32_t GetFullPackCount() {
+			return N;
+		}
+
+	protected:
+		Slot* AcquirePush(size_t& pos) {
+			pos = pushIndex.load(std::memory_order_relaxed);
+			while (true) {
+				Slot* slot = &slots[pos & Mask];
+				size_t seq = slot->sequence.load(std::memory_order_acquire);
+				if (seq == pos) {
+					if (pushIndex.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						return slot;
+					}
+				} else if ((ptrdiff_t)(seq - pos) < 0) {
+					return nullptr;
+				} else {
+					pos = pushIndex.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		Slot* AcquirePop(size_t& pos) {
+			pos = popIndex.load(std::memory_order_relaxed);
+			while (true) {
+				Slot* slot = &slots[pos & Mask];
+				size_t seq = slot->sequence.load(std::memory_order_acquire);
+				if (seq == pos + 1) {
+					if (popIndex.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						return slot;
+					}
+				} else if ((ptrdiff_t)(seq - (pos + 1)) < 0) {
+					return nullptr;
+				} else {
+					pos = popIndex.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		TMPMCQueue(const TMPMCQueue& rhs);
+		TMPMCQueue& operator = (const TMPMCQueue& rhs);
+
+		// Producer and consumer indices are at least a cache line apart, and apart from neighbouring objects.
+		// Padded instead of aligned, so queues can still be allocated with plain new.
+		Slot* slots;
+		uint8_t slotsPadding[CPU_CACHELINE_SIZE - sizeof(Slot*)];
+		std::atomic<size_t> pushIndex;
+		uint8_t pushPadding[CPU_CACHELINE_SIZE - sizeof(size_t)];
+		std::atomic<size_t> popIndex;
+		uint8_t popPadding[CPU_CACHELINE_SIZE - sizeof(size_t)];
+	};
 }
 
@@ -0,0 +1,232 @@
+// TRay.h
+// Rays and packet ray-box intersection
+//
+
+#pragma once
+
+#include "TFrustum.h"
+
+namespace PaintsNow {
+	// Slab test of one ray against box [lower, upper], clips [tmin, tmax] to the part of the ray inside the box.
+	// Same operand order as the packet kernels below, so that both give identical results: Min / Max pick the second operand on NaN,
+	// which comes from 0 * inf for rays parallel to a slab with origin exactly on its plane. Such rays are not reliably reported.
+	template <class T>
+	inline bool IntersectSlabs(const T* origin, const T* inverseDirection, const T* lower, const T* upper, T& tmin, T& tmax) {
+		for (size_t c = 0; c < 3; c++) {
+			T t1 = (lower[c] - origin[c]) * inverseDirection[c];
+			T t2 = (upper[c] - origin[c]) * inverseDirection[c];
+			tmin = Math::Max(Math::Min(t1, t2), tmin);
+			tmax = Math::Min(Math::Max(t1, t2), tmax);
+		}
+
+		return !(tmax < tmin);
+	}
+
+	// Batch kernels return how many leading boxes they have processed, always a multiple of 32 so that hit words are not shared.
+	template <class T, class V>
+	inline size_t IntersectPacked(const T*, const T*, const std::pair<V, V>*, size_t, T, T, T*, uint32_t*) {
+		return 0;
+	}
+
+#ifdef USE_SSE
+	// Slab test on packs, each lane is a ray-box pair. Returns lanes of misses, tmin is clipped to entry distances.
+	template <class F>
+	inline typename F::value IntersectPack(typename F::value originX, typename F::value originY, typename F::value originZ, typename F::value inverseX, typename F::value inverseY, typename F::value inverseZ,
+		typename F::value lowerX, typename F::value lowerY, typename F::value lowerZ, typename F::value upperX, typename F::value upperY, typename F::value upperZ, typename F::value& tmin, typename F::value tmax) {
+		typedef typename F::value V;
+		V t1 = F::Mul(F::Sub(lowerX, originX), inverseX);
+		V t2 = F::Mul(F::Sub(upperX, originX), inverseX);
+		tmin = F::Max(F::Min(t1, t2), tmin);
+		tmax = F::Min(F::Max(t1, t2), tmax);
+
+		t1 = F::Mul(F::Sub(lowerY, originY), inverseY);
+		t2 = F::Mul(F::Sub(upperY, originY), inverseY);
+		tmin = F::Max(F::Min(t1, t2), tmin);
+		tmax = F::Min(F::Max(t1, t2), tmax);
+
+		t1 = F::Mul(F::Sub(lowerZ, originZ), inverseZ);
+		t2 = F::Mul(F::Sub(upperZ, originZ), inverseZ);
+		tmin = F::Max(F::Min(t1, t2), tmin);
+		tmax = F::Min(F::Max(t1, t2), tmax);
+
+		return F::Less(tmax, tmin);
+	}
+
+	// One ray against F::COUNT boxes at a time.
+	template <class F, class B>
+	inline size_t IntersectPackedWith(const float* origin, const float* inverseDirection, const std::pair<B, B>* boxes, size_t count, float tmin, float tmax, float* distances, uint32_t* hits) {
+		typedef typename F::value V;
+		V originX = F::Set(origin[0]), originY = F::Set(origin[1]), originZ = F::Set(origin[2]);
+		V inverseX = F::Set(inverseDirection[0]), inverseY = F::Set(inverseDirection[1]), inverseZ = F::Set(inverseDirection[2]);
+		V enter = F::Set(tmin), leave = F::Set(tmax), missed = F::Set(std::numeric_limits<float>::max());
+
+		size_t i = 0;
+		for (; i + 32 <= count; i += 32) {
+			uint32_t word = 0;
+			for (size_t j = 0; j < 32; j += F::COUNT) {
+				V lowerX, lowerY, lowerZ, upperX, upperY, upperZ;
+				GatherBoxes<F>(boxes + i + j, lowerX, lowerY, lowerZ, upperX, upperY, upperZ);
+				V distance = enter;
+				V miss = IntersectPack<F>(originX, originY, originZ, inverseX, inverseY, inverseZ, lowerX, lowerY, lowerZ, upperX, upperY, upperZ, distance, leave);
+				F::Store(distances + i + j, F::Select(miss, missed, distance));
+				word |= (~F::Mask(miss) & ((1u << F::COUNT) - 1)) << j;
+			}
+
+			hits[i >> 5] = word;
+		}
+
+		return i;
+	}
+
+	inline size_t IntersectPacked(const float* origin, const float* inverseDirection, const Float3Pair* boxes, size_t count, float tmin, float tmax, float* distances, uint32_t* hits) {
+		return IntersectPackedWith<BoxPackf>(origin, inverseDirection, boxes, count, tmin, tmax, distances, hits);
+	}
+
+	inline size_t IntersectPacked(const float* origin, const float* inverseDirection, const Float4Pair* boxes, size_t count, float tmin, float tmax, float* distances, uint32_t* hits) {
+		return IntersectPackedWith<BoxPackf>(origin, inverseDirection, boxes, count, tmin, tmax, distances, hits);
+	}
+#endif
+
+	// Ray with cached reciprocal direction. Zero direction components give infinite reciprocals, which the slab test handles.
+	template <class T>
+	class TRay {
+	public:
+		TRay() {}
+		TRay(const TVector<T, 3>& o, const TVector<T, 3>& d) : origin(o), direction(d) {
+			for (size_t c = 0; c < 3; c++) {
+				inverseDirection[c] = T(1) / d[c];
+			}
+		}
+
+		inline const TVector<T, 3>& GetOrigin() const {
+			return origin;
+		}
+
+		inline const TVector<T, 3>& GetDirection() const {
+			return direction;
+		}
+
+		inline const TVector<T, 3>& GetInverseDirection() const {
+			return inverseDirection;
+		}
+
+		// Clips [tmin, tmax] to box [lower, upper] (3 components are used), returns false if the ray misses the box in range.
+		// tmin is the entry distance then, or the original tmin if the range starts inside the box.
+		inline bool Intersect(const T* lower, const T* upper, T& tmin, T& tmax) const {
+			return IntersectSlabs(&origin.data[0], &inverseDirection.data[0], lower, upper, tmin, tmax);
+		}
+
+		template <class K>
+		inline bool Intersect(const K& box, T& tmin, T& tmax) const {
+			return Intersect(&box.first.data[0], &box.second.data[0], tmin, tmax);
+		}
+
+		// Batch intersection. Bit (i & 31) of hits[i >> 5] is set if box i is hit in [tmin, tmax], unused bits of the last word are cleared.
+		// distances[i] receives the entry distance, or the max value of T for misses. hits must hold (count + 31) / 32 words.
+		template <class V>
+		void Intersect(const std::pair<V, V>* boxes, size_t count, T tmin, T tmax, T* distances, uint32_t* hits) const {
+			memset(hits, 0, (count + 31) / 32 * sizeof(uint32_t));
+			for (size_t i = IntersectPacked(&origin.data[0], &inverseDirection.data[0], boxes, count, tmin, tmax, distances, hits); i < count; i++) {
+				T enter = tmin, leave = tmax;
+				bool hit = Intersect(boxes[i], enter, leave);
+				distances[i] = hit ? enter : std::numeric_limits<T>::max();
+				hits[i >> 5] |= (uint32_t)hit << (i & 31);
+			}
+		}
+
+	protected:
+		TVector<T, 3> origin;
+		TVector<T, 3> direction;
+		TVector<T, 3> inverseDirection;
+	};
+
+	// N rays in structure-of-arrays layout for testing against one box at a time, e.g. coherent primary rays of a screen tile.
+	// Unused lanes are set up to miss everything.
+	template <class T, size_t N>
+	struct TRayPacket {
+		enum { COUNT = N };
+
+		TRayPacket() {
+			Reset();
+		}
+
+		void Reset() {
+			for (size_t i = 0; i < N; i++) {
+				originX[i] = originY[i] = originZ[i] = T(0);
+				inverseX[i] = inverseY[i] = inverseZ[i] = T(0);
+				tmin[i] = T(1);
+				tmax[i] = T(0);
+			}
+		}
+
+		void Set(size_t lane, const TRay<T>& ray, T enter, T leave) {
+			assert(lane < N);
+			const TVector<T, 3>& origin = ray.GetOrigin();
+			const TVector<T, 3>& inverseDirection = ray.GetInverseDirection();
+			originX[lane] = origin.data[0];
+			originY[lane] = origin.data[1];
+			originZ[lane] = origin.data[2];
+			inverseX[lane] = inverseDirection.data[0];
+			inverseY[lane] = inverseDirection.data[1];
+			inverseZ[lane] = inverseDirection.data[2];
+			tmin[lane] = enter;
+			tmax[lane] = leave;
+		}
+
+		T originX[N];
+		T originY[N];
+		T originZ[N];
+		T inverseX[N];
+		T inverseY[N];
+		T inverseZ[N];
+		T tmin[N];
+		T tmax[N];
+	};
+
+	// Tests all rays of packet against box [lower, upper]. Returns hit bits by lane,
+	// distances[lane] receives the entry distance, or the max value of T for misses.
+	template <class T, size_t N>
+	inline uint32_t IntersectPacket(const TRayPacket<T, N>& packet, const T* lower, const T* upper, T* distances) {
+		uint32_t hits = 0;
+		for (size_t i = 0; i < N; i++) {
+			T origin[3] = { packet.originX[i], packet.originY[i], packet.originZ[i] };
+			T inverseDirection[3] = { packet.inverseX[i], packet.inverseY[i], packet.inverseZ[i] };
+			T enter = packet.tmin[i], leave = packet.tmax[i];
+			bool hit = IntersectSlabs(origin, inverseDirection, lower, upper, enter, leave);
+			distances[i] = hit ? enter : std::numeric_limits<T>::max();
+			hits |= (uint32_t)hit << i;
+		}
+
+		return hits;
+	}
+
+#ifdef USE_SSE
+	// Lanes [k, k + F::COUNT) of packet
+	template <class F, class R>
+	inline uint32_t IntersectPacketWith(const R& packet, size_t k, const float* lower, const float* upper, float* distances) {
+		typedef typename F::value V;
+		V distance = F::Load(packet.tmin + k);
+		V miss = IntersectPack<F>(F::Load(packet.originX + k), F::Load(packet.originY + k), F::Load(packet.originZ + k), F::Load(packet.inverseX + k), F::Load(packet.inverseY + k), F::Load(packet.inverseZ + k),
+			F::Set(lower[0]), F::Set(lower[1]), F::Set(lower[2]), F::Set(upper[0]), F::Set(upper[1]), F::Set(upper[2]), distance, F::Load(packet.tmax + k));
+		F::Store(distances + k, F::Select(miss, F::Set(std::numeric_limits<float>::max()), distance));
+		return (~F::Mask(miss) & ((1u << F::COUNT) - 1)) << k;
+	}
+
+	inline uint32_t IntersectPacket(const TRayPacket<float, 4>& packet, const float* lower, const float* upper, float* distances) {
+		return IntersectPacketWith<BoxPack4f>(packet, 0, lower, upper, distances);
+	}
+
+	inline uint32_t IntersectPacket(const TRayPacket<float, 8>& packet, const float* lower, const float* upper, float* distances) {
+#ifdef USE_AVX
+		return IntersectPacketWith<BoxPack8f>(packet, 0, lower, upper, distances);
+#else
+		return IntersectPacketWith<BoxPack4f>(packet, 0, lower, upper, distances) | IntersectPacketWith<BoxPack4f>(packet, 4, lower, upper, distances);
+#endif
+	}
+#endif
+
+	template <class T, size_t N, class K>
+	inline uint32_t IntersectPacket(const TRayPacket<T, N>& packet, const K& box, T* distances) {
+		return IntersectPacket(packet, &box.first.data[0], &box.second.data[0], distances);
+	}
+}
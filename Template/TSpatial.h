@@ -0,0 +1,272 @@
+// TSpatial.h
+// Morton and Hilbert codes, and spatial ordering of points for memory locality
+//
+
+#pragma once
+
+#include "TParallel.h"
+
+// pdep for bit interleaving. Not implied by AVX2 on MSVC as it is microcoded and slow on AMD processors before Zen 3.
+#if defined(__BMI2__) && !defined(USE_BMI2)
+#define USE_BMI2
+#endif
+
+#ifdef USE_BMI2
+#include <immintrin.h>
+#endif
+
+namespace PaintsNow {
+	namespace Math {
+		// Bit interleaving: spreads low bits of x to every second (SpreadBits2) or every third (SpreadBits3) bit.
+		// 16 / 10 bits are kept for 32-bit codes, 32 / 21 bits for 64-bit codes.
+		inline uint32_t SpreadBits2(uint32_t x) {
+#ifdef USE_BMI2
+			return _pdep_u32(x, 0x55555555u);
+#else
+			x &= 0xFFFF;
+			x = (x | (x << 8)) & 0x00FF00FFu;
+			x = (x | (x << 4)) & 0x0F0F0F0Fu;
+			x = (x | (x << 2)) & 0x33333333u;
+			return (x | (x << 1)) & 0x55555555u;
+#endif
+		}
+
+		inline uint32_t SpreadBits3(uint32_t x) {
+#ifdef USE_BMI2
+			return _pdep_u32(x, 0x09249249u);
+#else
+			x &= 0x3FF;
+			x = (x | (x << 16)) & 0x030000FFu;
+			x = (x | (x << 8)) & 0x0300F00Fu;
+			x = (x | (x << 4)) & 0x030C30C3u;
+			return (x | (x << 2)) & 0x09249249u;
+#endif
+		}
+
+		inline uint64_t SpreadBits2(uint64_t x) {
+#if defined(USE_BMI2) && (defined(__x86_64__) || defined(_M_AMD64))
+			return _pdep_u64(x, 0x5555555555555555ull);
+#else
+			x &= 0xFFFFFFFFull;
+			x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+			x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+			x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+			x = (x | (x << 2)) & 0x3333333333333333ull;
+			return (x | (x << 1)) & 0x5555555555555555ull;
+#endif
+		}
+
+		inline uint64_t SpreadBits3(uint64_t x) {
+#if defined(USE_BMI2) && (defined(__x86_64__) || defined(_M_AMD64))
+			return _pdep_u64(x, 0x1249249249249249ull);
+#else
+			x &= 0x1FFFFFull;
+			x = (x | (x << 32)) & 0x001F00000000FFFFull;
+			x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+			x = (x | (x << 8)) & 0x100F00F00F00F00Full;
+			x = (x | (x << 4)) & 0x10C30C30C30C30C3ull;
+			return (x | (x << 2)) & 0x1249249249249249ull;
+#endif
+		}
+
+		// Morton (Z-order) codes, x takes the lowest bit. Sorting by them keeps nearby cells mostly nearby in memory.
+		inline uint32_t EncodeMorton(uint32_t x, uint32_t y) {
+			return SpreadBits2(x) | (SpreadBits2(y) << 1);
+		}
+
+		inline uint32_t EncodeMorton(uint32_t x, uint32_t y, uint32_t z) {
+			return SpreadBits3(x) | (SpreadBits3(y) << 1) | (SpreadBits3(z) << 2);
+		}
+
+		inline uint64_t EncodeMorton(uint64_t x, uint64_t y) {
+			return SpreadBits2(x) | (SpreadBits2(y) << 1);
+		}
+
+		inline uint64_t EncodeMorton(uint64_t x, uint64_t y, uint64_t z) {
+			return SpreadBits3(x) | (SpreadBits3(y) << 1) | (SpreadBits3(z) << 2);
+		}
+
+		// Signed coordinates would be ambiguous between the unsigned widths above. They must not be negative.
+		inline uint32_t EncodeMorton(int32_t x, int32_t y) {
+			assert(x >= 0 && y >= 0);
+			return EncodeMorton((uint32_t)x, (uint32_t)y);
+		}
+
+		inline uint32_t EncodeMorton(int32_t x, int32_t y, int32_t z) {
+			assert(x >= 0 && y >= 0 && z >= 0);
+			return EncodeMorton((uint32_t)x, (uint32_t)y, (uint32_t)z);
+		}
+
+		inline uint64_t EncodeMorton(int64_t x, int64_t y) {
+			assert(x >= 0 && y >= 0);
+			return EncodeMorton((uint64_t)x, (uint64_t)y);
+		}
+
+		inline uint64_t EncodeMorton(int64_t x, int64_t y, int64_t z) {
+			assert(x >= 0 && y >= 0 && z >= 0);
+			return EncodeMorton((uint64_t)x, (uint64_t)y, (uint64_t)z);
+		}
+
+		// Turns n coordinates of bits bits each into the transposed Hilbert index (J. Skilling, Programming the Hilbert curve, 2004).
+		template <class T, size_t n>
+		void HilbertTranspose(T* X, uint32_t bits) {
+			T M = (T)1 << (bits - 1);
+			for (T Q = M; Q > 1; Q >>= 1) {
+				T P = Q - 1;
+				for (size_t i = 0; i < n; i++) {
+					if (X[i] & Q) {
+						X[0] ^= P;
+					} else {
+						T t = (X[0] ^ X[i]) & P;
+						X[0] ^= t;
+						X[i] ^= t;
+					}
+				}
+			}
+
+			for (size_t j = 1; j < n; j++) {
+				X[j] ^= X[j - 1];
+			}
+
+			T t = 0;
+			for (T R = M; R > 1; R >>= 1) {
+				if (X[n - 1] & R) {
+					t ^= R - 1;
+				}
+			}
+
+			for (size_t k = 0; k < n; k++) {
+				X[k] ^= t;
+			}
+		}
+
+		// Hilbert codes of cells in a grid of 2^bits cells per axis. Consecutive codes are always adjacent cells,
+		// better locality than Morton codes at the cost of a loop over bits.
+		template <class T>
+		T EncodeHilbert2(T x, T y, uint32_t bits) {
+			assert(bits != 0 && bits * 2 <= sizeof(T) * 8);
+			T X[2] = { x, y };
+			HilbertTranspose<T, 2>(X, bits);
+			return EncodeMorton(X[1], X[0]);
+		}
+
+		template <class T>
+		T EncodeHilbert3(T x, T y, T z, uint32_t bits) {
+			assert(bits != 0 && bits * 3 <= sizeof(T) * 8);
+			T X[3] = { x, y, z };
+			HilbertTranspose<T, 3>(X, bits);
+			return EncodeMorton(X[2], X[1], X[0]);
+		}
+
+		inline uint32_t EncodeHilbert(uint32_t x, uint32_t y) {
+			return EncodeHilbert2(x, y, 16);
+		}
+
+		inline uint32_t EncodeHilbert(uint32_t x, uint32_t y, uint32_t z) {
+			return EncodeHilbert3(x, y, z, 10);
+		}
+
+		inline uint64_t EncodeHilbert(uint64_t x, uint64_t y) {
+			return EncodeHilbert2(x, y, 32);
+		}
+
+		inline uint64_t EncodeHilbert(uint64_t x, uint64_t y, uint64_t z) {
+			return EncodeHilbert3(x, y, z, 21);
+		}
+
+		inline uint32_t EncodeHilbert(int32_t x, int32_t y) {
+			assert(x >= 0 && y >= 0);
+			return EncodeHilbert((uint32_t)x, (uint32_t)y);
+		}
+
+		inline uint32_t EncodeHilbert(int32_t x, int32_t y, int32_t z) {
+			assert(x >= 0 && y >= 0 && z >= 0);
+			return EncodeHilbert((uint32_t)x, (uint32_t)y, (uint32_t)z);
+		}
+
+		inline uint64_t EncodeHilbert(int64_t x, int64_t y) {
+			assert(x >= 0 && y >= 0);
+			return EncodeHilbert((uint64_t)x, (uint64_t)y);
+		}
+
+		inline uint64_t EncodeHilbert(int64_t x, int64_t y, int64_t z) {
+			assert(x >= 0 && y >= 0 && z >= 0);
+			return EncodeHilbert((uint64_t)x, (uint64_t)y, (uint64_t)z);
+		}
+
+		// 32-bit codes of non-negative integer vectors of 2 or 3 (or more, extra components are ignored) components, e.g. Int3, UInt2.
+		template <class V>
+		uint32_t EncodeMorton(const V& coord) {
+			return V::size == 2 ? EncodeMorton((uint32_t)coord[0], (uint32_t)coord[1]) : EncodeMorton((uint32_t)coord[0], (uint32_t)coord[1], (uint32_t)coord[2]);
+		}
+
+		template <class V>
+		uint32_t EncodeHilbert(const V& coord) {
+			return V::size == 2 ? EncodeHilbert((uint32_t)coord[0], (uint32_t)coord[1]) : EncodeHilbert((uint32_t)coord[0], (uint32_t)coord[1], (uint32_t)coord[2]);
+		}
+
+		// Grid cell of point in box split into 2^bits cells per axis, for 2 or 3 components. Points outside are clamped to border cells.
+		template <class V>
+		void QuantizeCell(const V& point, const std::pair<V, V>& box, uint32_t bits, uint32_t* cell) {
+			typedef typename V::type T;
+			const uint32_t last = (1u << bits) - 1;
+			for (size_t c = 0; c < (V::size == 2 ? 2 : 3); c++) {
+				T extent = box.second[c] - box.first[c];
+				T value = extent > 0 ? (point[c] - box.first[c]) * ((T)(last + 1) / extent) : T(0);
+				// NaN goes to the first cell
+				cell[c] = value > 0 ? (value < (T)last ? (uint32_t)value : last) : 0;
+			}
+		}
+
+		// 32-bit codes of points in box, e.g. Float3 positions with the scene bounding box, for spatial sorting.
+		template <class V>
+		uint32_t EncodeMorton(const V& point, const std::pair<V, V>& box) {
+			uint32_t cell[3];
+			QuantizeCell(point, box, V::size == 2 ? 16 : 10, cell);
+			return V::size == 2 ? EncodeMorton(cell[0], cell[1]) : EncodeMorton(cell[0], cell[1], cell[2]);
+		}
+
+		template <class V>
+		uint32_t EncodeHilbert(const V& point, const std::pair<V, V>& box) {
+			uint32_t cell[3];
+			QuantizeCell(point, box, V::size == 2 ? 16 : 10, cell);
+			return V::size == 2 ? EncodeHilbert(cell[0], cell[1]) : EncodeHilbert(cell[0], cell[1], cell[2]);
+		}
+
+		template <class V, bool hilbert>
+		struct SpatialCodeKernel {
+			SpatialCodeKernel(const V* p, const std::pair<V, V>& b, uint32_t* c, uint32_t* i) : points(p), box(b), codes(c), indices(i) {}
+			void operator () (size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					codes[i] = hilbert ? EncodeHilbert(points[i], box) : EncodeMorton(points[i], box);
+					indices[i] = (uint32_t)i;
+				}
+			}
+
+			const V* points;
+			const std::pair<V, V>& box;
+			uint32_t* codes;
+			uint32_t* indices;
+		};
+
+		// Fills indices with the order of points along the Morton (or Hilbert) curve of box on thread pool E,
+		// e.g. for reordering SoA buffers, or bulk-building kd-trees and batching objects by region. Points of equal cells keep their order.
+		template <class E, class V>
+		void SpatialOrder(E& threadPool, const V* points, size_t count, const std::pair<V, V>& box, uint32_t* indices, bool hilbert = false, size_t grain = 16384) {
+			if (count == 0) return;
+
+			std::vector<uint32_t> codes(count * 2);
+			std::vector<uint32_t> tempIndices(count);
+
+			if (hilbert) {
+				SpatialCodeKernel<V, true> kernel(points, box, &codes[0], indices);
+				ParallelFor(threadPool, kernel, count, grain);
+			} else {
+				SpatialCodeKernel<V, false> kernel(points, box, &codes[0], indices);
+				ParallelFor(threadPool, kernel, count, grain);
+			}
+
+			RadixSort(threadPool, &codes[0], indices, count, &codes[count], &tempIndices[0], grain);
+		}
+	}
+}
@@ -23,7 +23,22 @@
 #endif
 
 #ifdef USE_SSE
-#ifdef USE_SSE_LATEST
+// wider backends are selected at compile time by target options (e.g. -mavx2, /arch:AVX2)
+#if defined(__AVX__)
+#define USE_AVX
+#endif
+#if defined(__AVX2__)
+#define USE_AVX2
+#endif
+#if defined(__AVX512F__)
+#define USE_AVX512
+#endif
+// half float conversions, implied by AVX2 on MSVC
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define USE_F16C
+#endif
+
+#if defined(USE_SSE_LATEST) || defined(USE_AVX)
 #include <immintrin.h>
 #else
 #include <emmintrin.h>
@@ -116,6 +131,90 @@ namespace PaintsNow {
 	inline TVector<float, 4> StoreVector4f(__m128 v) {
 		return *(const TVector<float, 4>*)&v;
 	}
+
+	// integer and wide vectors are not over-aligned, always use unaligned loads
+	inline __m128i LoadVector4i(const TVector<int, 4>& value) {
+		return _mm_loadu_si128((const __m128i*)&value.data[0]);
+	}
+
+	inline __m128i LoadVector4i(const TVector<unsigned int, 4>& value) {
+		return _mm_loadu_si128((const __m128i*)&value.data[0]);
+	}
+
+	inline TVector<int, 4> StoreVector4i(__m128i v) {
+		TVector<int, 4> ret;
+		_mm_storeu_si128((__m128i*)&ret.data[0], v);
+		return ret;
+	}
+
+	inline TVector<unsigned int, 4> StoreVector4u(__m128i v) {
+		TVector<unsigned int, 4> ret;
+		_mm_storeu_si128((__m128i*)&ret.data[0], v);
+		return ret;
+	}
+#endif
+
+#ifdef USE_AVX
+	inline __m256d LoadVector4d(const TVector<double, 4>& value) {
+		return _mm256_loadu_pd(&value.data[0]);
+	}
+
+	inline TVector<double, 4> StoreVector4d(__m256d v) {
+		TVector<double, 4> ret;
+		_mm256_storeu_pd(&ret.data[0], v);
+		return ret;
+	}
+
+	inline __m256 LoadVector8f(const TVector<float, 8>& value) {
+		return _mm256_loadu_ps(&value.data[0]);
+	}
+
+	inline TVector<float, 8> StoreVector8f(__m256 v) {
+		TVector<float, 8> ret;
+		_mm256_storeu_ps(&ret.data[0], v);
+		return ret;
+	}
+#endif
+
+	// Lane permutation of 4-vectors, lane i of result is lane (a, b, c, d)[i] of v.
+	template <size_t a, size_t b, size_t c, size_t d, class T>
+	inline TVector<T, 4> Swizzle(const TVector<T, 4>& v) {
+		TVector<T, 4> ret;
+		ret[0] = v[a];
+		ret[1] = v[b];
+		ret[2] = v[c];
+		ret[3] = v[d];
+		return ret;
+	}
+
+#if defined(USE_SSE) && !(defined(_MSC_VER) && _MSC_VER <= 1200)
+	// Shuffle immediate of Swizzle<a, b, c, d>. Shuffles only move lanes, so they are bit-exact with the scalar version
+	// as long as each lane comes from the same source lane, which is checked here.
+	template <size_t a, size_t b, size_t c, size_t d>
+	struct TSwizzleMask {
+		enum { value = _MM_SHUFFLE(d, c, b, a) };
+		static_assert(a < 4 && b < 4 && c < 4 && d < 4, "Swizzle lane out of range");
+		static_assert((value & 3) == a && ((value >> 2) & 3) == b && ((value >> 4) & 3) == c && ((value >> 6) & 3) == d, "Shuffle lanes differ from scalar swizzle");
+	};
+
+	template <size_t a, size_t b, size_t c, size_t d>
+	inline TVector<float, 4> Swizzle(const TVector<float, 4>& v) {
+		enum { mask = TSwizzleMask<a, b, c, d>::value };
+		__m128 x = LoadVector4f(v);
+		return StoreVector4f(_mm_shuffle_ps(x, x, mask));
+	}
+
+	template <size_t a, size_t b, size_t c, size_t d>
+	inline TVector<int, 4> Swizzle(const TVector<int, 4>& v) {
+		enum { mask = TSwizzleMask<a, b, c, d>::value };
+		return StoreVector4i(_mm_shuffle_epi32(LoadVector4i(v), mask));
+	}
+
+	template <size_t a, size_t b, size_t c, size_t d>
+	inline TVector<unsigned int, 4> Swizzle(const TVector<unsigned int, 4>& v) {
+		enum { mask = TSwizzleMask<a, b, c, d>::value };
+		return StoreVector4u(_mm_shuffle_epi32(LoadVector4i(v), mask));
+	}
 #endif
 
 #define VISIT(X, index) \
@@ -132,89 +231,104 @@ namespace PaintsNow {
 #define SWIZZLE4(X, Y, Z, W) \
 	inline TType4<T> _##X##Y##Z##W() const { return TType4<T>(X(), Y(), Z(), W()); } \
 
+#define SWIZZLE_INDEX(X) SWIZZLE_INDEX_##X
+#define SWIZZLE_INDEX_x 0
+#define SWIZZLE_INDEX_y 1
+#define SWIZZLE_INDEX_z 2
+#define SWIZZLE_INDEX_w 3
+
+// Swizzles within 4-vectors, single shuffles on SSE
+#if defined(_MSC_VER) && _MSC_VER <= 1200
+#define SWIZZLE4_LANES(X, Y, Z, W) SWIZZLE4(X, Y, Z, W)
+#else
+#define SWIZZLE4_LANES(X, Y, Z, W) \
+	inline TType4<T> _##X##Y##Z##W() const { return Swizzle<SWIZZLE_INDEX(X), SWIZZLE_INDEX(Y), SWIZZLE_INDEX(Z), SWIZZLE_INDEX(W)>(*this); } \
+
+#endif
+
 #define SWIZZLE4_FULL(X, Y, Z, W) \
-	inline TType4<T> _##X##X##X##X() const { return TType4<T>(X(), X(), X(), X()); } \
-	inline TType4<T> _##X##X##X##Y() const { return TType4<T>(X(), X(), X(), Y()); } \
-	inline TType4<T> _##X##X##X##Z() const { return TType4<T>(X(), X(), X(), Z()); } \
-	inline TType4<T> _##X##X##X##W() const { return TType4<T>(X(), X(), X(), W()); } \
+	SWIZZLE4_LANES(X, X, X, X) \
+	SWIZZLE4_LANES(X, X, X, Y) \
+	SWIZZLE4_LANES(X, X, X, Z) \
+	SWIZZLE4_LANES(X, X, X, W) \
 	\
-	inline TType4<T> _##X##X##Y##X() const { return TType4<T>(X(), X(), Y(), X()); } \
-	inline TType4<T> _##X##X##Y##Y() const { return TType4<T>(X(), X(), Y(), Y()); } \
-	inline TType4<T> _##X##X##Y##Z() const { return TType4<T>(X(), X(), Y(), Z()); } \
-	inline TType4<T> _##X##X##Y##W() const { return TType4<T>(X(), X(), Y(), W()); } \
+	SWIZZLE4_LANES(X, X, Y, X) \
+	SWIZZLE4_LANES(X, X, Y, Y) \
+	SWIZZLE4_LANES(X, X, Y, Z) \
+	SWIZZLE4_LANES(X, X, Y, W) \
 	\
-	inline TType4<T> _##X##X##Z##X() const { return TType4<T>(X(), X(), Z(), X()); } \
-	inline TType4<T> _##X##X##Z##Y() const { return TType4<T>(X(), X(), Z(), Y()); } \
-	inline TType4<T> _##X##X##Z##Z() const { return TType4<T>(X(), X(), Z(), Z()); } \
-	inline TType4<T> _##X##X##Z##W() const { return TType4<T>(X(), X(), Z(), W()); } \
+	SWIZZLE4_LANES(X, X, Z, X) \
+	SWIZZLE4_LANES(X, X, Z, Y) \
+	SWIZZLE4_LANES(X, X, Z, Z) \
+	SWIZZLE4_LANES(X, X, Z, W) \
 	\
-	inline TType4<T> _##X##X##W##X() const { return TType4<T>(X(), X(), W(), X()); } \
-	inline TType4<T> _##X##X##W##Y() const { return TType4<T>(X(), X(), W(), Y()); } \
-	inline TType4<T> _##X##X##W##Z() const { return TType4<T>(X(), X(), W(), Z()); } \
-	inline TType4<T> _##X##X##W##W() const { return TType4<T>(X(), X(), W(), W()); } \
+	SWIZZLE4_LANES(X, X, W, X) \
+	SWIZZLE4_LANES(X, X, W, Y) \
+	SWIZZLE4_LANES(X, X, W, Z) \
+	SWIZZLE4_LANES(X, X, W, W) \
 	\
 	\
-	inline TType4<T> _##X##Y##X##X() const { return TType4<T>(X(), Y(), X(), X()); } \
-	inline TType4<T> _##X##Y##X##Y() const { return TType4<T>(X(), Y(), X(), Y()); } \
-	inline TType4<T> _##X##Y##X##Z() const { return TType4<T>(X(), Y(), X(), Z()); } \
-	inline TType4<T> _##X##Y##X##W() const { return TType4<T>(X(), Y(), X(), W()); } \
+	SWIZZLE4_LANES(X, Y, X, X) \
+	SWIZZLE4_LANES(X, Y, X, Y) \
+	SWIZZLE4_LANES(X, Y, X, Z) \
+	SWIZZLE4_LANES(X, Y, X, W) \
 	\
-	inline TType4<T> _##X##Y##Y##X() const { return TType4<T>(X(), Y(), Y(), X()); } \
-	inline TType4<T> _##X##Y##Y##Y() const { return TType4<T>(X(), Y(), Y(), Y()); } \
-	inline TType4<T> _##X##Y##Y##Z() const { return TType4<T>(X(), Y(), Y(), Z()); } \
-	inline TType4<T> _##X##Y##Y##W() const { return TType4<T>(X(), Y(), Y(), W()); } \
+	SWIZZLE4_LANES(X, Y, Y, X) \
+	SWIZZLE4_LANES(X, Y, Y, Y) \
+	SWIZZLE4_LANES(X, Y, Y, Z) \
+	SWIZZLE4_LANES(X, Y, Y, W) \
 	\
-	inline TType4<T> _##X##Y##Z##X() const { return TType4<T>(X(), Y(), Z(), X()); } \
-	inline TType4<T> _##X##Y##Z##Y() const { return TType4<T>(X(), Y(), Z(), Y()); } \
-	inline TType4<T> _##X##Y##Z##Z() const { return TType4<T>(X(), Y(), Z(), Z()); } \
-	inline TType4<T> _##X##Y##Z##W() const { return TType4<T>(X(), Y(), Z(), W()); } \
+	SWIZZLE4_LANES(X, Y, Z, X) \
+	SWIZZLE4_LANES(X, Y, Z, Y) \
+	SWIZZLE4_LANES(X, Y, Z, Z) \
+	SWIZZLE4_LANES(X, Y, Z, W) \
 	\
-	inline TType4<T> _##X##Y##W##X() const { return TType4<T>(X(), Y(), W(), X()); } \
-	inline TType4<T> _##X##Y##W##Y() const { return TType4<T>(X(), Y(), W(), Y()); } \
-	inline TType4<T> _##X##Y##W##Z() const { return TType4<T>(X(), Y(), W(), Z()); } \
-	inline TType4<T> _##X##Y##W##W() const { return TType4<T>(X(), Y(), W(), W()); } \
+	SWIZZLE4_LANES(X, Y, W, X) \
+	SWIZZLE4_LANES(X, Y, W, Y) \
+	SWIZZLE4_LANES(X, Y, W, Z) \
+	SWIZZLE4_LANES(X, Y, W, W) \
 	\
 	\
-	inline TType4<T> _##X##Z##X##X() const { return TType4<T>(X(), Z(), X(), X()); } \
-	inline TType4<T> _##X##Z##X##Y() const { return TType4<T>(X(), Z(), X(), Y()); } \
-	inline TType4<T> _##X##Z##X##Z() const { return TType4<T>(X(), Z(), X(), Z()); } \
-	inline TType4<T> _##X##Z##X##W() const { return TType4<T>(X(), Z(), X(), W()); } \
+	SWIZZLE4_LANES(X, Z, X, X) \
+	SWIZZLE4_LANES(X, Z, X, Y) \
+	SWIZZLE4_LANES(X, Z, X, Z) \
+	SWIZZLE4_LANES(X, Z, X, W) \
 	\
-	inline TType4<T> _##X##Z##Y##X() const { return TType4<T>(X(), Z(), Y(), X()); } \
-	inline TType4<T> _##X##Z##Y##Y() const { return TType4<T>(X(), Z(), Y(), Y()); } \
-	inline TType4<T> _##X##Z##Y##Z() const { return TType4<T>(X(), Z(), Y(), Z()); } \
-	inline TType4<T> _##X##Z##Y##W() const { return TType4<T>(X(), Z(), Y(), W()); } \
+	SWIZZLE4_LANES(X, Z, Y, X) \
+	SWIZZLE4_LANES(X, Z, Y, Y) \
+	SWIZZLE4_LANES(X, Z, Y, Z) \
+	SWIZZLE4_LANES(X, Z, Y, W) \
 	\
-	inline TType4<T> _##X##Z##Z##X() const { return TType4<T>(X(), Z(), Z(), X()); } \
-	inline TType4<T> _##X##Z##Z##Y() const { return TType4<T>(X(), Z(), Z(), Y()); } \
-	inline TType4<T> _##X##Z##Z##Z() const { return TType4<T>(X(), Z(), Z(), Z()); } \
-	inline TType4<T> _##X##Z##Z##W() const { return TType4<T>(X(), Z(), Z(), W()); } \
+	SWIZZLE4_LANES(X, Z, Z, X) \
+	SWIZZLE4_LANES(X, Z, Z, Y) \
+	SWIZZLE4_LANES(X, Z, Z, Z) \
+	SWIZZLE4_LANES(X, Z, Z, W) \
 	\
-	inline TType4<T> _##X##Z##W##X() const { return TType4<T>(X(), Z(), W(), X()); } \
-	inline TType4<T> _##X##Z##W##Y() const { return TType4<T>(X(), Z(), W(), Y()); } \
-	inline TType4<T> _##X##Z##W##Z() const { return TType4<T>(X(), Z(), W(), Z()); } \
-	inline TType4<T> _##X##Z##W##W() const { return TType4<T>(X(), Z(), W(), W()); } \
+	SWIZZLE4_LANES(X, Z, W, X) \
+	SWIZZLE4_LANES(X, Z, W, Y) \
+	SWIZZLE4_LANES(X, Z, W, Z) \
+	SWIZZLE4_LANES(X, Z, W, W) \
 	\
 	\
-	inline TType4<T> _##X##W##X##X() const { return TType4<T>(X(), W(), X(), X()); } \
-	inline TType4<T> _##X##W##X##Y() const { return TType4<T>(X(), W(), X(), Y()); } \
-	inline TType4<T> _##X##W##X##Z() const { return TType4<T>(X(), W(), X(), Z()); } \
-	inline TType4<T> _##X##W##X##W() const { return TType4<T>(X(), W(), X(), W()); } \
+	SWIZZLE4_LANES(X, W, X, X) \
+	SWIZZLE4_LANES(X, W, X, Y) \
+	SWIZZLE4_LANES(X, W, X, Z) \
+	SWIZZLE4_LANES(X, W, X, W) \
 	\
-	inline TType4<T> _##X##W##Y##X() const { return TType4<T>(X(), W(), Y(), X()); } \
-	inline TType4<T> _##X##W##Y##Y() const { return TType4<T>(X(), W(), Y(), Y()); } \
-	inline TType4<T> _##X##W##Y##Z() const { return TType4<T>(X(), W(), Y(), Z()); } \
-	inline TType4<T> _##X##W##Y##W() const { return TType4<T>(X(), W(), Y(), W()); } \
+	SWIZZLE4_LANES(X, W, Y, X) \
+	SWIZZLE4_LANES(X, W, Y, Y) \
+	SWIZZLE4_LANES(X, W, Y, Z) \
+	SWIZZLE4_LANES(X, W, Y, W) \
 	\
-	inline TType4<T> _##X##W##Z##X() const { return TType4<T>(X(), W(), Z(), X()); } \
-	inline TType4<T> _##X##W##Z##Y() const { return TType4<T>(X(), W(), Z(), Y()); } \
-	inline TType4<T> _##X##W##Z##Z() const { return TType4<T>(X(), W(), Z(), Z()); } \
-	inline TType4<T> _##X##W##Z##W() const { return TType4<T>(X(), W(), Z(), W()); } \
+	SWIZZLE4_LANES(X, W, Z, X) \
+	SWIZZLE4_LANES(X, W, Z, Y) \
+	SWIZZLE4_LANES(X, W, Z, Z) \
+	SWIZZLE4_LANES(X, W, Z, W) \
 	\
-	inline TType4<T> _##X##W##W##X() const { return TType4<T>(X(), W(), W(), X()); } \
-	inline TType4<T> _##X##W##W##Y() const { return TType4<T>(X(), W(), W(), Y()); } \
-	inline TType4<T> _##X##W##W##Z() const { return TType4<T>(X(), W(), W(), Z()); } \
-	inline TType4<T> _##X##W##W##W() const { return TType4<T>(X(), W(), W(), W()); } \
+	SWIZZLE4_LANES(X, W, W, X) \
+	SWIZZLE4_LANES(X, W, W, Y) \
+	SWIZZLE4_LANES(X, W, W, Z) \
+	SWIZZLE4_LANES(X, W, W, W) \
 	\
 
 	template <class T>
@@ -953,6 +1067,328 @@ namespace PaintsNow {
 	}
 #endif
 
+	// Double4 and 8-wide float arithmetic
+#ifdef USE_AVX
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4> operator + (const TVector<double, 4>& lhs, const double& rhs) {
+		return StoreVector4d(_mm256_add_pd(LoadVector4d(lhs), _mm256_set1_pd(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4> operator + (const TVector<double, 4>& lhs, const TVector<double, 4>& rhs) {
+		return StoreVector4d(_mm256_add_pd(LoadVector4d(lhs), LoadVector4d(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4>& operator += (TVector<double, 4>& lhs, double t) {
+		return lhs = StoreVector4d(_mm256_add_pd(LoadVector4d(lhs), _mm256_set1_pd(t)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4>& operator += (TVector<double, 4>& lhs, const TVector<double, 4>& rhs) {
+		return lhs = StoreVector4d(_mm256_add_pd(LoadVector4d(lhs), LoadVector4d(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4> operator - (const TVector<double, 4>& lhs, const double& rhs) {
+		return StoreVector4d(_mm256_sub_pd(LoadVector4d(lhs), _mm256_set1_pd(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4> operator - (const TVector<double, 4>& lhs, const TVector<double, 4>& rhs) {
+		return StoreVector4d(_mm256_sub_pd(LoadVector4d(lhs), LoadVector4d(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4>& operator -= (TVector<double, 4>& lhs, double t) {
+		return lhs = StoreVector4d(_mm256_sub_pd(LoadVector4d(lhs), _mm256_set1_pd(t)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4>& operator -= (TVector<double, 4>& lhs, const TVector<double, 4>& rhs) {
+		return lhs = StoreVector4d(_mm256_sub_pd(LoadVector4d(lhs), LoadVector4d(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4> operator * (const TVector<double, 4>& lhs, const double& rhs) {
+		return StoreVector4d(_mm256_mul_pd(LoadVector4d(lhs), _mm256_set1_pd(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4> operator * (const TVector<double, 4>& lhs, const TVector<double, 4>& rhs) {
+		return StoreVector4d(_mm256_mul_pd(LoadVector4d(lhs), LoadVector4d(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4>& operator *= (TVector<double, 4>& lhs, const double& t) {
+		return lhs = StoreVector4d(_mm256_mul_pd(LoadVector4d(lhs), _mm256_set1_pd(t)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4>& operator *= (TVector<double, 4>& lhs, const TVector<double, 4>& rhs) {
+		return lhs = StoreVector4d(_mm256_mul_pd(LoadVector4d(lhs), LoadVector4d(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4> operator / (const TVector<double, 4>& lhs, const double& rhs) {
+		return StoreVector4d(_mm256_div_pd(LoadVector4d(lhs), _mm256_set1_pd(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4> operator / (const TVector<double, 4>& lhs, const TVector<double, 4>& rhs) {
+		return StoreVector4d(_mm256_div_pd(LoadVector4d(lhs), LoadVector4d(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4>& operator /= (TVector<double, 4>& lhs, const double& t) {
+		return lhs = StoreVector4d(_mm256_div_pd(LoadVector4d(lhs), _mm256_set1_pd(t)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<double, 4>& operator /= (TVector<double, 4>& lhs, const TVector<double, 4>& rhs) {
+		return lhs = StoreVector4d(_mm256_div_pd(LoadVector4d(lhs), LoadVector4d(rhs)));
+	}
+#endif
+
+#ifdef USE_AVX
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8> operator + (const TVector<float, 8>& lhs, const float& rhs) {
+		return StoreVector8f(_mm256_add_ps(LoadVector8f(lhs), _mm256_set1_ps(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8> operator + (const TVector<float, 8>& lhs, const TVector<float, 8>& rhs) {
+		return StoreVector8f(_mm256_add_ps(LoadVector8f(lhs), LoadVector8f(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8>& operator += (TVector<float, 8>& lhs, float t) {
+		return lhs = StoreVector8f(_mm256_add_ps(LoadVector8f(lhs), _mm256_set1_ps(t)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8>& operator += (TVector<float, 8>& lhs, const TVector<float, 8>& rhs) {
+		return lhs = StoreVector8f(_mm256_add_ps(LoadVector8f(lhs), LoadVector8f(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8> operator - (const TVector<float, 8>& lhs, const float& rhs) {
+		return StoreVector8f(_mm256_sub_ps(LoadVector8f(lhs), _mm256_set1_ps(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8> operator - (const TVector<float, 8>& lhs, const TVector<float, 8>& rhs) {
+		return StoreVector8f(_mm256_sub_ps(LoadVector8f(lhs), LoadVector8f(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8>& operator -= (TVector<float, 8>& lhs, float t) {
+		return lhs = StoreVector8f(_mm256_sub_ps(LoadVector8f(lhs), _mm256_set1_ps(t)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8>& operator -= (TVector<float, 8>& lhs, const TVector<float, 8>& rhs) {
+		return lhs = StoreVector8f(_mm256_sub_ps(LoadVector8f(lhs), LoadVector8f(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8> operator * (const TVector<float, 8>& lhs, const float& rhs) {
+		return StoreVector8f(_mm256_mul_ps(LoadVector8f(lhs), _mm256_set1_ps(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8> operator * (const TVector<float, 8>& lhs, const TVector<float, 8>& rhs) {
+		return StoreVector8f(_mm256_mul_ps(LoadVector8f(lhs), LoadVector8f(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8>& operator *= (TVector<float, 8>& lhs, const float& t) {
+		return lhs = StoreVector8f(_mm256_mul_ps(LoadVector8f(lhs), _mm256_set1_ps(t)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8>& operator *= (TVector<float, 8>& lhs, const TVector<float, 8>& rhs) {
+		return lhs = StoreVector8f(_mm256_mul_ps(LoadVector8f(lhs), LoadVector8f(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8> operator / (const TVector<float, 8>& lhs, const float& rhs) {
+		return StoreVector8f(_mm256_div_ps(LoadVector8f(lhs), _mm256_set1_ps(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8> operator / (const TVector<float, 8>& lhs, const TVector<float, 8>& rhs) {
+		return StoreVector8f(_mm256_div_ps(LoadVector8f(lhs), LoadVector8f(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8>& operator /= (TVector<float, 8>& lhs, const float& t) {
+		return lhs = StoreVector8f(_mm256_div_ps(LoadVector8f(lhs), _mm256_set1_ps(t)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<float, 8>& operator /= (TVector<float, 8>& lhs, const TVector<float, 8>& rhs) {
+		return lhs = StoreVector8f(_mm256_div_ps(LoadVector8f(lhs), LoadVector8f(rhs)));
+	}
+#endif
+
+	// Int4 and UInt4 arithmetic, wrapping as scalar code does
+#ifdef USE_SSE
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<int, 4> operator + (const TVector<int, 4>& lhs, const TVector<int, 4>& rhs) {
+		return StoreVector4i(_mm_add_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<int, 4>& operator += (TVector<int, 4>& lhs, const TVector<int, 4>& rhs) {
+		return lhs = StoreVector4i(_mm_add_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<int, 4> operator - (const TVector<int, 4>& lhs, const TVector<int, 4>& rhs) {
+		return StoreVector4i(_mm_sub_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<int, 4>& operator -= (TVector<int, 4>& lhs, const TVector<int, 4>& rhs) {
+		return lhs = StoreVector4i(_mm_sub_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+#endif
+
+#ifdef USE_SSE
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<unsigned int, 4> operator + (const TVector<unsigned int, 4>& lhs, const TVector<unsigned int, 4>& rhs) {
+		return StoreVector4u(_mm_add_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<unsigned int, 4>& operator += (TVector<unsigned int, 4>& lhs, const TVector<unsigned int, 4>& rhs) {
+		return lhs = StoreVector4u(_mm_add_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<unsigned int, 4> operator - (const TVector<unsigned int, 4>& lhs, const TVector<unsigned int, 4>& rhs) {
+		return StoreVector4u(_mm_sub_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<unsigned int, 4>& operator -= (TVector<unsigned int, 4>& lhs, const TVector<unsigned int, 4>& rhs) {
+		return lhs = StoreVector4u(_mm_sub_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+#endif
+
+#ifdef USE_AVX2
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<int, 4> operator * (const TVector<int, 4>& lhs, const TVector<int, 4>& rhs) {
+		return StoreVector4i(_mm_mullo_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<int, 4>& operator *= (TVector<int, 4>& lhs, const TVector<int, 4>& rhs) {
+		return lhs = StoreVector4i(_mm_mullo_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+#endif
+
+#ifdef USE_AVX2
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<unsigned int, 4> operator * (const TVector<unsigned int, 4>& lhs, const TVector<unsigned int, 4>& rhs) {
+		return StoreVector4u(_mm_mullo_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+
+#ifndef _MSC_VER
+	template <>
+#endif
+	inline TVector<unsigned int, 4>& operator *= (TVector<unsigned int, 4>& lhs, const TVector<unsigned int, 4>& rhs) {
+		return lhs = StoreVector4u(_mm_mullo_epi32(LoadVector4i(lhs), LoadVector4i(rhs)));
+	}
+#endif
+
 	template <class T, size_t n>
 	inline bool operator == (const TVector<T, n>& lhs, const TVector<T, n>& rhs) {
 		return memcmp(&lhs, &rhs, sizeof(lhs)) == 0;
@@ -0,0 +1,165 @@
+// BufferTest.cpp
+// Copy-on-write checks for shared TBuffer storage.
+// Build from repository root: g++ -std=c++11 -O2 -I. Test/BufferTest.cpp
+// Exits with non-zero status on the first mismatch.
+//
+
+#include "../Template/TBuffer.h"
+#include <cstdio>
+#include <cstdlib>
+
+using namespace PaintsNow;
+
+#define CHECK(f) \
+	if (!(f)) { \
+		printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #f); \
+		exit(1); \
+	}
+
+static const uint8_t* ReadData(const Bytes& bytes) {
+	return bytes.GetData();
+}
+
+static Bytes MakeBytes(size_t size, uint8_t seed) {
+	Bytes bytes(size);
+	for (size_t i = 0; i < size; i++) {
+		bytes[i] = (uint8_t)(seed + i);
+	}
+
+	return bytes;
+}
+
+static bool Matches(const Bytes& bytes, size_t size, uint8_t seed) {
+	if (bytes.GetSize() != size) {
+		return false;
+	}
+
+	for (size_t i = 0; i < size; i++) {
+		if (bytes[i] != (uint8_t)(seed + i)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void TestShareStock() {
+	// stock storage is copied anyway, nothing to share
+	Bytes bytes = MakeBytes(8, 1);
+	CHECK(bytes.IsStockStorage());
+	bytes.Share();
+	CHECK(bytes.IsStockStorage());
+	CHECK(!bytes.IsSharedStorage());
+	CHECK(Matches(bytes, 8, 1));
+}
+
+static void TestShareCopy() {
+	Bytes bytes = MakeBytes(1000, 2);
+	CHECK(bytes.IsManagedStorage());
+	bytes.Share();
+	CHECK(bytes.IsSharedStorage());
+	CHECK(Matches(bytes, 1000, 2));
+
+	// copies only add a reference, also through assignment
+	Bytes copy(bytes);
+	Bytes assigned;
+	assigned = copy;
+	CHECK(copy.IsSharedStorage() && assigned.IsSharedStorage());
+	CHECK(ReadData(copy) == ReadData(bytes));
+	CHECK(ReadData(assigned) == ReadData(bytes));
+	CHECK(Matches(copy, 1000, 2));
+
+	// self assignment keeps the reference
+	assigned = assigned;
+	CHECK(ReadData(assigned) == ReadData(bytes));
+
+	// the storage outlives the buffer it was shared from
+	bytes.Clear();
+	CHECK(Matches(copy, 1000, 2));
+	CHECK(Matches(assigned, 1000, 2));
+}
+
+static void TestDetachOnWrite() {
+	Bytes bytes = MakeBytes(1000, 3);
+	bytes.Share();
+	Bytes copy = bytes;
+	const uint8_t* data = ReadData(bytes);
+
+	// reads never detach
+	CHECK(copy == bytes);
+	CHECK(ReadData(copy) == data);
+
+	// the first write detaches the writer only
+	copy[10] = 0;
+	CHECK(ReadData(copy) != data);
+	CHECK(ReadData(bytes) == data);
+	CHECK(Matches(bytes, 1000, 3));
+	CHECK(copy[10] == 0 && copy[11] == (uint8_t)(3 + 11));
+
+	// both are the only owners now, writes stay in place
+	const uint8_t* detached = ReadData(copy);
+	copy[20] = 0;
+	bytes[20] = 0;
+	CHECK(ReadData(copy) == detached);
+	CHECK(ReadData(bytes) == data);
+
+	// imports write too
+	Bytes imported = bytes;
+	uint8_t value = 7;
+	imported.Import(30, &value, 1);
+	CHECK(ReadData(imported) != data);
+	CHECK(imported[30] == 7 && bytes[30] == (uint8_t)(3 + 30));
+}
+
+static void TestDetachOnResize() {
+	Bytes bytes = MakeBytes(1000, 4);
+	bytes.Share();
+	const uint8_t* data = ReadData(bytes);
+
+	Bytes larger = bytes;
+	larger.Resize(2000);
+	CHECK(larger.IsManagedStorage());
+	CHECK(larger.GetSize() == 2000);
+	for (size_t i = 0; i < 1000; i++) {
+		CHECK(larger[i] == (uint8_t)(4 + i));
+	}
+
+	Bytes smaller = bytes;
+	smaller.Resize(8);
+	CHECK(smaller.IsStockStorage());
+	CHECK(Matches(smaller, 8, 4));
+
+	Bytes appended = bytes;
+	appended.Append(data, 10);
+	CHECK(appended.GetSize() == 1010 && appended[1005] == (uint8_t)(4 + 5));
+
+	// none of them touched the shared storage
+	CHECK(ReadData(bytes) == data);
+	CHECK(Matches(bytes, 1000, 4));
+}
+
+static void TestMoveShared() {
+	Bytes bytes = MakeBytes(1000, 5);
+	bytes.Share();
+	const uint8_t* data = ReadData(bytes);
+
+	Bytes moved(std::move(bytes));
+	CHECK(bytes.Empty());
+	CHECK(moved.IsSharedStorage());
+	CHECK(ReadData(moved) == data);
+
+	// a moved sole owner writes in place
+	moved[0] = 0;
+	CHECK(ReadData(moved) == data);
+}
+
+int main() {
+	TestShareStock();
+	TestShareCopy();
+	TestDetachOnWrite();
+	TestDetachOnResize();
+	TestMoveShared();
+
+	printf("BufferTest passed.\n");
+	return 0;
+}
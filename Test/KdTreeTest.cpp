@@ -0,0 +1,815 @@
+// KdTreeTest.cpp
+// Brute-force checks for TKdTree, TStaticKdTree and TSnapshotKdTree.
+// Build from repository root: g++ -std=c++11 -O2 -DUSE_OPTICK=0 -I. Test/KdTreeTest.cpp Interface/*.cpp System/Tiny.cpp System/ThreadPool.cpp Driver/Thread/Pthread/ZThreadPthread.cpp PaintsNow.cpp -lpthread
+// Exits with non-zero status on the first mismatch.
+//
+
+#include "../Template/TKdTree.h"
+#include "../Template/TFrustum.h"
+#include "../Template/TRay.h"
+#include <cmath>
+#include <cstdio>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace PaintsNow;
+
+#define CHECK(f) \
+	if (!(f)) { \
+		printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #f); \
+		exit(1); \
+	}
+
+static uint32_t seed = 1;
+
+static float Random(float lower, float upper) {
+	seed = seed * 1664525u + 1013904223u;
+	return lower + (upper - lower) * (float)(seed >> 8) / (float)(1 << 24);
+}
+
+static Float3Pair RandomBox(float range, float extent) {
+	Float3 lower(Random(-range, range), Random(-range, range), Random(-range, range));
+	Float3 upper(lower.x() + Random(0, extent), lower.y() + Random(0, extent), lower.z() + Random(0, extent));
+	return Float3Pair(lower, upper);
+}
+
+struct Collector {
+	bool operator () (const Float3Pair& key, uint32_t value) {
+		values.insert(value);
+		return true;
+	}
+
+	std::set<uint32_t> values;
+};
+
+struct BatchCollector {
+	bool operator () (uint32_t index, const Float3Pair& key, uint32_t value) {
+		pairs.insert(std::make_pair(index, value));
+		return true;
+	}
+
+	std::set<std::pair<uint32_t, uint32_t> > pairs;
+};
+
+struct NearestHit {
+	NearestHit() : distance(std::numeric_limits<float>::max()) {}
+	float operator () (const Float3Pair& key, uint32_t value, float tmin) {
+		distance = Math::Min(distance, tmin);
+		return distance;
+	}
+
+	float distance;
+};
+
+static void CheckStaticQuery(const TStaticKdTree<Float3Pair>& tree, const std::vector<Float3Pair>& keys) {
+	std::vector<Float3Pair> targets(64);
+	for (size_t k = 0; k < targets.size(); k++) {
+		targets[k] = RandomBox(100, 40);
+	}
+
+	BatchCollector batch;
+	tree.QueryBatch(&targets[0], (uint32_t)targets.size(), batch);
+
+	for (uint32_t k = 0; k < targets.size(); k++) {
+		Collector collector;
+		tree.Query(targets[k], collector);
+
+		std::set<uint32_t> expected;
+		for (uint32_t i = 0; i < keys.size(); i++) {
+			if (TOverlap<Float3Pair>::Overlap(keys[i], targets[k])) {
+				expected.insert(i);
+				CHECK(batch.pairs.count(std::make_pair(k, i)) == 1);
+			}
+		}
+
+		CHECK(collector.values == expected);
+	}
+}
+
+static void TestStaticQuery() {
+	for (uint32_t count = 0; count < 3000; count = count * 3 + 1) {
+		std::vector<Float3Pair> keys(count);
+		std::vector<uint32_t> values(count);
+		for (uint32_t i = 0; i < count; i++) {
+			keys[i] = RandomBox(100, 10);
+			values[i] = i;
+		}
+
+		TStaticKdTree<Float3Pair> tree;
+		tree.Build(count == 0 ? nullptr : &keys[0], count == 0 ? nullptr : &values[0], count);
+		CheckStaticQuery(tree, keys);
+	}
+}
+
+static void TestStaticCull() {
+	std::vector<Float3Pair> keys(2000);
+	std::vector<uint32_t> values(keys.size());
+	for (uint32_t i = 0; i < keys.size(); i++) {
+		keys[i] = RandomBox(100, 10);
+		values[i] = i;
+	}
+
+	TStaticKdTree<Float3Pair> tree;
+	tree.Build(&keys[0], &values[0], (uint32_t)keys.size());
+
+	for (int k = 0; k < 32; k++) {
+		Float3 position(Random(-50, 50), Random(-50, 50), Random(-50, 50));
+		Float3 direction(Random(-1, 1), Random(-1, 1), Random(-1, 1));
+		TMatrix<float, 4, 4> view = Math::MatrixLookAt(position, direction, Float3(0, 1, 0));
+		TFrustum<float> frustum(view * Math::MatrixPerspective(1.0f, 1.0f, 1.0f, 80.0f));
+
+		Collector collector;
+		tree.Cull(frustum, collector);
+
+		std::set<uint32_t> expected;
+		for (uint32_t i = 0; i < keys.size(); i++) {
+			if (frustum.Test(keys[i])) {
+				expected.insert(i);
+			}
+		}
+
+		// subtrees fully inside are reported without per-key tests, which are conservative anyway
+		CHECK(collector.values == expected);
+	}
+}
+
+static void TestStaticRay() {
+	std::vector<Float3Pair> keys(2000);
+	std::vector<uint32_t> values(keys.size());
+	for (uint32_t i = 0; i < keys.size(); i++) {
+		keys[i] = RandomBox(100, 10);
+		values[i] = i;
+	}
+
+	TStaticKdTree<Float3Pair> tree;
+	tree.Build(&keys[0], &values[0], (uint32_t)keys.size());
+
+	for (int k = 0; k < 1024; k++) {
+		Float3 direction(Random(-1, 1), Random(-1, 1), Random(-1, 1));
+		if (k % 8 == 0) {
+			direction[k % 3] = 0;
+		}
+
+		TRay<float> ray(Float3(Random(-100, 100), Random(-100, 100), Random(-100, 100)), direction);
+		NearestHit hit;
+		tree.QueryRay(ray, 0.0f, 1000.0f, hit);
+
+		float expected = std::numeric_limits<float>::max();
+		for (uint32_t i = 0; i < keys.size(); i++) {
+			float tmin = 0.0f, tmax = 1000.0f;
+			if (ray.Intersect(keys[i], tmin, tmax)) {
+				expected = Math::Min(expected, tmin);
+			}
+		}
+
+		CHECK(hit.distance == expected);
+	}
+}
+
+// Minimal ThreadPool compatible executor for parallel builds.
+// The owner thread is pooled and runs tasks in PollWait, other callers are not. Every third push fails to cover the inline fallback.
+class TestThreadPool {
+public:
+	TestThreadPool(uint32_t count) : owner(std::this_thread::get_id()), running(true), pushCount(0) {
+		for (uint32_t i = 0; i < count; i++) {
+			workers.push_back(std::thread(&TestThreadPool::Work, this));
+		}
+	}
+
+	~TestThreadPool() {
+		mutex.lock();
+		running = false;
+		mutex.unlock();
+		condition.notify_all();
+
+		for (size_t i = 0; i < workers.size(); i++) {
+			workers[i].join();
+		}
+	}
+
+	bool IsRunning() const {
+		return true;
+	}
+
+	uint32_t GetThreadCount() const {
+		return (uint32_t)workers.size() + 1;
+	}
+
+	uint32_t GetCurrentThreadIndex() const {
+		return std::this_thread::get_id() == owner ? 0 : ~(uint32_t)0;
+	}
+
+	bool Push(ITask* task) {
+		std::lock_guard<std::mutex> guard(mutex);
+		if (++pushCount % 3 == 0) {
+			return false;
+		}
+
+		tasks.push_back(task);
+		condition.notify_one();
+		return true;
+	}
+
+	bool PollWait(std::atomic<uint32_t>& variable, uint32_t mask = ~(uint32_t)0, uint32_t flag = 0) {
+		while ((variable.load(std::memory_order_acquire) & mask) != flag) {
+			ITask* task = Take(false);
+			if (task != nullptr) {
+				task->Execute(nullptr);
+			} else {
+				std::this_thread::yield();
+			}
+		}
+
+		return true;
+	}
+
+	uint32_t GetPushCount() {
+		std::lock_guard<std::mutex> guard(mutex);
+		return pushCount;
+	}
+
+protected:
+	ITask* Take(bool wait) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (tasks.empty()) {
+			if (!wait || !running) {
+				return nullptr;
+			}
+
+			condition.wait(lock);
+		}
+
+		ITask* task = tasks.front();
+		tasks.pop_front();
+		return task;
+	}
+
+	void Work() {
+		ITask* task;
+		while ((task = Take(true)) != nullptr) {
+			task->Execute(nullptr);
+		}
+	}
+
+	std::thread::id owner;
+	std::vector<std::thread> workers;
+	std::deque<ITask*> tasks;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool running;
+	uint32_t pushCount;
+};
+
+static void BuildParallel(TStaticKdTree<Float3Pair>* tree, TestThreadPool* threadPool, const std::vector<Float3Pair>* keys, const std::vector<uint32_t>* values) {
+	tree->Build(*threadPool, &(*keys)[0], &(*values)[0], (uint32_t)keys->size(), 64);
+}
+
+static void TestStaticBuildParallel() {
+	TestThreadPool threadPool(3);
+	for (uint32_t count = 1; count < 20000; count = count * 5 + 3) {
+		std::vector<Float3Pair> keys(count);
+		std::vector<uint32_t> values(count);
+		for (uint32_t i = 0; i < count; i++) {
+			keys[i] = RandomBox(100, 10);
+			values[i] = i;
+		}
+
+		// from the pooled owner thread, which polls while waiting
+		TStaticKdTree<Float3Pair> tree;
+		BuildParallel(&tree, &threadPool, &keys, &values);
+		CHECK(tree.GetCount() == count);
+		CheckStaticQuery(tree, keys);
+
+		// from a thread out of the pool, which can only wait
+		TStaticKdTree<Float3Pair> other;
+		std::thread builder(BuildParallel, &other, &threadPool, &keys, &values);
+		builder.join();
+		CHECK(other.GetCount() == count);
+		CheckStaticQuery(other, keys);
+	}
+
+	// large counts must have been split into tasks
+	CHECK(threadPool.GetPushCount() > 3);
+}
+
+static void TestNearest() {
+	typedef TKdTree<Float3Pair> Tree;
+	const uint32_t count = 3000;
+	std::vector<Tree> nodes(count);
+	for (uint32_t i = 0; i < count; i++) {
+		nodes[i] = Tree(RandomBox(100, 4), (uint8_t)(i % 6));
+		if (i != 0) {
+			nodes[0].Attach(&nodes[i]);
+		}
+	}
+
+	const uint32_t K = 8;
+	std::vector<Tree::NearestNode> results(K), expected(count);
+	for (int k = 0; k < 64; k++) {
+		Float3 point(Random(-100, 100), Random(-100, 100), Random(-100, 100));
+		Float3Pair target(point, point);
+		CHECK(nodes[0].QueryNearest(target, &results[0], K) == K);
+
+		for (uint32_t i = 0; i < count; i++) {
+			expected[i] = Tree::NearestNode(TOverlap<Float3Pair>::Distance(nodes[i].GetKey(), target), &nodes[i]);
+		}
+
+		std::partial_sort(expected.begin(), expected.begin() + K, expected.end());
+		for (uint32_t i = 0; i < K; i++) {
+			CHECK(results[i].first == expected[i].first);
+		}
+	}
+}
+
+struct DynamicNearestHit {
+	DynamicNearestHit() : distance(std::numeric_limits<float>::max()) {}
+	float operator () (TKdTree<Float3Pair>&, float tmin) {
+		distance = Math::Min(distance, tmin);
+		return distance;
+	}
+
+	float distance;
+};
+
+// Slab test with divisions like TKdTree::QueryRay, TRay multiplies by inverse directions which may round differently.
+static bool ClipSlabs(const Float3Pair& key, const Float3& origin, const Float3& direction, float& tmin, float& tmax) {
+	for (size_t c = 0; c < 3; c++) {
+		if (direction[c] == 0) {
+			if (origin[c] < key.first[c] || key.second[c] < origin[c]) {
+				return false;
+			}
+		} else {
+			float enter = (key.first[c] - origin[c]) / direction[c];
+			float leave = (key.second[c] - origin[c]) / direction[c];
+			if (direction[c] < 0) {
+				std::swap(enter, leave);
+			}
+
+			tmin = Math::Max(tmin, enter);
+			tmax = Math::Min(tmax, leave);
+		}
+	}
+
+	return !(tmax < tmin);
+}
+
+static void TestDynamicRay() {
+	typedef TKdTree<Float3Pair> Tree;
+	const uint32_t count = 3000;
+	std::vector<Tree> nodes(count);
+	for (uint32_t i = 0; i < count; i++) {
+		nodes[i] = Tree(RandomBox(100, 10), (uint8_t)(i % 6));
+		if (i != 0) {
+			nodes[0].Attach(&nodes[i]);
+		}
+	}
+
+	for (int k = 0; k < 1024; k++) {
+		Float3 direction(Random(-1, 1), Random(-1, 1), Random(-1, 1));
+		if (k % 8 == 0) {
+			direction[k % 3] = 0;
+		}
+
+		Float3 origin(Random(-100, 100), Random(-100, 100), Random(-100, 100));
+		DynamicNearestHit hit;
+		nodes[0].QueryRay(origin, direction, 0.0f, 1000.0f, hit);
+
+		float expected = std::numeric_limits<float>::max();
+		for (uint32_t i = 0; i < count; i++) {
+			float tmin = 0.0f, tmax = 1000.0f;
+			if (ClipSlabs(nodes[i].GetKey(), origin, direction, tmin, tmax)) {
+				expected = Math::Min(expected, tmin);
+			}
+		}
+
+		CHECK(hit.distance == expected);
+	}
+}
+
+typedef TKdTree<Float3Pair> DynamicTree;
+
+// Records ids of visited nodes overlapping the target, or of all visited nodes with the prune filter.
+// With prune, descending stops at nodes where (id + target) % 5 == 0, so Query and QueryBatch must visit the same pairs.
+struct DynamicCollector {
+	DynamicCollector(DynamicTree* b, uint32_t t, bool p) : base(b), target(t), prune(p) {}
+	bool operator () (const Float3Pair& targetKey, DynamicTree& node) {
+		uint32_t id = (uint32_t)(&node - base);
+		if (prune) {
+			CHECK(visited.insert(id).second);
+			return (id + target) % 5 != 0;
+		}
+
+		if (TOverlap<Float3Pair>::Overlap(node.GetKey(), targetKey)) {
+			CHECK(visited.insert(id).second);
+		}
+
+		return true;
+	}
+
+	DynamicTree* base;
+	uint32_t target;
+	bool prune;
+	std::set<uint32_t> visited;
+};
+
+struct DynamicBatchCollector {
+	DynamicBatchCollector(DynamicTree* b, const Float3Pair* t, bool p) : base(b), targets(t), prune(p) {}
+	bool operator () (uint32_t index, DynamicTree& node) {
+		uint32_t id = (uint32_t)(&node - base);
+		if (prune) {
+			CHECK(pairs.insert(std::make_pair(index, id)).second);
+			return (id + index) % 5 != 0;
+		}
+
+		if (TOverlap<Float3Pair>::Overlap(node.GetKey(), targets[index])) {
+			CHECK(pairs.insert(std::make_pair(index, id)).second);
+		}
+
+		return true;
+	}
+
+	DynamicTree* base;
+	const Float3Pair* targets;
+	bool prune;
+	std::set<std::pair<uint32_t, uint32_t> > pairs;
+};
+
+static void CheckDynamicQuery(DynamicTree* root, std::vector<DynamicTree>& nodes, std::vector<Float3Pair>& targets) {
+	DynamicTree* base = &nodes[0];
+	DynamicBatchCollector batch(base, &targets[0], false);
+	root->QueryBatch(&targets[0], (uint32_t)targets.size(), batch);
+	DynamicBatchCollector prunedBatch(base, &targets[0], true);
+	root->QueryBatch(&targets[0], (uint32_t)targets.size(), prunedBatch);
+
+	for (uint32_t k = 0; k < targets.size(); k++) {
+		DynamicCollector collector(base, k, false);
+		root->Query(targets[k], collector);
+
+		std::set<uint32_t> expected;
+		for (uint32_t i = 0; i < nodes.size(); i++) {
+			if (TOverlap<Float3Pair>::Overlap(nodes[i].GetKey(), targets[k])) {
+				expected.insert(i);
+				CHECK(batch.pairs.count(std::make_pair(k, i)) == 1);
+			}
+		}
+
+		CHECK(collector.visited == expected);
+
+		DynamicCollector pruned(base, k, true);
+		root->Query(targets[k], pruned);
+		std::set<uint32_t> prunedExpected;
+		while (!prunedBatch.pairs.empty() && prunedBatch.pairs.begin()->first == k) {
+			prunedExpected.insert(prunedBatch.pairs.begin()->second);
+			prunedBatch.pairs.erase(prunedBatch.pairs.begin());
+		}
+
+		CHECK(pruned.visited == prunedExpected);
+	}
+
+	CHECK(prunedBatch.pairs.empty());
+}
+
+static void TestDynamicQuery() {
+	const uint32_t count = 3000;
+	std::vector<DynamicTree> nodes(count);
+	for (uint32_t i = 0; i < count; i++) {
+		nodes[i] = DynamicTree(RandomBox(100, 10), (uint8_t)(i % 6));
+		if (i != 0) {
+			nodes[0].Attach(&nodes[i]);
+		}
+	}
+
+	// some targets go left only, some right only and some both at each node, which exercises the right candidate marks
+	std::vector<Float3Pair> targets(256);
+	for (size_t k = 0; k < targets.size(); k++) {
+		targets[k] = RandomBox(100, k % 2 == 0 ? 5.0f : 60.0f);
+	}
+
+	CheckDynamicQuery(&nodes[0], nodes, targets);
+}
+
+// A left spine with a right leaf at each level. Queries overlapping everything keep one pending right leaf per level,
+// far more than QUERY_STACK_SIZE, so Query has to fall back to recursion.
+static void TestDynamicQueryDeep() {
+	const uint32_t levels = DynamicTree::QUERY_STACK_SIZE * 3;
+	std::vector<DynamicTree> nodes(levels * 2 + 1);
+	for (uint32_t i = 0; i < nodes.size(); i++) {
+		float x = 1000.0f - (float)((i + 1) / 2) + (i % 2 == 0 && i != 0 ? 0.5f : 0.0f);
+		nodes[i] = DynamicTree(Float3Pair(Float3(x, 0, 0), Float3(x + 0.25f, 1, 1)), 0);
+		if (i != 0) {
+			nodes[0].Attach(&nodes[i]);
+		}
+	}
+
+	uint32_t depth = 0;
+	for (DynamicTree* p = &nodes[nodes.size() - 2]; p->GetParent() != nullptr; p = p->GetParent()) {
+		depth++;
+	}
+
+	CHECK(depth == levels);
+
+	std::vector<Float3Pair> targets;
+	targets.push_back(Float3Pair(Float3(-1e4f, -1e4f, -1e4f), Float3(1e4f, 1e4f, 1e4f)));
+	for (int k = 0; k < 63; k++) {
+		float x = Random(1000.0f - levels, 1000.0f);
+		targets.push_back(Float3Pair(Float3(x, 0, 0), Float3(x + Random(0, 100), 1, 1)));
+	}
+
+	CheckDynamicQuery(&nodes[0], nodes, targets);
+}
+
+static uint32_t GetMaxDepth(std::vector<DynamicTree>& nodes, DynamicTree* root) {
+	uint32_t maxDepth = 0;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		uint32_t depth = 0;
+		DynamicTree* p = &nodes[i];
+		while (p->GetParent() != nullptr) {
+			p = p->GetParent();
+			depth++;
+		}
+
+		CHECK(p == root);
+		maxDepth = Math::Max(maxDepth, depth);
+	}
+
+	return maxDepth;
+}
+
+// Height bound of scapegoat trees with alpha = 2 / 3.
+static uint32_t GetBalancedHeight(uint32_t count) {
+	return (uint32_t)(log((double)count) / log(1.5));
+}
+
+static uint32_t GetPerfectHeight(uint32_t count) {
+	uint32_t height = 0;
+	while ((2u << height) <= count) {
+		height++;
+	}
+
+	return height;
+}
+
+struct AlternateSelector {
+	AlternateSelector() : toggle(false) {}
+	bool operator () (DynamicTree*, DynamicTree*) {
+		return toggle = !toggle;
+	}
+
+	bool toggle;
+};
+
+static void TestAttachBalanced() {
+	// sorted inserts degenerate into a list without balancing
+	const uint32_t count = 2000;
+	std::vector<DynamicTree> nodes(count);
+	for (uint32_t i = 0; i < count; i++) {
+		float x = (float)i;
+		nodes[i] = DynamicTree(Float3Pair(Float3(x, x, x), Float3(x + 0.5f, x + 0.5f, x + 0.5f)), (uint8_t)(i % 6));
+	}
+
+	DynamicTree* root = &nodes[0];
+	for (uint32_t i = 1; i < count; i++) {
+		root = root->AttachBalanced(&nodes[i], i + 1);
+		CHECK(root->GetParent() == nullptr);
+		if (i % 97 == 0) {
+			CHECK(root->GetWeight() == i + 1);
+		}
+	}
+
+	CHECK(root->GetWeight() == count);
+	CHECK(GetMaxDepth(nodes, root) <= GetBalancedHeight(count));
+
+	std::vector<Float3Pair> targets(64);
+	for (size_t k = 0; k < targets.size(); k++) {
+		float x = Random(-10, 2010);
+		targets[k] = Float3Pair(Float3(x - Random(0, 50), x - Random(0, 50), x - Random(0, 50)), Float3(x + Random(0, 50), x + Random(0, 50), x + Random(0, 50)));
+	}
+
+	CheckDynamicQuery(root, nodes, targets);
+}
+
+static void TestRebalance() {
+	// the spine tree of TestDynamicQueryDeep
+	const uint32_t count = 401;
+	std::vector<DynamicTree> nodes(count);
+	for (uint32_t i = 0; i < count; i++) {
+		float x = 1000.0f - (float)((i + 1) / 2) + (i % 2 == 0 && i != 0 ? 0.5f : 0.0f);
+		nodes[i] = DynamicTree(Float3Pair(Float3(x, Random(0, 10), 0), Float3(x + 0.25f, Random(10, 20), 1)), 0);
+		if (i != 0) {
+			nodes[0].Attach(&nodes[i]);
+		}
+	}
+
+	CHECK(GetMaxDepth(nodes, &nodes[0]) == count / 2 + 1);
+
+	std::vector<Float3Pair> targets(64);
+	for (size_t k = 0; k < targets.size(); k++) {
+		float x = Random(790, 1000);
+		targets[k] = Float3Pair(Float3(x, Random(0, 15), 0), Float3(x + Random(0, 20), Random(15, 30), 1));
+	}
+
+	// rebalance a subtree in place, the parent must link to its new root
+	DynamicTree* subtree = &nodes[41];
+	DynamicTree* parent = subtree->GetParent();
+	DynamicTree* subroot = subtree->Rebalance();
+	CHECK(subroot->GetParent() == parent);
+	CHECK(subroot->GetWeight() == count - 41);
+	CHECK(nodes[0].GetWeight() == count);
+	CHECK(GetMaxDepth(nodes, &nodes[0]) == 21 + GetPerfectHeight(count - 41));
+	CheckDynamicQuery(&nodes[0], nodes, targets);
+
+	// then the whole tree
+	DynamicTree* root = nodes[0].Rebalance();
+	CHECK(root->GetParent() == nullptr);
+	CHECK(root->GetWeight() == count);
+	CHECK(GetMaxDepth(nodes, root) == GetPerfectHeight(count));
+	CheckDynamicQuery(root, nodes, targets);
+}
+
+static void TestBalancedUpdateBatch() {
+	const uint32_t count = 1000;
+	std::vector<DynamicTree> nodes(count);
+	DynamicTree* root = &nodes[0];
+	for (uint32_t i = 0; i < count; i++) {
+		nodes[i] = DynamicTree(RandomBox(100, 10), (uint8_t)(i % 6));
+		if (i != 0) {
+			root = root->AttachBalanced(&nodes[i], i + 1);
+		}
+	}
+
+	std::vector<Float3Pair> targets(64);
+	AlternateSelector selector;
+	// small batches detach and reattach (n * 4 < count), large ones rebuild the whole tree
+	const uint32_t batches[] = { 1, 100, 249, 250, 1000 };
+	for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+		uint32_t n = batches[b];
+		std::vector<DynamicTree*> moved;
+		std::vector<Float3Pair> keys;
+		// the root is moved too
+		moved.push_back(root);
+		keys.push_back(RandomBox(100, 10));
+		for (uint32_t i = 0; moved.size() < n; i++) {
+			DynamicTree* node = &nodes[(i * 7 + b * 13) % count];
+			if (node != root) {
+				moved.push_back(node);
+				keys.push_back(RandomBox(100, 10));
+			}
+		}
+
+		root = root->UpdateBatch(&moved[0], &keys[0], n, count, selector);
+		CHECK(root->GetParent() == nullptr);
+		CHECK(root->GetWeight() == count);
+		for (uint32_t i = 0; i < n; i++) {
+			CHECK(memcmp(&moved[i]->GetKey(), &keys[i], sizeof(Float3Pair)) == 0);
+		}
+
+		uint32_t depth = GetMaxDepth(nodes, root);
+		CHECK(depth <= GetBalancedHeight(count));
+		if (n * 4 >= count) {
+			CHECK(depth == GetPerfectHeight(count));
+		}
+
+		for (size_t k = 0; k < targets.size(); k++) {
+			targets[k] = RandomBox(100, 40);
+		}
+
+		CheckDynamicQuery(root, nodes, targets);
+	}
+}
+
+static void TestSnapshotUpdateBatch() {
+	TSnapshotKdTree<Float3Pair> snapshot;
+	std::vector<uint32_t> handles;
+	for (uint32_t i = 0; i < 1000; i++) {
+		handles.push_back(snapshot.Insert(RandomBox(100, 10), i));
+	}
+
+	for (int round = 0; round < 8; round++) {
+		std::vector<uint32_t> updated;
+		std::vector<Float3Pair> keys;
+		for (size_t i = round; i < handles.size(); i += 3) {
+			updated.push_back(handles[i]);
+			keys.push_back(RandomBox(100, 10));
+		}
+
+		snapshot.UpdateBatch(&updated[0], &keys[0], (uint32_t)updated.size());
+		snapshot.Publish();
+
+		for (int k = 0; k < 16; k++) {
+			Float3Pair target = RandomBox(100, 40);
+			Collector collector;
+			snapshot.Query(target, collector);
+
+			std::set<uint32_t> expected;
+			for (uint32_t i = 0; i < handles.size(); i++) {
+				if (TOverlap<Float3Pair>::Overlap(snapshot.GetKey(handles[i]), target)) {
+					expected.insert(i);
+				}
+			}
+
+			CHECK(collector.values == expected);
+		}
+	}
+}
+
+// Every published version moves all keys to x = version and stores version as value,
+// so a reader must never see keys or values of different versions in one query.
+struct VersionChecker {
+	VersionChecker() : count(0), version(0), mixed(false) {}
+	bool operator () (const Float3Pair& key, uint32_t value) {
+		if (count++ == 0) {
+			version = value;
+		}
+
+		mixed = mixed || value != version || key.first.x() != (float)version;
+		// let the writer run in the middle of a query, also on a single core
+		if ((count & 63) == 0) {
+			std::this_thread::yield();
+		}
+
+		return true;
+	}
+
+	uint32_t count;
+	uint32_t version;
+	bool mixed;
+};
+
+static std::atomic<bool> readerStop;
+static std::atomic<bool> readerFailed;
+
+static void ReadSnapshots(TSnapshotKdTree<Float3Pair>* snapshot, uint32_t count) {
+	Float3Pair all(Float3(-1, -1, -1), Float3(1e6f, 1e6f, 1e6f));
+	while (!readerStop.load()) {
+		VersionChecker checker;
+		snapshot->Query(all, checker);
+		if (checker.mixed || (checker.count != count && checker.count != 0)) {
+			readerFailed.store(true);
+		}
+
+		std::this_thread::yield();
+	}
+}
+
+static void TestSnapshotConcurrency() {
+	const uint32_t count = 1000;
+	TSnapshotKdTree<Float3Pair> snapshot;
+	std::vector<uint32_t> handles;
+	for (uint32_t i = 0; i < count; i++) {
+		handles.push_back(snapshot.Insert(Float3Pair(Float3(0, (float)i, 0), Float3(0, (float)i + 0.5f, 1)), 0));
+	}
+
+	snapshot.Publish();
+	readerStop.store(false);
+	readerFailed.store(false);
+
+	std::vector<std::thread> readers;
+	for (int t = 0; t < 3; t++) {
+		readers.push_back(std::thread(ReadSnapshots, &snapshot, count));
+	}
+
+	std::vector<Float3Pair> keys(count);
+	for (uint32_t version = 1; version <= 200; version++) {
+		for (uint32_t i = 0; i < count; i++) {
+			keys[i] = snapshot.GetKey(handles[i]);
+			keys[i].first.x() = keys[i].second.x() = (float)version;
+			snapshot.GetValue(handles[i]) = version;
+		}
+
+		snapshot.UpdateBatch(&handles[0], &keys[0], count);
+		snapshot.Publish();
+		std::this_thread::yield();
+	}
+
+	readerStop.store(true);
+	for (size_t t = 0; t < readers.size(); t++) {
+		readers[t].join();
+	}
+
+	CHECK(!readerFailed.load());
+}
+
+int main() {
+	TestStaticQuery();
+	TestStaticCull();
+	TestStaticRay();
+	TestStaticBuildParallel();
+	TestNearest();
+	TestDynamicRay();
+	TestDynamicQuery();
+	TestDynamicQueryDeep();
+	TestAttachBalanced();
+	TestRebalance();
+	TestBalancedUpdateBatch();
+	TestSnapshotUpdateBatch();
+	TestSnapshotConcurrency();
+
+	printf("KdTreeTest passed.\n");
+	return 0;
+}
@@ -0,0 +1,135 @@
+// MatrixTest.cpp
+// Accuracy checks for batched Inverse and QuickInverse of 4x4 matrices.
+// Build from repository root: g++ -std=c++11 -O2 -I. Test/MatrixTest.cpp
+// Add -mavx2 to cover the 8-wide float and 4-wide double packs.
+// Exits with non-zero status on the first mismatch.
+//
+
+#include "../Interface/IType.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace PaintsNow;
+
+#define CHECK(f) \
+	if (!(f)) { \
+		printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #f); \
+		exit(1); \
+	}
+
+static const size_t MAX_COUNT = 40;
+static uint32_t seed = 1;
+
+static double Random(double lower, double upper) {
+	seed = seed * 1664525u + 1013904223u;
+	return lower + (upper - lower) * (double)(seed >> 8) / (double)(1 << 24);
+}
+
+// Rotation, non-uniform scale and translation, with shear added when not rigid.
+template <class T>
+static TMatrix<T, 4, 4> RandomMatrix(bool rigid) {
+	TType3<T> axis((T)Random(-1, 1), (T)Random(-1, 1), (T)Random(-1, 1) + (T)2);
+	T length = (T)sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+	TType4<T> rotation(axis[0] / length, axis[1] / length, axis[2] / length, (T)Random(-3, 3));
+	TType4<T> scale((T)Random(0.5, 4), (T)Random(0.5, 4), (T)Random(0.5, 4), (T)1);
+	TType3<T> translation((T)Random(-100, 100), (T)Random(-100, 100), (T)Random(-100, 100));
+
+	TMatrix<T, 4, 4> m = Math::MatrixScale(scale) * Math::MatrixRotate(rotation) * Math::MatrixTranslate(translation);
+	if (!rigid) {
+		for (size_t i = 0; i < 4; i++) {
+			for (size_t j = 0; j < 3; j++) {
+				m(i, j) += (T)Random(-0.25, 0.25);
+			}
+		}
+
+		// small enough against the translation to keep the determinant away from zero
+		m(0, 3) = (T)Random(-0.001, 0.001);
+		m(1, 3) = (T)Random(-0.001, 0.001);
+	}
+
+	return m;
+}
+
+template <class T>
+static double MaxElement(const TMatrix<T, 4, 4>& m) {
+	double value = 0;
+	for (size_t i = 0; i < 4; i++) {
+		for (size_t j = 0; j < 4; j++) {
+			value = Math::Max(value, fabs((double)m(i, j)));
+		}
+	}
+
+	return value;
+}
+
+// Largest element difference relative to the largest element of expected.
+template <class T>
+static double RelativeError(const TMatrix<T, 4, 4>& value, const TMatrix<T, 4, 4>& expected) {
+	double error = 0;
+	for (size_t i = 0; i < 4; i++) {
+		for (size_t j = 0; j < 4; j++) {
+			error = Math::Max(error, fabs((double)value(i, j) - (double)expected(i, j)));
+		}
+	}
+
+	return error / MaxElement(expected);
+}
+
+// Largest element of m * inverse - I, relative to the element magnitudes of both factors.
+template <class T>
+static double Residual(const TMatrix<T, 4, 4>& m, const TMatrix<T, 4, 4>& inverse) {
+	return RelativeError(m * inverse, TMatrix<T, 4, 4>::Identity()) / (MaxElement(m) * MaxElement(inverse));
+}
+
+template <class T>
+static void CheckBatch(bool quick, double tolerance) {
+	for (size_t count = 0; count < MAX_COUNT; count++) {
+		std::vector<TMatrix<T, 4, 4> > in(count + 1);
+		std::vector<TMatrix<T, 4, 4> > out(count + 1);
+		for (size_t i = 0; i < count; i++) {
+			in[i] = RandomMatrix<T>(quick);
+		}
+
+		// the batch must not write past count
+		TMatrix<T, 4, 4> guard = RandomMatrix<T>(false);
+		out[count] = guard;
+
+		if (quick) {
+			Math::QuickInverse(&in[0], &out[0], count);
+		} else {
+			Math::Inverse(&in[0], &out[0], count);
+		}
+
+		CHECK(out[count] == guard);
+
+		for (size_t i = 0; i < count; i++) {
+			TMatrix<T, 4, 4> single = quick ? Math::QuickInverse(in[i]) : Math::Inverse(in[i]);
+			CHECK(RelativeError(out[i], single) < tolerance);
+			CHECK(Residual(in[i], out[i]) < tolerance);
+		}
+
+		// in place
+		std::vector<TMatrix<T, 4, 4> > inplace(in);
+		if (quick) {
+			Math::QuickInverse(&inplace[0], &inplace[0], count);
+		} else {
+			Math::Inverse(&inplace[0], &inplace[0], count);
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			CHECK(inplace[i] == out[i]);
+		}
+	}
+}
+
+int main() {
+	CheckBatch<float>(false, 1e-5);
+	CheckBatch<float>(true, 1e-5);
+	CheckBatch<double>(false, 1e-12);
+	CheckBatch<double>(true, 1e-12);
+
+	printf("MatrixTest passed.\n");
+	return 0;
+}